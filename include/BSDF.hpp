@@ -1,7 +1,8 @@
 #pragma once
 #include "PnRT.hpp"
+#include "sampler.hpp"
 
-// ߿ռ½еλ
+// 在切线空间下进行单位半球采样
 inline glm::vec3 UniformSampleHemisphere(const glm::vec2& u) {
     float z = u[0];
     float r = std::sqrt(std::max(0.f, 1.f - z * z));
@@ -11,15 +12,210 @@ inline glm::vec3 UniformSampleHemisphere(const glm::vec2& u) {
 
 inline glm::vec3 DiffuseBRDF(const glm::vec3& n, const glm::vec3& wo, 
     const Material& m, glm::vec3 *wi, float* pdf) {
-    glm::vec3 t; // 
+    glm::vec3 t; // 切线
     if (n.z > 0.9999995f) t = glm::vec3(1.f, 0.f, 0.f);
     else t = glm::normalize(glm::cross(n, wo));
-    glm::vec3 b = glm::cross(n, t); // 
+    glm::vec3 b = glm::cross(n, t); // 次切线
     *wi = UniformSampleHemisphere(glm::vec2(Rand0To1(), Rand0To1()));
     *pdf = InvPI;
-    // ߿ռתΪռ
+    // 从切线空间转为世界空间
     *wi = glm::vec3(t[0] * (*wi)[0] + t[1] * (*wi)[1] + t[2] * (*wi)[2],
                     b[0] * (*wi)[0] + b[1] * (*wi)[1] + b[2] * (*wi)[2],
                     n[0] * (*wi)[0] + n[1] * (*wi)[1] + n[2] * (*wi)[2]);
     return m.baseColor * InvPI;
-}
\ No newline at end of file
+}
+
+/*
+	以下与ray_tracing.comp中的DisneyBRDF及其重要性采样逐行对应，CPU渲染器以此作为GPU结果的参照
+	着色器中调用Rand0To1()的地方改为使用传入的种子
+*/
+
+inline float Sqr(float x) { return x * x; }
+
+inline float Mix(float x, float y, float a) { return x * (1.f - a) + y * a; }
+
+// 根据法线建立切线空间
+inline void BuildTangentSpace(const glm::vec3& n, glm::vec3* t, glm::vec3* b) {
+	// 切线
+	if (n.z > 0.9999995f) *t = glm::vec3(1.f, 0.f, 0.f);
+	else *t = glm::normalize(glm::cross(n, glm::vec3(0.f, 0.f, 1.f)));
+	*b = glm::cross(n, *t); // 次切线
+}
+
+// 向量v从切线空间转到世界空间
+inline glm::vec3 TangentToWorld(const glm::vec3& t, const glm::vec3& b, const glm::vec3& n, const glm::vec3& v) {
+	return v.x * t + v.y * b + v.z * n;
+}
+
+// 余弦加权半球采样
+inline glm::vec3 SampleCosineHemisphere(const glm::vec3& n, const glm::vec3& t, const glm::vec3& b, uint32_t& seed) {
+	float theta = Rand0To1(seed), r = Rand0To1(seed);
+	float x = r * std::sin(theta), y = r * std::cos(theta);
+	float z = std::sqrt(1 - Sqr(x) - Sqr(y));
+	return TangentToWorld(t, b, n, glm::vec3(x, y, z));
+}
+
+inline float SchlickFresnel(float u) {
+	float m = Clamp(1 - u, 0, 1);
+	float m2 = m * m;
+	return m2 * m2 * m; // pow(m,5)
+}
+
+inline float GTR1(float NdotH, float a) {
+	if (a >= 1) return InvPI;
+	float a2 = a * a;
+	float t = 1 + (a2 - 1) * NdotH * NdotH;
+	return (a2 - 1) / (PI * std::log(a2) * t);
+}
+
+inline float GTR2(float NdotH, float a) {
+	float a2 = a * a;
+	float t = 1 + (a2 - 1) * NdotH * NdotH;
+	return a2 / (PI * t * t);
+}
+
+inline float GTR2Aniso(float NdotH, float HdotX, float HdotY, float ax, float ay) {
+	return 1 / (PI * ax * ay * Sqr(Sqr(HdotX / ax) + Sqr(HdotY / ay) + NdotH * NdotH));
+}
+
+inline float SmithGGGX(float NdotV, float alphaG) {
+	float a = alphaG * alphaG;
+	float b = NdotV * NdotV;
+	return 1 / (NdotV + std::sqrt(a + b - a * b));
+}
+
+inline float SmithGGGXAniso(float NdotV, float VdotX, float VdotY, float ax, float ay) {
+	return 1 / (NdotV + std::sqrt(Sqr(VdotX * ax) + Sqr(VdotY * ay) + Sqr(NdotV)));
+}
+
+// DisneyBRDF镜面反射重要性采样
+inline glm::vec3 SampleGTR2(const glm::vec3& n, const glm::vec3& t, const glm::vec3& b, const glm::vec3& v,
+	float r1, float r2, float alpha) {
+	float phiH = 2.f * PI * r1;
+	float cosThetaH = std::sqrt((1.f - r2) / (1.f + (alpha * alpha - 1.f) * r2));
+	float sinThetaH = std::max(0.f, 1.f - Sqr(cosThetaH));
+	float sinPhiH = std::sin(phiH), cosPhiH = 1.f - Sqr(sinPhiH);
+	glm::vec3 h = glm::vec3(sinThetaH * cosPhiH, sinThetaH * sinPhiH, cosThetaH);
+	h = TangentToWorld(t, b, n, h);
+	return 2 * glm::dot(v, h) * h - v;
+}
+
+// DisneyBRDF清漆重要性采样
+inline glm::vec3 SampleGTR1(const glm::vec3& n, const glm::vec3& t, const glm::vec3& b, const glm::vec3& v,
+	float r1, float r2, float alpha) {
+	float phiH = 2.f * PI * r1;
+	float cosThetaH = std::sqrt((1.f - std::pow(alpha * alpha, 1.f - r2)) / (1.f - alpha * alpha));
+	float sinThetaH = std::max(0.f, 1.f - Sqr(cosThetaH));
+	float sinPhiH = std::sin(phiH), cosPhiH = 1.f - Sqr(sinPhiH);
+	glm::vec3 h = glm::vec3(sinThetaH * cosPhiH, sinThetaH * sinPhiH, cosThetaH);
+	h = TangentToWorld(t, b, n, h);
+	return 2 * glm::dot(v, h) * h - v;
+}
+
+// 出射方向L在三种BRDF项采样下的概率密度按能量贡献加权平均
+inline float SampleDisneyPDF(const glm::vec3& V, const glm::vec3& N, const glm::vec3& L, const Material& material) {
+	float rDiffuse = (1.f - material.metallic);
+	float rSpecular = 1.f;
+	float rClearcoat = 0.25f * material.clearcoat;
+	float invSum = 1.f / (rDiffuse + rSpecular + rClearcoat);
+
+	float pDiffuse = rDiffuse * invSum;
+	float pSpecular = rSpecular * invSum;
+	float pClearcoat = rClearcoat * invSum;
+	float alphaGTR1 = Mix(0.1f, 0.001f, material.clearcoatGloss);
+	float alphaGTR2 = std::max(0.001f, Sqr(material.roughness));
+
+	glm::vec3 H = glm::normalize(L + V);
+	float LdotH = glm::dot(L, H);
+	float NdotH = glm::dot(N, H);
+	float NdotL = glm::dot(N, L);
+
+	float pdfDiffuse = NdotL * InvPI;
+	float pdfSpecular = GTR2(NdotH, alphaGTR2) * NdotH / (4.f * LdotH);
+	float pdfClearcoat = GTR1(NdotH, alphaGTR1) * NdotH / (4.f * LdotH);
+
+	return pDiffuse * pdfDiffuse + pSpecular * pdfSpecular + pClearcoat * pdfClearcoat;
+}
+
+// DisneyBRDF重要性采样：根据漫反射、镜面反射、清漆三项的能量贡献随机选取一项采样
+inline glm::vec3 SampleDisneyBRDF(const glm::vec3& V, const glm::vec3& N, const glm::vec3& T, const glm::vec3& B,
+	const Material& material, float r1, float r2, uint32_t& seed, float* pdf) {
+	float rDiffuse = (1.f - material.metallic);
+	float rSpecular = 1.f;
+	float rClearcoat = 0.25f * material.clearcoat;
+	float invSum = 1.f / (rDiffuse + rSpecular + rClearcoat);
+
+	float pDiffuse = rDiffuse * invSum;
+	float pSpecular = rSpecular * invSum;
+
+	float r = Rand0To1(seed);
+
+	float alphaGTR1 = Mix(0.1f, 0.001f, material.clearcoatGloss);
+	float alphaGTR2 = std::max(0.001f, Sqr(material.roughness));
+
+	glm::vec3 L;
+	if (r <= pDiffuse) {
+		L = SampleCosineHemisphere(N, T, B, seed);
+	} else if (r <= pDiffuse + pSpecular) {
+		L = SampleGTR2(N, T, B, V, r1, r2, alphaGTR2);
+	} else {
+		L = SampleGTR1(N, T, B, V, r1, r2, alphaGTR1);
+	}
+	*pdf = SampleDisneyPDF(V, N, L, material);
+	return L;
+}
+
+inline glm::vec3 DisneyBRDF(const glm::vec3& V, const glm::vec3& N, const glm::vec3& L,
+	const glm::vec3& X, const glm::vec3& Y, const Material& material) {
+	float NdotL = glm::dot(N, L);
+	float NdotV = glm::dot(N, V);
+	if (NdotL < 0 || NdotV < 0) return glm::vec3(0);
+
+	glm::vec3 H = glm::normalize(L + V);
+	float NdotH = glm::dot(N, H);
+	float LdotH = glm::dot(L, H);
+
+	// 各种颜色
+	glm::vec3 Cdlin = material.baseColor;
+	float Cdlum = 0.3f * Cdlin.r + 0.6f * Cdlin.g + 0.1f * Cdlin.b;
+	glm::vec3 Ctint = (Cdlum > 0) ? (Cdlin / Cdlum) : (glm::vec3(1));
+	glm::vec3 Cspec = material.specular * glm::mix(glm::vec3(1), Ctint, material.specularTint);
+	glm::vec3 Cspec0 = glm::mix(0.08f * Cspec, Cdlin, material.metallic); // 0° 镜面反射颜色
+	glm::vec3 Csheen = glm::mix(glm::vec3(1), Ctint, material.sheenTint); // 织物颜色
+
+	// 漫反射
+	float Fd90 = 0.5f + 2.f * LdotH * LdotH * material.roughness;
+	float FL = SchlickFresnel(NdotL);
+	float FV = SchlickFresnel(NdotV);
+	float Fd = Mix(1.f, Fd90, FL) * Mix(1.f, Fd90, FV);
+
+	// 次表面散射
+	float Fss90 = LdotH * LdotH * material.roughness;
+	float Fss = Mix(1.f, Fss90, FL) * Mix(1.f, Fss90, FV);
+	float ss = 1.25f * (Fss * (1.f / (NdotL + NdotV) - 0.5f) + 0.5f);
+
+	// 镜面反射 -- 各向异性
+	float aspect = std::sqrt(1.f - material.anisotropic * 0.9f);
+	float ax = std::max(0.001f, Sqr(material.roughness) / aspect);
+	float ay = std::max(0.001f, Sqr(material.roughness) * aspect);
+	float Ds = GTR2Aniso(NdotH, glm::dot(H, X), glm::dot(H, Y), ax, ay);
+	float FH = SchlickFresnel(LdotH);
+	glm::vec3 Fs = glm::mix(Cspec0, glm::vec3(1), FH);
+	float Gs;
+	Gs = SmithGGGXAniso(NdotL, glm::dot(L, X), glm::dot(L, Y), ax, ay);
+	Gs *= SmithGGGXAniso(NdotV, glm::dot(V, X), glm::dot(V, Y), ax, ay);
+
+	// 清漆
+	float Dr = GTR1(NdotH, Mix(0.1f, 0.001f, material.clearcoatGloss));
+	float Fr = Mix(0.04f, 1.f, FH);
+	float Gr = SmithGGGX(NdotL, 0.25f) * SmithGGGX(NdotV, 0.25f);
+
+	// sheen
+	glm::vec3 Fsheen = FH * material.sheen * Csheen;
+
+	glm::vec3 diffuse = InvPI * Mix(Fd, ss, material.subsurface) * Cdlin + Fsheen;
+	glm::vec3 specular = Gs * Fs * Ds;
+	glm::vec3 clearcoat = glm::vec3(0.25f * Gr * Fr * Dr * material.clearcoat);
+
+	return diffuse * (1.f - material.metallic) + specular + clearcoat;
+}
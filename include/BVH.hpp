@@ -2,6 +2,10 @@
 #include "PnRT.hpp"
 #include "bound.hpp"
 #include "triangle.hpp"
+#include "parallel.hpp"
+#include "morton.hpp"
+#include "RayPacket.hpp"
+#include "TraversalQuery.hpp"
 
 struct BVHNode {
 	Bound bound;
@@ -11,171 +15,1776 @@ struct BVHNode {
 	int endIndex;
 };
 
+/*
+	CPU求交使用的宽BVH节点：由二叉树的若干层合并而成，最多WIDE_BVH_WIDTH个儿子
+	儿子的包围盒按分量连续存储(SoA)，一次SIMD运算即可与所有儿子的包围盒求交
+	编译时启用AVX则为8叉，否则使用SSE的4叉
+*/
+#ifdef __AVX__
+constexpr int WIDE_BVH_WIDTH = 8;
+#else
+constexpr int WIDE_BVH_WIDTH = 4;
+#endif
+
+struct WideBVHNode {
+	float boundMin[3][WIDE_BVH_WIDTH];
+	float boundMax[3][WIDE_BVH_WIDTH];
+	// >= 0：宽节点编号；-1：空；<= -2：叶子，-2 - children为叶子在二叉树bvh中的编号
+	int children[WIDE_BVH_WIDTH];
+};
+
+enum class BVHBuildMethod {
+	SAH, // 分桶SAH构建，质量高，用于最终渲染
+	Linear // 按Morton码排序的LBVH，构建速度快，用于模型移动后的快速重建
+};
+
+struct BVHSetting {
+	BVHBuildMethod method = BVHBuildMethod::SAH;
+	int mortonBits = 30; // LBVH的Morton码位数：30（每个轴10位）或63（每个轴21位）
+	int nBuckets = 12; // 每个轴上SAH分桶的数量，最多为64
+	int maxTrianglesInLeaf = 255;
+	float trav = 1.f; // 访问一个内部节点相对于一次三角形求交的代价
+	// 空间划分(SBVH)：允许三角形跨越划分平面时被裁剪后同时放入左右儿子，减少大三角形造成的包围盒重叠
+	bool spatialSplit = false;
+	float splitBudget = 0.3f; // 空间划分最多额外产生的三角形引用数，与三角形总数之比
+	float splitAlpha = 1e-5f; // 物体划分的左右包围盒重叠面积与根节点表面积之比超过该值时才尝试空间划分
+	float rebuildRatio = 1.5f; // Refit后SAH代价超过构建时的该倍数，认为树的质量下降需要重新构建
+	// 构建后的树重构优化：静态场景可以用更长的构建时间换取更低的遍历代价
+	int optimizePasses = 0; // 优化的遍数，0为不优化
+	int treeletSize = 7; // 每次重构的treelet叶子数，3到8之间
+	bool buildWide = true; // 为CPU求交额外构建SIMD宽BVH，GPU仍使用二叉树
+	// 二叉树最近交点遍历先访问进入时刻较小的儿子，并跳过进入时刻已超过最近交点的节点；宽BVH总是按进入时刻排序
+	bool orderedTraversal = false;
+};
+
+// 连续的编号区间[begin, end)
+struct IndexRange {
+	int begin = 0, end = 0;
+};
+
+// 按升序追加区间，与上一个区间相接时合并
+inline void AppendRange(std::vector<IndexRange>* ranges, int begin, int end) {
+	if (!ranges->empty() && ranges->back().end == begin) ranges->back().end = end;
+	else ranges->push_back({ begin, end });
+}
+
+struct BVHRefitResult {
+	std::vector<IndexRange> dirtyRuns; // 包围盒发生变化的节点，按编号升序，一般是移动的子树及其祖先
+	float sahCost = 0.f;
+	bool needRebuild = false;
+};
+
+// 求交时的统计，传入Intersect后累加
+struct TraversalStats {
+	int64_t nodeVisits = 0; // 访问的节点数，宽BVH中为宽节点与叶子数
+	int64_t triangleTests = 0; // 三角形求交次数
+};
+
+/*
+	阴影射线的遮挡缓存：每个槽位（一般对应一个灯光）记录上一条被遮挡的阴影射线击中的三角形
+	指向同一灯光的相邻阴影射线往往被同一个三角形遮挡，先与该三角形求交，没有遮挡时再遍历BVH
+	缓存不加锁，每个线程或图像块使用各自的缓存；BVH重建后三角形编号改变，需要重新创建缓存
+*/
+struct OcclusionCache {
+	struct Occluder {
+		int instance = -1; // 两层加速结构中三角形所在的实例
+		int triangle = -1;
+	};
+
+	explicit OcclusionCache(int nSlots = 0) : occluders(nSlots) {}
+
+	float HitRate() const {
+		return queries ? (float)hits / queries : 0.f;
+	}
+
+	std::vector<Occluder> occluders;
+	int64_t queries = 0; // 使用缓存的相交测试次数
+	int64_t hits = 0; // 被缓存的三角形遮挡、不需要遍历的次数
+};
+
+struct BVHOptimizeResult {
+	float sahBefore = 0.f, sahAfter = 0.f;
+	int restructured = 0; // 拓扑被改变的treelet个数
+};
+
 class BVH {
 public:
-	BVH(const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles)
-		: vertices(vertices), triangles(triangles) {
-		BuildBVH(0, triangles.size());
+	BVH(const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles,
+		const BVHSetting& setting = BVHSetting())
+		: vertices(vertices), triangles(triangles), setting(setting) {
+		this->setting.nBuckets = std::min(std::max(setting.nBuckets, 2), (int)MAX_BUCKETS);
+		this->setting.mortonBits = setting.mortonBits > 30 ? 63 : 30;
+		this->setting.treeletSize = std::min(std::max(setting.treeletSize, 3), (int)MAX_TREELET_SIZE);
+		Build();
+		if (this->setting.optimizePasses > 0) optimizeResult = Optimize(this->setting.optimizePasses);
+		buildCost = SAHCost();
+		BuildTriangleBlocks();
+		if (this->setting.buildWide) CollapseWide();
+	}
+
+	// 直接使用已经构建好的节点与重排后的三角形（如从场景缓存中读取），不再重新构建
+	BVH(const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles, const std::vector<BVHNode>& bvh,
+		const BVHSetting& setting = BVHSetting())
+		: vertices(vertices), triangles(triangles), bvh(bvh), setting(setting) {
+		nodeCount = bvh.size();
+		buildCost = SAHCost();
+		optimizeResult.sahBefore = optimizeResult.sahAfter = buildCost;
+		BuildTriangleBlocks();
+		if (this->setting.buildWide) CollapseWide();
+	}
+
+	/*
+		顶点位置改变后（模型移动或形变）保持树的拓扑不变，自底向上重新计算三角形与节点的包围盒
+		只有引用了[vertexBegin, vertexEnd)中顶点的叶子重新计算三角形与三角形块，宽BVH只更新包围盒改变的儿子
+		空间划分得到的叶子使用完整三角形的包围盒，结果仍然正确但不再紧凑
+	*/
+	BVHRefitResult Refit(int vertexBegin = 0, int vertexEnd = std::numeric_limits<int>::max()) {
+		BVHRefitResult result;
+		if (bvh.empty()) return result;
+		RefitNode(0, nodeCount, vertexBegin, vertexEnd, &result.dirtyRuns);
+		result.sahCost = SAHCost();
+		result.needRebuild = result.sahCost > buildCost * setting.rebuildRatio;
+		return result;
+	}
+
+	/*
+		treelet重构：以每个内部节点为根，反复展开表面积最大的后代，得到treeletSize个treelet叶子
+		用动态规划在这些叶子的所有子集上求出SAH代价最小的二叉树拓扑，代价更低时复用原有的内部节点替换
+		自底向上处理，不相交的子树并行，叶子节点不变，最后按先序重新展开节点和三角形，保持左儿子紧跟父节点的布局
+	*/
+	BVHOptimizeResult Optimize(int nPasses) {
+		BVHOptimizeResult result;
+		result.sahBefore = result.sahAfter = SAHCost();
+		if (nodeCount < 3) return result;
+		optNodes.assign(nodeCount, OptNode());
+		InitOptNode(0, nodeCount);
+		for (int pass = 0; pass < nPasses; ++pass) {
+			std::atomic<int> restructured{ 0 };
+			OptimizeNode(0, &restructured);
+			result.restructured += restructured;
+			if (restructured == 0) break;
+		}
+		std::vector<BVHNode> nodes(nodeCount);
+		std::vector<Triangle> refTriangles(triangles.size());
+		FlattenOptNode(0, 0, 0, nodes, refTriangles);
+		bvh.swap(nodes);
+		triangles.swap(refTriangles);
+		optNodes.clear();
+		optNodes.shrink_to_fit();
+		result.sahAfter = SAHCost();
+		BuildTriangleBlocks();
+		if (!wideNodes.empty()) CollapseWide();
+		return result;
+	}
+
+	// 整棵树的SAH代价：内部节点按访问代价、叶子节点按三角形个数，以表面积与根节点表面积之比加权
+	float SAHCost() const {
+		if (bvh.empty()) return 0.f;
+		float rootArea = bvh[0].bound.SurfaceArea();
+		double cost = 0.0;
+		for (const auto& node : bvh) {
+			float area = node.bound.SurfaceArea() / rootArea;
+			if (node.rightChild == -1) cost += area * (node.endIndex - node.startIndex);
+			else cost += area * setting.trav;
+		}
+		return (float)cost;
+	}
+
+	bool Intersect(const Ray& r, Interaction* isect, TraversalStats* stats = nullptr) const {
+		TriangleHit hit;
+		if (!IntersectHit(r, &hit, stats)) return false;
+		SurfaceInteraction(hit, r, isect);
+		return true;
+	}
+
+	/*
+		最近交点求交：遍历中只记录交点的三角形编号、距离与重心坐标，不计算表面信息
+		需要法线、纹理坐标时再对结果调用SurfaceInteraction，每条光线只计算一次
+	*/
+	bool IntersectHit(const Ray& r, TriangleHit* hit, TraversalStats* stats = nullptr) const {
+		ClosestHitQuery query;
+		Traverse(r, &query, stats);
+		*hit = query.hit;
+		return hit->triangle != -1;
+	}
+
+	/*
+		所有交点：对光线范围内的每个交点调用onHit(const TriangleHit&)，顺序不确定，onHit返回false时停止
+		空间划分的BVH中同一个三角形可能在多个叶子中被击中，需要时由调用者按primitiveId去重
+	*/
+	template <typename F>
+	void IntersectAll(const Ray& r, const F& onHit, TraversalStats* stats = nullptr) const {
+		AllHitsQuery<F> query(onHit);
+		Traverse(r, &query, stats);
+	}
+
+	// 最近的K个交点，按距离从近到远写入hits，返回交点个数
+	template <int K>
+	int IntersectNearest(const Ray& r, TriangleHit* hits, TraversalStats* stats = nullptr) const {
+		NearestHitsQuery<K> query(setting.spatialSplit ? triangles.data() : nullptr);
+		Traverse(r, &query, stats);
+		for (int i = 0; i < query.nHits; ++i) hits[i] = query.hits[i];
+		return query.nHits;
+	}
+
+	/*
+		以查询策略Query遍历BVH，叶子中的三角形块交给query->Block处理，见TraversalQuery.hpp
+		构建了宽BVH时遍历宽BVH；否则需要排序的查询在启用orderedTraversal时按距离排序，其余按光线方向的符号决定儿子的顺序
+		query->Block返回false而提前结束时返回false
+	*/
+	template <typename Query>
+	bool Traverse(const Ray& r, Query* query, TraversalStats* stats = nullptr) const {
+		if (!wideNodes.empty()) return WideTraverse(r, query, stats);
+		if (Query::SORT_CHILDREN && setting.orderedTraversal) return OrderedTraverse(r, query, stats);
+		return BinaryTraverse(r, query, stats);
+	}
+
+	// 由IntersectHit的结果计算交点的表面信息
+	void SurfaceInteraction(const TriangleHit& hit, const Ray& r, Interaction* isect) const {
+		TriangleInteraction(triangles[hit.triangle], r.dir, hit.t, hit.b0, hit.b1, hit.b2, vertices, isect);
+	}
+
+	// 只进行相交测试，不返回Interaction信息
+	bool IntersectP(const Ray& r, TraversalStats* stats = nullptr) const {
+		return FindOccluder(r, stats) != -1;
+	}
+
+	// 先与缓存中slot槽位的三角形求交，未被其遮挡时再遍历，并把找到的遮挡三角形写入缓存
+	bool IntersectP(const Ray& r, OcclusionCache* cache, int slot, TraversalStats* stats = nullptr) const {
+		OcclusionCache::Occluder& occluder = cache->occluders[slot];
+		++cache->queries;
+		if (occluder.triangle != -1) {
+			if (stats) ++stats->triangleTests;
+			/*
+				与遍历相同，先测试三角形的包围盒，结果与不使用缓存时一致
+				否则终点附近的三角形（如阴影射线指向的灯光本身）可能在包围盒测试中被剔除，却被三角形求交的误差接受
+			*/
+			const Triangle& tri = triangles[occluder.triangle];
+			if (BoundIntersect(tri.bound, TraversalRay(r), r.tMax) && TriangleIntersectP(tri, r, vertices)) {
+				++cache->hits;
+				return true;
+			}
+		}
+		int triangle = FindOccluder(r, stats);
+		if (triangle == -1) return false;
+		occluder.triangle = triangle;
+		return true;
+	}
+
+	// 相交测试，返回遮挡光线的任意一个三角形的编号，没有遮挡时返回-1
+	int FindOccluder(const Ray& r, TraversalStats* stats = nullptr) const {
+		AnyHitQuery query;
+		Traverse(r, &query, stats);
+		return query.hit.triangle;
+	}
+
+	/*
+		光线包求交：activeMask中的光线在二叉树bvh上一起遍历，返回击中的光线的位掩码
+		击中的光线的tMax缩短为交点距离，isects[i]为第i条光线的交点，只在最终交点上计算表面信息
+		方向一致的光线（主光线、指向同一灯光的阴影射线）访问的节点基本相同，一次节点访问由8条光线分摊
+	*/
+	int IntersectPacket(RayPacket& packet, int activeMask, Interaction* isects, TraversalStats* stats = nullptr) const {
+		TriangleHit hits[RAY_PACKET_SIZE];
+		int hitMask = IntersectPacketHits(packet, activeMask, hits, stats);
+		for (int mask = hitMask; mask; mask &= mask - 1) {
+			int i = BitIndex(mask);
+			SurfaceInteraction(hits[i], packet.Get(i), &isects[i]);
+		}
+		return hitMask;
+	}
+
+	// 与IntersectPacket相同，只记录每条光线交点的三角形编号、距离与重心坐标，不计算表面信息
+	int IntersectPacketHits(RayPacket& packet, int activeMask, TriangleHit* hits, TraversalStats* stats = nullptr) const {
+		alignas(32) float hitTime[RAY_PACKET_SIZE], hitB0[RAY_PACKET_SIZE], hitB1[RAY_PACKET_SIZE], hitB2[RAY_PACKET_SIZE];
+		int hitTriangle[RAY_PACKET_SIZE];
+		int hitMask = PacketTraverse<false>(packet, activeMask, hitTime, hitB0, hitB1, hitB2, hitTriangle, stats);
+		for (int mask = hitMask; mask; mask &= mask - 1) {
+			int i = BitIndex(mask);
+			hits[i].triangle = hitTriangle[i];
+			hits[i].t = hitTime[i];
+			hits[i].b0 = hitB0[i];
+			hits[i].b1 = hitB1[i];
+			hits[i].b2 = hitB2[i];
+			packet.tMax[i] = hitTime[i];
+		}
+		return hitMask;
+	}
+
+	// 光线包相交测试，返回被遮挡的光线的位掩码，所有光线都被遮挡时立即返回
+	int OccludedPacket(const RayPacket& packet, int activeMask, TraversalStats* stats = nullptr) const {
+		return PacketTraverse<true>(packet, activeMask, nullptr, nullptr, nullptr, nullptr, nullptr, stats);
+	}
+
+	// CPU求交使用的宽BVH节点数，没有构建宽BVH时为0
+	int WideNodeCount() const {
+		return wideNodes.size();
+	}
+
+	// 叶子三角形块的个数，每个叶子的三角形从新的块开始，块数不少于三角形数 / TRIANGLE_BLOCK_SIZE
+	int TriangleBlockCount() const {
+		return triangleBlocks.size();
+	}
+private:
+	struct Bucket {
+		SIMDBound bound;
+		int nTriangles = 0;
+	};
+	static constexpr int MAX_BUCKETS = 64;
+	static constexpr int BUCKET_MIN = 8;
+	// 三个轴的桶，构造时不初始化，由Reset只初始化实际使用的前nBuckets个桶
+	union BucketArray {
+		BucketArray() {}
+		void Reset(int nBuckets) {
+			for (int d = 0; d < 3; ++d)
+				for (int i = 0; i < nBuckets; ++i)
+					new (&buc[d][i]) Bucket();
+		}
+		Bucket buc[3][MAX_BUCKETS];
+	};
+
+	// 构建阶段使用的指针形式节点，构建完成后再展开为线性的bvh数组
+	struct BVHBuildNode {
+		Bound bound;
+		int axis = -1;
+		int startIndex = 0;
+		int endIndex = 0;
+		int nNodes = 1; // 以该节点为根的子树节点个数
+		int nRefs = 0; // 以该节点为根的子树中三角形引用的个数
+		const int* refs = nullptr; // 空间划分时叶子节点引用的三角形编号
+		BVHBuildNode* children[2] = { nullptr, nullptr };
+	};
+	struct BuildArena {
+		std::deque<BVHBuildNode> nodes;
+		std::deque<std::vector<int>> leafRefs;
+	};
+
+	// 空间划分构建时的三角形引用，包围盒为三角形被裁剪到当前节点内的部分
+	struct Reference {
+		int id;
+		Bound bound;
+		glm::vec3 boundCenter;
+	};
+	struct SpatialBin {
+		SIMDBound bound;
+		int enter = 0, exit = 0;
+	};
+	// 空间划分使树变深，超过该深度不再进行空间划分，保证遍历时128的栈足够使用
+	static constexpr int MAX_SPATIAL_DEPTH = 64;
+
+	// 三角形数量超过该值的节点，其右子树作为任务交给线程池构建
+	static constexpr int PARALLEL_BUILD_THRESHOLD = 4096;
+
+	/*
+		从二叉树合并出宽BVH：每个宽节点从二叉节点的两个儿子开始，反复展开表面积最大的内部节点直到儿子数达到宽度
+		二叉树改变（Refit、Optimize）后重新合并
+	*/
+	void CollapseWide() {
+		wideNodes.clear();
+		wideSlots.assign(bvh.size(), -1);
+		if (bvh.empty()) return;
+		wideNodes.reserve(nodeCount / (WIDE_BVH_WIDTH - 1) + 1);
+		CollapseWideNode(0);
+	}
+
+	int CollapseWideNode(int binaryId) {
+		int wideId = wideNodes.size();
+		wideNodes.emplace_back();
+		int slots[WIDE_BVH_WIDTH], nSlots = 0;
+		const BVHNode& root = bvh[binaryId];
+		if (root.rightChild == -1) { // 整棵树只有一个叶子
+			slots[nSlots++] = binaryId;
+		} else {
+			slots[nSlots++] = binaryId + 1;
+			slots[nSlots++] = root.rightChild;
+		}
+		while (nSlots < WIDE_BVH_WIDTH) {
+			int best = -1;
+			float bestArea = -1.f;
+			for (int i = 0; i < nSlots; ++i) {
+				const BVHNode& node = bvh[slots[i]];
+				if (node.rightChild == -1) continue;
+				float area = node.bound.SurfaceArea();
+				if (area > bestArea) {
+					bestArea = area;
+					best = i;
+				}
+			}
+			if (best == -1) break;
+			// 展开的两个儿子保持相邻，宽节点中的儿子仍大致按空间顺序排列
+			int id = slots[best];
+			for (int i = nSlots; i > best + 1; --i) slots[i] = slots[i - 1];
+			slots[best] = id + 1;
+			slots[best + 1] = bvh[id].rightChild;
+			++nSlots;
+		}
+		int children[WIDE_BVH_WIDTH];
+		for (int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+			if (i >= nSlots) children[i] = -1;
+			else if (bvh[slots[i]].rightChild == -1) children[i] = -2 - slots[i];
+			else children[i] = CollapseWideNode(slots[i]);
+		}
+		// 递归时wideNodes可能扩容，最后再写入当前节点
+		WideBVHNode& node = wideNodes[wideId];
+		for (int i = 0; i < nSlots; ++i) wideSlots[slots[i]] = wideId * WIDE_BVH_WIDTH + i;
+		for (int i = 0; i < WIDE_BVH_WIDTH; ++i) {
+			node.children[i] = children[i];
+			for (int axis = 0; axis < 3; ++axis) {
+				// 空儿子使用反向的包围盒，求交时总是不相交
+				node.boundMin[axis][i] = i < nSlots ? bvh[slots[i]].bound.pMin[axis] : FLOAT_MAX;
+				node.boundMax[axis][i] = i < nSlots ? bvh[slots[i]].bound.pMax[axis] : FLOAT_MIN;
+			}
+		}
+		return wideId;
 	}
 
-	bool Intersect(const Ray& r, Interaction* isect) const {
-		// ѽҪʵĽڵѹջ
+	/*
+		叶子的三角形块：每个叶子的三角形从一个新的块开始，leafBlocks为叶子第一个块的编号
+		拓扑改变（构建、Optimize）后重新生成，顶点移动（Refit）后只重新填写受影响的叶子
+	*/
+	void BuildTriangleBlocks() {
+		int n = bvh.size();
+		leafBlocks.assign(n, -1);
+		int nBlocks = 0;
+		for (int i = 0; i < n; ++i) {
+			const BVHNode& node = bvh[i];
+			if (node.rightChild != -1) continue;
+			leafBlocks[i] = nBlocks;
+			nBlocks += (node.endIndex - node.startIndex + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+		}
+		triangleBlocks.assign(nBlocks, TriangleBlock());
+		ParallelFor(0, n, 1024, [&](int i) {
+			if (bvh[i].rightChild == -1) FillTriangleBlocks(i);
+		});
+	}
+
+	void FillTriangleBlocks(int leafId) {
+		const BVHNode& node = bvh[leafId];
+		for (int k = 0; node.startIndex + k < node.endIndex; ++k) {
+			TriangleBlock& block = triangleBlocks[leafBlocks[leafId] + k / TRIANGLE_BLOCK_SIZE];
+			const Triangle& tri = triangles[node.startIndex + k];
+			for (int v = 0; v < 3; ++v)
+				for (int axis = 0; axis < 3; ++axis)
+					block.p[v][axis][k % TRIANGLE_BLOCK_SIZE] = vertices[tri.indices[v]].position[axis];
+		}
+	}
+
+	// 叶子中的三角形块逐个交给查询处理，query->Block返回false时返回false
+	template <typename Query>
+	bool LeafQuery(int leafId, const TriangleBlockRay& blockRay, const Ray& r, Query* query) const {
+		const BVHNode& leaf = bvh[leafId];
+		const TriangleBlock* block = triangleBlocks.data() + leafBlocks[leafId];
+		for (int first = leaf.startIndex; first < leaf.endIndex; first += TRIANGLE_BLOCK_SIZE, ++block) {
+			int count = std::min(TRIANGLE_BLOCK_SIZE, leaf.endIndex - first);
+			if (!query->Block(*block, count, first, blockRay, &r.tMax)) return false;
+		}
+		return true;
+	}
+
+	/*
+		二叉树遍历：在划分轴上光线方向为负时先访问右儿子，否则先访问左儿子
+		儿子入栈前测试其包围盒，出栈后再用缩短后的tMax测试一次
+	*/
+	template <typename Query>
+	bool BinaryTraverse(const Ray& r, Query* query, TraversalStats* stats) const {
+		// 把将要访问的节点压入栈中
 		int nodeStack[128], top = 0;
 		nodeStack[top++] = 0;
-		// жϻб־
-		bool hit = false;
+		// 方向倒数与三角形求交的错切系数在整个遍历中只计算一次
+		TraversalRay ray(r);
+		TriangleBlockRay blockRay(r);
 		while (top) {
 			const int curId = nodeStack[--top];
 			const BVHNode& node = bvh[curId];
-			// δиõΧ
-			if (!BoundIntersect(node.bound, r)) continue;
-			if (node.rightChild == -1) { // Ҷӽڵ
-				for (int i = node.startIndex; i < node.endIndex; ++i) { // ÿ
-					if (TriangleIntersect(triangles[i], r, vertices, isect)) {
-						hit = true;
-					}
-				}
-			} else { // Ҷӽڵ
-				// ڻϹ߷ΪҪȷҶ
-				if (r.dir[node.axis] < 0) {
+			if (stats) ++stats->nodeVisits;
+			// 未击中该点包围盒则跳过
+			if (!BoundIntersect(node.bound, ray, r.tMax)) continue;
+			if (node.rightChild == -1) { // 叶子节点
+				if (stats) stats->triangleTests += node.endIndex - node.startIndex;
+				if (!LeafQuery(curId, blockRay, r, query)) return false;
+			} else { // 非叶子节点
+				// 在划分轴上光线方向为负方向，则需要先访问右儿子
+				if (ray.dirNegative[node.axis]) {
 					nodeStack[top++] = curId + 1;
-					// жǷһӵİΧ
+					// 判断是否击中另一个儿子的包围盒
 					const BVHNode& rc = bvh[node.rightChild];
-					if (BoundIntersect(rc.bound, r)) nodeStack[top++] = node.rightChild;
+					if (BoundIntersect(rc.bound, ray, r.tMax)) nodeStack[top++] = node.rightChild;
 				} else {
 					nodeStack[top++] = node.rightChild;
 					const BVHNode& lc = bvh[curId + 1];
-					if (BoundIntersect(lc.bound, r)) nodeStack[top++] = curId + 1;
+					if (BoundIntersect(lc.bound, ray, r.tMax)) nodeStack[top++] = curId + 1;
 				}
 			}
 		}
+		return true;
+	}
+
+	// 与TraversalRay相同的起点、方向倒数与方向符号，广播到SIMD寄存器的每个分量
+	struct WideRay {
+#ifdef __AVX__
+		__m256 origin[3], invDir[3];
+#else
+		__m128 origin[3], invDir[3];
+#endif
+		int dirNegative[3];
+		explicit WideRay(const Ray& r) {
+			for (int axis = 0; axis < 3; ++axis) {
+#ifdef __AVX__
+				origin[axis] = _mm256_set1_ps(r.origin[axis]);
+				invDir[axis] = _mm256_set1_ps(1.f / r.dir[axis]);
+#else
+				origin[axis] = _mm_set1_ps(r.origin[axis]);
+				invDir[axis] = _mm_set1_ps(1.f / r.dir[axis]);
+#endif
+				dirNegative[axis] = std::signbit(r.dir[axis]);
+			}
+		}
+	};
+
+	/*
+		一次求出光线与宽节点所有儿子包围盒的相交区间，返回相交儿子的位掩码，tNear为进入各个包围盒的时刻
+		方向为负的轴交换近、远平面，避免逐个分量比较
+		C++14的std::vector不保证按32字节对齐分配，因此使用非对齐读取
+		0 * inf产生的NaN在min/max中取另一个操作数，使该轴不参与裁剪
+		与BoundIntersect相同放大离开时刻，三个轴取最小值后再乘一次，少占用三个寄存器
+	*/
+	static int WideNodeIntersect(const WideBVHNode& node, const WideRay& ray, float tMax, float* tNear) {
+#ifdef __AVX__
+		__m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(tMax);
+		for (int axis = 0; axis < 3; ++axis) {
+			const float* nearPlane = ray.dirNegative[axis] ? node.boundMax[axis] : node.boundMin[axis];
+			const float* farPlane = ray.dirNegative[axis] ? node.boundMin[axis] : node.boundMax[axis];
+			__m256 tNearAxis = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearPlane), ray.origin[axis]), ray.invDir[axis]);
+			__m256 tFarAxis = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farPlane), ray.origin[axis]), ray.invDir[axis]);
+			t0 = _mm256_max_ps(tNearAxis, t0);
+			t1 = _mm256_min_ps(tFarAxis, t1);
+		}
+		t1 = _mm256_min_ps(_mm256_mul_ps(t1, _mm256_set1_ps(BOUND_FAR_SCALE)), _mm256_set1_ps(tMax));
+		_mm256_store_ps(tNear, t0);
+		return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#else
+		__m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tMax);
+		for (int axis = 0; axis < 3; ++axis) {
+			const float* nearPlane = ray.dirNegative[axis] ? node.boundMax[axis] : node.boundMin[axis];
+			const float* farPlane = ray.dirNegative[axis] ? node.boundMin[axis] : node.boundMax[axis];
+			__m128 tNearAxis = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearPlane), ray.origin[axis]), ray.invDir[axis]);
+			__m128 tFarAxis = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farPlane), ray.origin[axis]), ray.invDir[axis]);
+			t0 = _mm_max_ps(tNearAxis, t0);
+			t1 = _mm_min_ps(tFarAxis, t1);
+		}
+		t1 = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(BOUND_FAR_SCALE)), _mm_set1_ps(tMax));
+		_mm_store_ps(tNear, t0);
+		return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#endif
+	}
+
+	/*
+		宽BVH遍历：相交的儿子按进入时刻从远到近压栈，最近的儿子最先访问
+		栈中同时记录进入时刻，出栈时若已找到更近的交点则直接跳过
+		查询不需要排序时（遮挡测试、所有交点）按儿子的顺序压栈
+	*/
+	template <typename Query>
+	bool WideTraverse(const Ray& r, Query* query, TraversalStats* stats) const {
+		struct StackEntry {
+			int child;
+			float t;
+		};
+		StackEntry stack[256];
+		int top = 0;
+		stack[top++] = { 0, 0.f };
+		WideRay ray(r);
+		TriangleBlockRay blockRay(r);
+		while (top) {
+			const StackEntry entry = stack[--top];
+			if (entry.t > r.tMax) continue;
+			if (stats) ++stats->nodeVisits;
+			if (entry.child <= -2) { // 叶子节点
+				int leafId = -2 - entry.child;
+				if (stats) stats->triangleTests += bvh[leafId].endIndex - bvh[leafId].startIndex;
+				if (!LeafQuery(leafId, blockRay, r, query)) return false;
+				continue;
+			}
+			const WideBVHNode& node = wideNodes[entry.child];
+			alignas(32) float tNear[WIDE_BVH_WIDTH];
+			int mask = WideNodeIntersect(node, ray, r.tMax, tNear);
+			if (!Query::SORT_CHILDREN) {
+				for (; mask; mask &= mask - 1) {
+					int i = BitIndex(mask);
+					stack[top++] = { node.children[i], tNear[i] };
+				}
+				continue;
+			}
+			// 插入排序：按进入时刻从大到小压栈
+			int base = top;
+			for (; mask; mask &= mask - 1) {
+				int i = BitIndex(mask);
+				StackEntry e = { node.children[i], tNear[i] };
+				int j = top++;
+				while (j > base && stack[j - 1].t < e.t) {
+					stack[j] = stack[j - 1];
+					--j;
+				}
+				stack[j] = e;
+			}
+		}
+		return true;
+	}
+
+	/*
+		按距离排序的二叉树遍历：两个儿子的包围盒都在父节点中测试，先访问进入时刻较小的儿子
+		栈中同时记录进入时刻，出栈时若已找到更近的交点则不再读取该节点
+	*/
+	template <typename Query>
+	bool OrderedTraverse(const Ray& r, Query* query, TraversalStats* stats) const {
+		struct StackEntry {
+			int node;
+			float t;
+		};
+		StackEntry stack[128];
+		int top = 0;
+		TraversalRay ray(r);
+		TriangleBlockRay blockRay(r);
+		float tRoot;
+		if (!BoundIntersect(bvh[0].bound, ray, r.tMax, &tRoot)) return true;
+		stack[top++] = { 0, tRoot };
+		while (top) {
+			const StackEntry entry = stack[--top];
+			if (entry.t > r.tMax) continue;
+			const BVHNode& node = bvh[entry.node];
+			if (stats) ++stats->nodeVisits;
+			if (node.rightChild == -1) {
+				if (stats) stats->triangleTests += node.endIndex - node.startIndex;
+				if (!LeafQuery(entry.node, blockRay, r, query)) return false;
+				continue;
+			}
+			const int children[2] = { entry.node + 1, node.rightChild };
+			float t[2];
+			const bool hit0 = BoundIntersect(bvh[children[0]].bound, ray, r.tMax, &t[0]);
+			const bool hit1 = BoundIntersect(bvh[children[1]].bound, ray, r.tMax, &t[1]);
+			if (hit0 && hit1) {
+				// 较远的儿子先压栈，进入时刻相同时先访问左儿子
+				const int nearChild = t[1] < t[0];
+				stack[top++] = { children[1 - nearChild], t[1 - nearChild] };
+				stack[top++] = { children[nearChild], t[nearChild] };
+			} else if (hit0) {
+				stack[top++] = { children[0], t[0] };
+			} else if (hit1) {
+				stack[top++] = { children[1], t[1] };
+			}
+		}
+		return true;
+	}
+
+	/*
+		光线包在遍历中不变的量
+		三角形求交按TriangleIntersect的规则，对方向z分量为0的光线交换坐标轴，交换与错切系数在这里逐条光线预先求出
+		所有光线在每个轴上方向同号时，记录起点与方向倒数的区间，用于整个包的区间算术裁剪
+	*/
+	struct PacketRay {
+		explicit PacketRay(const RayPacket& packet, int activeMask) {
+			for (int axis = 0; axis < 3; ++axis) {
+				origin[axis] = PacketLoad(packet.origin[axis]);
+				dir[axis] = PacketLoad(packet.dir[axis]);
+				invDir[axis] = PacketSet1(1.f) / dir[axis];
+			}
+			PacketFloat zero = PacketSet1(0.f);
+			PacketFloat zeroZ = dir[2] == zero;
+			PacketFloat xLonger = PacketAbs(dir[0]) > PacketAbs(dir[1]);
+			PacketFloat yLonger = PacketAbs(dir[0]) <= PacketAbs(dir[1]);
+			swapX = zeroZ & xLonger;
+			swapY = zeroZ & yLonger;
+			shearX = PacketSelect(swapX, dir[2], dir[0]);
+			shearY = PacketSelect(swapY, dir[2], dir[1]);
+			invDz = PacketSet1(1.f) / PacketSelect(swapX, dir[0], PacketSelect(swapY, dir[1], dir[2]));
+
+			alignas(32) float inv[3][RAY_PACKET_SIZE];
+			for (int axis = 0; axis < 3; ++axis) PacketStore(inv[axis], invDir[axis]);
+			float originMin[3] = {}, originMax[3] = {}, invDirMin[3] = {}, invDirMax[3] = {};
+			intervalValid = activeMask != 0;
+			for (int axis = 0; axis < 3 && intervalValid; ++axis) {
+				originMin[axis] = invDirMin[axis] = FLOAT_MAX;
+				originMax[axis] = invDirMax[axis] = FLOAT_MIN;
+				int nNegative = 0, nActive = 0;
+				for (int mask = activeMask; mask; mask &= mask - 1) {
+					int i = BitIndex(mask);
+					// 方向分量为0时倒数为无穷大，区间乘法会产生NaN，不使用区间裁剪
+					if (!std::isfinite(inv[axis][i])) intervalValid = false;
+					nNegative += inv[axis][i] < 0;
+					++nActive;
+					originMin[axis] = std::min(originMin[axis], packet.origin[axis][i]);
+					originMax[axis] = std::max(originMax[axis], packet.origin[axis][i]);
+					invDirMin[axis] = std::min(invDirMin[axis], inv[axis][i]);
+					invDirMax[axis] = std::max(invDirMax[axis], inv[axis][i]);
+				}
+				if (nNegative != 0 && nNegative != nActive) intervalValid = false;
+				dirNegative[axis] = nNegative != 0;
+			}
+			intervalOriginMin = _mm_setr_ps(originMin[0], originMin[1], originMin[2], 0.f);
+			intervalOriginMax = _mm_setr_ps(originMax[0], originMax[1], originMax[2], 0.f);
+			intervalInvDirMin = _mm_setr_ps(invDirMin[0], invDirMin[1], invDirMin[2], 0.f);
+			intervalInvDirMax = _mm_setr_ps(invDirMax[0], invDirMax[1], invDirMax[2], 0.f);
+			intervalNegative = _mm_castsi128_ps(_mm_setr_epi32(-dirNegative[0], -dirNegative[1], -dirNegative[2], 0));
+			intervalAxisMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+			if (!intervalValid) {
+				// 方向不一致时按第一条光线的方向决定儿子的访问顺序
+				int first = activeMask ? BitIndex(activeMask) : 0;
+				for (int axis = 0; axis < 3; ++axis) dirNegative[axis] = packet.dir[axis][first] < 0;
+			}
+		}
+		PacketFloat origin[3], dir[3], invDir[3];
+		PacketFloat swapX, swapY, shearX, shearY, invDz;
+		bool intervalValid;
+		int dirNegative[3];
+		// 区间裁剪使用的起点与方向倒数的区间，第四个分量不使用
+		__m128 intervalOriginMin, intervalOriginMax, intervalInvDirMin, intervalInvDirMax;
+		__m128 intervalNegative, intervalAxisMask;
+	};
+
+	/*
+		区间算术：平面到起点距离的区间乘以方向倒数的区间，得到包中所有光线在各个轴上进入、离开时刻的下界与上界
+		进入时刻下界的最大值仍大于离开时刻上界的最小值时，包中任何一条光线都不可能击中该包围盒
+		三个轴放在一个SSE寄存器中同时计算，区间乘法取四个端点乘积的最小、最大值
+	*/
+	static bool PacketIntervalMiss(const Bound& bound, const PacketRay& ray, float tMax) {
+		__m128 pMin = _mm_setr_ps(bound.pMin.x, bound.pMin.y, bound.pMin.z, 0.f);
+		__m128 pMax = _mm_setr_ps(bound.pMax.x, bound.pMax.y, bound.pMax.z, 0.f);
+		__m128 nearPlane = _mm_or_ps(_mm_and_ps(ray.intervalNegative, pMax), _mm_andnot_ps(ray.intervalNegative, pMin));
+		__m128 farPlane = _mm_or_ps(_mm_and_ps(ray.intervalNegative, pMin), _mm_andnot_ps(ray.intervalNegative, pMax));
+		__m128 n0 = _mm_sub_ps(nearPlane, ray.intervalOriginMax), n1 = _mm_sub_ps(nearPlane, ray.intervalOriginMin);
+		__m128 f0 = _mm_sub_ps(farPlane, ray.intervalOriginMax), f1 = _mm_sub_ps(farPlane, ray.intervalOriginMin);
+		__m128 tNear = _mm_min_ps(_mm_min_ps(_mm_mul_ps(n0, ray.intervalInvDirMin), _mm_mul_ps(n0, ray.intervalInvDirMax)),
+			_mm_min_ps(_mm_mul_ps(n1, ray.intervalInvDirMin), _mm_mul_ps(n1, ray.intervalInvDirMax)));
+		__m128 tFar = _mm_max_ps(_mm_max_ps(_mm_mul_ps(f0, ray.intervalInvDirMin), _mm_mul_ps(f0, ray.intervalInvDirMax)),
+			_mm_max_ps(_mm_mul_ps(f1, ray.intervalInvDirMin), _mm_mul_ps(f1, ray.intervalInvDirMax)));
+		// 与BoundIntersect相同放大离开时刻，第四个分量的乘积为0，不影响进入时刻；离开时刻的第四个分量替换为tMax
+		tFar = _mm_mul_ps(tFar, _mm_set1_ps(BOUND_FAR_SCALE));
+		tFar = _mm_or_ps(_mm_and_ps(ray.intervalAxisMask, tFar), _mm_andnot_ps(ray.intervalAxisMask, _mm_set1_ps(tMax)));
+		tNear = _mm_max_ps(tNear, _mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(1, 0, 3, 2)));
+		tNear = _mm_max_ps(tNear, _mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(2, 3, 0, 1)));
+		tFar = _mm_min_ps(tFar, _mm_shuffle_ps(tFar, tFar, _MM_SHUFFLE(1, 0, 3, 2)));
+		tFar = _mm_min_ps(tFar, _mm_shuffle_ps(tFar, tFar, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_comigt_ss(tNear, tFar) != 0;
+	}
+
+	// 包中每条光线与同一个包围盒求交，返回相交的光线的位掩码
+	static int PacketBoundIntersect(const Bound& bound, const PacketRay& ray, const PacketFloat& tMax) {
+		PacketFloat t0 = PacketSet1(0.f), t1 = tMax;
+		for (int axis = 0; axis < 3; ++axis) {
+			PacketFloat tNear = (PacketSet1(bound.pMin[axis]) - ray.origin[axis]) * ray.invDir[axis];
+			PacketFloat tFar = (PacketSet1(bound.pMax[axis]) - ray.origin[axis]) * ray.invDir[axis];
+			// 0 * inf产生的NaN在min/max中取第二个操作数，使该轴不参与裁剪
+			t0 = PacketMax(PacketMin(tNear, tFar), t0);
+			t1 = PacketMin(PacketMax(tNear, tFar), t1);
+		}
+		// 离开时刻与BoundIntersect相同放大
+		t1 = PacketMin(t1 * PacketSet1(BOUND_FAR_SCALE), tMax);
+		return PacketMoveMask(t0 <= t1);
+	}
+
+	/*
+		一个三角形与包中所有光线求交，与TriangleIntersect的运算顺序相同，逐条光线的结果一致
+		返回击中的光线的位掩码，击中的光线写入交点距离与重心坐标
+	*/
+	int PacketTriangleIntersect(const Triangle& tri, const PacketRay& ray, const PacketFloat& tMax,
+		PacketFloat* t, PacketFloat* b0, PacketFloat* b1, PacketFloat* b2) const {
+		PacketFloat P[3][3];
+		for (int k = 0; k < 3; ++k) {
+			const glm::vec3& p = vertices[tri.indices[k]].position;
+			PacketFloat x = PacketSet1(p.x) - ray.origin[0];
+			PacketFloat y = PacketSet1(p.y) - ray.origin[1];
+			PacketFloat z = PacketSet1(p.z) - ray.origin[2];
+			// 光线z方向为0时交换坐标轴
+			PacketFloat sx = PacketSelect(ray.swapX, z, x);
+			PacketFloat sy = PacketSelect(ray.swapY, z, y);
+			PacketFloat sz = PacketSelect(ray.swapX, x, PacketSelect(ray.swapY, y, z));
+			// 错切变换，射线方向与+z轴对齐
+			P[k][0] = sx - sz * ray.shearX * ray.invDz;
+			P[k][1] = sy - sz * ray.shearY * ray.invDz;
+			P[k][2] = sz * ray.invDz;
+		}
+		PacketFloat e0 = P[1][0] * P[2][1] - P[1][1] * P[2][0];
+		PacketFloat e1 = P[2][0] * P[0][1] - P[2][1] * P[0][0];
+		PacketFloat e2 = P[0][0] * P[1][1] - P[0][1] * P[1][0];
+		PacketFloat zero = PacketSet1(0.f);
+		int negative = PacketMoveMask((e0 < zero) | (e1 < zero) | (e2 < zero));
+		int positive = PacketMoveMask((e0 > zero) | (e1 > zero) | (e2 > zero));
+		PacketFloat det = e0 + e1 + e2;
+		PacketFloat tScaled = e0 * P[0][2] + e1 * P[1][2] + e2 * P[2][2];
+		PacketFloat tMaxScaled = tMax * det;
+		int front = PacketMoveMask((det > zero) & (tScaled > zero) & (tScaled < tMaxScaled));
+		int back = PacketMoveMask((det < zero) & (tScaled < zero) & (tScaled > tMaxScaled));
+		int hit = ~(negative & positive) & (front | back) & RAY_PACKET_FULL_MASK;
+		if (hit && t) {
+			PacketFloat invDet = PacketSet1(1.f) / det;
+			PacketFloat hitMask = PacketMaskFromBits(hit);
+			*t = PacketSelect(hitMask, tScaled * invDet, *t);
+			*b0 = PacketSelect(hitMask, e0 * invDet, *b0);
+			*b1 = PacketSelect(hitMask, e1 * invDet, *b1);
+			*b2 = PacketSelect(hitMask, e2 * invDet, *b2);
+		}
 		return hit;
 	}
 
-	// ֻཻԣInteractionϢ
-	bool IntersectP(const Ray& r) const {
-		// ѽҪʵĽڵѹջ
+	/*
+		光线包遍历二叉树bvh：先用区间算术判断整个包是否错过节点，再用SIMD逐条光线求交
+		没有光线击中的节点直接跳过，儿子按包的方向从近到远访问
+		anyHit为false时记录每条光线最近交点的距离、重心坐标与三角形编号，返回击中的光线
+		anyHit为true时返回被遮挡的光线，被遮挡的光线不再参与之后的求交
+	*/
+	template <bool anyHit>
+	int PacketTraverse(const RayPacket& packet, int activeMask, float* hitTime, float* hitB0, float* hitB1, float* hitB2,
+		int* hitTriangle, TraversalStats* stats) const {
+		activeMask &= RAY_PACKET_FULL_MASK;
+		if (bvh.empty() || !activeMask) return 0;
+		PacketRay ray(packet, activeMask);
+		alignas(32) float tMaxLanes[RAY_PACKET_SIZE];
+		std::memcpy(tMaxLanes, packet.tMax, sizeof(tMaxLanes));
+		// 非活跃的光线tMax设为负数，与包围盒求交的结果总是不相交
+		for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+			if (!(activeMask >> i & 1)) tMaxLanes[i] = -1.f;
+		PacketFloat tMax = PacketLoad(tMaxLanes);
+		float tMaxBound = FLOAT_MIN;
+		for (int mask = activeMask; mask; mask &= mask - 1) tMaxBound = std::max(tMaxBound, tMaxLanes[BitIndex(mask)]);
+		PacketFloat t = tMax, b0 = PacketSet1(0.f), b1 = b0, b2 = b0;
+		int hitMask = 0;
+
 		int nodeStack[128], top = 0;
 		nodeStack[top++] = 0;
 		while (top) {
 			const int curId = nodeStack[--top];
 			const BVHNode& node = bvh[curId];
-			// δиõΧ
-			if (!BoundIntersect(node.bound, r)) continue;
-			if (node.rightChild == -1) { // Ҷӽڵ
-				for (int i = node.startIndex; i < node.endIndex; ++i) { // ÿ
-					if (TriangleIntersectP(triangles[i], r, vertices))
-						return true;
-				}
-			} else { // Ҷӽڵ
-				// ڻϹ߷ΪҪȷҶ
-				if (r.dir[node.axis] < 0) {
+			if (stats) ++stats->nodeVisits;
+			if (ray.intervalValid && PacketIntervalMiss(node.bound, ray, tMaxBound)) continue;
+			int nodeMask = PacketBoundIntersect(node.bound, ray, tMax) & activeMask;
+			if (!nodeMask) continue;
+			if (node.rightChild != -1) {
+				if (ray.dirNegative[node.axis]) {
 					nodeStack[top++] = curId + 1;
-					// жǷһӵİΧ
-					const BVHNode& rc = bvh[node.rightChild];
-					if (BoundIntersect(rc.bound, r)) nodeStack[top++] = node.rightChild;
+					nodeStack[top++] = node.rightChild;
 				} else {
 					nodeStack[top++] = node.rightChild;
-					const BVHNode& lc = bvh[curId + 1];
-					if (BoundIntersect(lc.bound, r)) nodeStack[top++] = curId + 1;
+					nodeStack[top++] = curId + 1;
 				}
+				continue;
+			}
+			for (int i = node.startIndex; i < node.endIndex; ++i) {
+				if (stats) ++stats->triangleTests;
+				if (anyHit) {
+					int hit = PacketTriangleIntersect(triangles[i], ray, tMax, nullptr, nullptr, nullptr, nullptr) & activeMask;
+					if (!hit) continue;
+					hitMask |= hit;
+					activeMask &= ~hit;
+					if (!activeMask) return hitMask;
+					// 被遮挡的光线tMax设为负数，之后的包围盒与三角形求交都不相交
+					tMax = PacketSelect(PacketMaskFromBits(hit), PacketSet1(-1.f), tMax);
+				} else {
+					int hit = PacketTriangleIntersect(triangles[i], ray, tMax, &t, &b0, &b1, &b2) & activeMask;
+					if (!hit) continue;
+					hitMask |= hit;
+					tMax = t;
+					for (int mask = hit; mask; mask &= mask - 1) hitTriangle[BitIndex(mask)] = i;
+				}
+			}
+			if (!anyHit && hitMask) {
+				// 交点距离缩短后重新计算区间裁剪使用的tMax上界
+				PacketStore(tMaxLanes, tMax);
+				tMaxBound = FLOAT_MIN;
+				for (int mask = activeMask; mask; mask &= mask - 1) tMaxBound = std::max(tMaxBound, tMaxLanes[BitIndex(mask)]);
 			}
 		}
-		return false;
+		if (!anyHit) {
+			PacketStore(hitTime, t);
+			PacketStore(hitB0, b0);
+			PacketStore(hitB1, b1);
+			PacketStore(hitB2, b2);
+		}
+		return hitMask;
 	}
-private:
-	struct Bucket {
-		int nTriangles = 0;
+
+	// 最低位1的位置
+	static int BitIndex(int mask) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return (int)index;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	// 树重构使用的显式二叉树，节点编号为原数组中的位置，叶子的三角形区间仍为原数组中的区间
+	struct OptNode {
 		Bound bound;
+		int children[2] = { -1, -1 };
+		int nNodes = 1, nTriangles = 0;
+		float cost = 0.f; // 子树的SAH代价（未除以根节点表面积）
 	};
+	static constexpr int MAX_TREELET_SIZE = 8;
+
+	float OptLeafCost(const OptNode& node) const {
+		return node.bound.SurfaceArea() * node.nTriangles;
+	}
+
+	void InitOptNode(int offset, int end) {
+		const BVHNode& node = bvh[offset];
+		OptNode& opt = optNodes[offset];
+		opt.bound = node.bound;
+		opt.nNodes = end - offset;
+		if (node.rightChild == -1) {
+			opt.nTriangles = node.endIndex - node.startIndex;
+			opt.cost = OptLeafCost(opt);
+			return;
+		}
+		InitOptNode(offset + 1, node.rightChild);
+		InitOptNode(node.rightChild, end);
+		opt.children[0] = offset + 1;
+		opt.children[1] = node.rightChild;
+		opt.nTriangles = optNodes[offset + 1].nTriangles + optNodes[node.rightChild].nTriangles;
+		opt.cost = setting.trav * opt.bound.SurfaceArea() + optNodes[offset + 1].cost + optNodes[node.rightChild].cost;
+	}
 
-	int BuildBVH(int L, int R, int depth = 0) {
-		// ڵ
-		static int nodeId = -1;
-		++nodeId;
-		// ǰڵιɵİΧ
+	// 先处理两个子树再以当前节点为根重构，子树之间没有共享节点，可以并行
+	void OptimizeNode(int id, std::atomic<int>* restructured) {
+		const OptNode& node = optNodes[id];
+		if (node.children[0] == -1) return;
+		if (node.nNodes >= PARALLEL_BUILD_THRESHOLD) {
+			TaskGroup group;
+			int right = node.children[1];
+			group.Run([&]() { OptimizeNode(right, restructured); });
+			OptimizeNode(node.children[0], restructured);
+			group.Wait();
+		} else {
+			OptimizeNode(node.children[0], restructured);
+			OptimizeNode(node.children[1], restructured);
+		}
+		if (RestructureTreelet(id)) ++*restructured;
+	}
+
+	bool RestructureTreelet(int root) {
+		const int treeletSize = setting.treeletSize;
+		int leaves[MAX_TREELET_SIZE], nLeaves = 0;
+		int internals[MAX_TREELET_SIZE], nInternals = 0;
+		internals[nInternals++] = root;
+		leaves[nLeaves++] = optNodes[root].children[0];
+		leaves[nLeaves++] = optNodes[root].children[1];
+		// 每次展开表面积最大的内部节点
+		while (nLeaves < treeletSize) {
+			int best = -1;
+			float bestArea = -1.f;
+			for (int i = 0; i < nLeaves; ++i) {
+				const OptNode& n = optNodes[leaves[i]];
+				if (n.children[0] == -1) continue;
+				float area = n.bound.SurfaceArea();
+				if (area > bestArea) {
+					bestArea = area;
+					best = i;
+				}
+			}
+			if (best == -1) break;
+			int id = leaves[best];
+			internals[nInternals++] = id;
+			leaves[best] = optNodes[id].children[0];
+			leaves[nLeaves++] = optNodes[id].children[1];
+		}
+		if (nLeaves < 3) return false;
+
+		// subsetBound[S]、subsetCost[S]：叶子子集S组成的子树的包围盒与最小代价，subsetSplit[S]为最优划分中的一侧
+		const int full = (1 << nLeaves) - 1;
+		Bound subsetBound[1 << MAX_TREELET_SIZE];
+		float subsetCost[1 << MAX_TREELET_SIZE];
+		int subsetSplit[1 << MAX_TREELET_SIZE];
+		for (int S = 1; S <= full; ++S) {
+			int low = S & -S;
+			int bit = 0;
+			while ((1 << bit) != low) ++bit;
+			if (S == low) {
+				subsetBound[S] = optNodes[leaves[bit]].bound;
+				subsetCost[S] = optNodes[leaves[bit]].cost;
+				continue;
+			}
+			subsetBound[S] = subsetBound[S ^ low];
+			subsetBound[S].Union(optNodes[leaves[bit]].bound);
+			// 只枚举包含最低位叶子的一侧，避免重复计算对称的划分
+			float minCost = FLOAT_MAX;
+			int bestSplit = low;
+			int rest = S ^ low;
+			for (int P = rest; ; P = (P - 1) & rest) {
+				int left = P | low;
+				if (left != S) {
+					float cost = subsetCost[left] + subsetCost[S ^ left];
+					if (cost < minCost) {
+						minCost = cost;
+						bestSplit = left;
+					}
+				}
+				if (P == 0) break;
+			}
+			subsetCost[S] = setting.trav * subsetBound[S].SurfaceArea() + minCost;
+			subsetSplit[S] = bestSplit;
+		}
+		if (subsetCost[full] >= optNodes[root].cost * (1.f - 1e-5f)) return false;
+
+		// 复用原有的内部节点编号，internals[0]为根节点，编号不变
+		int nextInternal = 0;
+		std::function<int(int)> assign = [&](int S) -> int {
+			if ((S & (S - 1)) == 0) {
+				int bit = 0;
+				while ((1 << bit) != S) ++bit;
+				return leaves[bit];
+			}
+			int id = internals[nextInternal++];
+			int left = assign(subsetSplit[S]);
+			int right = assign(S ^ subsetSplit[S]);
+			OptNode& node = optNodes[id];
+			node.children[0] = left;
+			node.children[1] = right;
+			node.bound = subsetBound[S];
+			node.nNodes = optNodes[left].nNodes + optNodes[right].nNodes + 1;
+			node.nTriangles = optNodes[left].nTriangles + optNodes[right].nTriangles;
+			node.cost = subsetCost[S];
+			return id;
+		};
+		assign(full);
+		return true;
+	}
+
+	/*
+		按先序把重构后的树展开到nodes[offset]开始的位置，三角形按新的叶子顺序复制到refTriangles
+		内部节点的划分轴取两个儿子中心距离最大的轴，坐标较小的儿子作为左儿子，使遍历时的前后顺序判断仍然有效
+	*/
+	void FlattenOptNode(int id, int offset, int triOffset, std::vector<BVHNode>& nodes, std::vector<Triangle>& refTriangles) {
+		const OptNode& node = optNodes[id];
+		if (node.children[0] == -1) {
+			const BVHNode& leaf = bvh[id];
+			std::copy(triangles.begin() + leaf.startIndex, triangles.begin() + leaf.endIndex, refTriangles.begin() + triOffset);
+			nodes[offset] = { node.bound, -1, -1, triOffset, triOffset + node.nTriangles };
+			return;
+		}
+		int left = node.children[0], right = node.children[1];
+		glm::vec3 d = (optNodes[right].bound.pMin + optNodes[right].bound.pMax)
+			- (optNodes[left].bound.pMin + optNodes[left].bound.pMax);
+		int axis = 0;
+		if (std::abs(d.y) > std::abs(d[axis])) axis = 1;
+		if (std::abs(d.z) > std::abs(d[axis])) axis = 2;
+		if (d[axis] < 0) std::swap(left, right);
+		int rightChild = offset + 1 + optNodes[left].nNodes;
+		int rightTriOffset = triOffset + optNodes[left].nTriangles;
+		nodes[offset] = { node.bound, axis, rightChild, triOffset, triOffset + node.nTriangles };
+		if (node.nNodes >= PARALLEL_BUILD_THRESHOLD) {
+			TaskGroup group;
+			group.Run([&]() { FlattenOptNode(right, rightChild, rightTriOffset, nodes, refTriangles); });
+			FlattenOptNode(left, offset + 1, triOffset, nodes, refTriangles);
+			group.Wait();
+		} else {
+			FlattenOptNode(left, offset + 1, triOffset, nodes, refTriangles);
+			FlattenOptNode(right, rightChild, rightTriOffset, nodes, refTriangles);
+		}
+	}
+
+	// 重新计算占据bvh[offset, end)的子树的包围盒，并求出其中包围盒发生变化的节点区间
+	// 包围盒改变的节点按先序追加到dirtyRuns，节点自身在子树之前，左子树在右子树之前
+	void RefitNode(int offset, int end, int vertexBegin, int vertexEnd, std::vector<IndexRange>* dirtyRuns) {
+		BVHNode& node = bvh[offset];
 		Bound bound;
-		for (int i = L; i < R; ++i) {
+		std::vector<IndexRange> leftRuns, rightRuns;
+		if (node.rightChild == -1) {
+			bool moved = false;
+			for (int i = node.startIndex; i < node.endIndex; ++i)
+				moved |= RefitTriangle(&triangles[i], vertexBegin, vertexEnd);
+			if (!moved) return;
+			FillTriangleBlocks(offset);
+			for (int i = node.startIndex; i < node.endIndex; ++i)
+				bound.Union(triangles[i].bound);
+		} else {
+			if (end - offset >= PARALLEL_BUILD_THRESHOLD) {
+				TaskGroup group;
+				group.Run([&]() { RefitNode(node.rightChild, end, vertexBegin, vertexEnd, &rightRuns); });
+				RefitNode(offset + 1, node.rightChild, vertexBegin, vertexEnd, &leftRuns);
+				group.Wait();
+			} else {
+				RefitNode(offset + 1, node.rightChild, vertexBegin, vertexEnd, &leftRuns);
+				RefitNode(node.rightChild, end, vertexBegin, vertexEnd, &rightRuns);
+			}
+			if (leftRuns.empty() && rightRuns.empty()) return;
+			bound = bvh[offset + 1].bound;
+			bound.Union(bvh[node.rightChild].bound);
+		}
+		if (bound.pMin != node.bound.pMin || bound.pMax != node.bound.pMax) {
+			node.bound = bound;
+			AppendRange(dirtyRuns, offset, offset + 1);
+			// 宽BVH中该节点所在的儿子槽位，不同节点的槽位不同，可以并行写入
+			if (!wideNodes.empty() && wideSlots[offset] != -1) {
+				WideBVHNode& wide = wideNodes[wideSlots[offset] / WIDE_BVH_WIDTH];
+				int slot = wideSlots[offset] % WIDE_BVH_WIDTH;
+				for (int axis = 0; axis < 3; ++axis) {
+					wide.boundMin[axis][slot] = bound.pMin[axis];
+					wide.boundMax[axis][slot] = bound.pMax[axis];
+				}
+			}
+		}
+		for (const IndexRange& run : leftRuns) AppendRange(dirtyRuns, run.begin, run.end);
+		for (const IndexRange& run : rightRuns) AppendRange(dirtyRuns, run.begin, run.end);
+	}
+
+	// 三角形引用了[vertexBegin, vertexEnd)中的顶点时重新计算面积与包围盒，返回是否重新计算
+	bool RefitTriangle(Triangle* tri, int vertexBegin, int vertexEnd) {
+		bool moved = false;
+		for (int v = 0; v < 3; ++v)
+			moved |= tri->indices[v] >= vertexBegin && tri->indices[v] < vertexEnd;
+		if (!moved) return false;
+		const glm::vec3& p0 = vertices[tri->indices[0]].position;
+		const glm::vec3& p1 = vertices[tri->indices[1]].position;
+		const glm::vec3& p2 = vertices[tri->indices[2]].position;
+		tri->area = glm::length(glm::cross(p1 - p0, p2 - p0)) * 0.5f;
+		tri->bound = Bound();
+		tri->bound.Union(p0);
+		tri->bound.Union(p1);
+		tri->bound.Union(p2);
+		tri->boundCenter = (tri->bound.pMax + tri->bound.pMin) * .5f;
+		return true;
+	}
+
+	void Build() {
+		arenas.clear();
+		bvh.clear();
+		if (triangles.empty()) return;
+		if (setting.method == BVHBuildMethod::Linear) {
+			BuildLBVH();
+			return;
+		}
+		Bound bound, centerBound;
+		for (int i = 0; i < (int)triangles.size(); ++i) {
+			triangles[i].primitiveId = i;
 			bound.Union(triangles[i].bound);
+			centerBound.Union(triangles[i].boundCenter);
+		}
+		BVHBuildNode* root;
+		if (setting.spatialSplit) {
+			std::vector<Reference> refs(triangles.size());
+			for (int i = 0; i < (int)triangles.size(); ++i)
+				refs[i] = { i, triangles[i].bound, triangles[i].boundCenter };
+			rootArea = bound.SurfaceArea();
+			int budget = (int)(setting.splitBudget * triangles.size());
+			root = BuildSBVH(*NewArena(), std::move(refs), bound, centerBound, budget, 0);
+		} else {
+			root = BuildBVH(*NewArena(), 0, triangles.size(), bound, centerBound);
+		}
+		// 每个BVH实例独立编号：根据子树大小直接计算每个节点在数组中的位置
+		nodeCount = root->nNodes;
+		bvh.resize(nodeCount);
+		if (setting.spatialSplit) {
+			// 按叶子节点的顺序重新排列三角形引用，被复制的三角形在数组中出现多次
+			std::vector<Triangle> refTriangles(root->nRefs);
+			FlattenBVH(root, 0, 0, &refTriangles);
+			triangles.swap(refTriangles);
+		} else {
+			FlattenBVH(root, 0, 0, nullptr);
+		}
+		arenas.clear();
+	}
+
+	BuildArena* NewArena() {
+		std::lock_guard<std::mutex> lock(arenaMutex);
+		arenas.emplace_back(new BuildArena());
+		return arenas.back().get();
+	}
+
+	BVHBuildNode* MakeLeaf(BVHBuildNode* node, int L, int R) {
+		node->startIndex = L;
+		node->endIndex = R;
+		return node;
+	}
+
+	BVHBuildNode* MakeLeaf(BVHBuildNode* node, BuildArena& arena, const std::vector<Reference>& refs) {
+		arena.leafRefs.emplace_back(refs.size());
+		std::vector<int>& ids = arena.leafRefs.back();
+		for (int i = 0; i < (int)refs.size(); ++i) ids[i] = refs[i].id;
+		node->refs = ids.data();
+		return node;
+	}
+
+	// 计算三角形包围盒中心在某个轴上所属的桶
+	static int BucketIndex(float center, float pMin, float scale, int nBuckets) {
+		int pos = (int)((center - pMin) * scale);
+		return std::min(std::max(pos, 0), nBuckets - 1);
+	}
+
+	// 三角形较少的节点使用较少的桶，避免扫描大量空桶
+	int BucketCount(int nTriangles) const {
+		return std::min(setting.nBuckets, std::max(BUCKET_MIN, nTriangles));
+	}
+
+	// 把prims[L, R)按三个轴同时分桶，prims为三角形或三角形引用
+	template <typename Primitive>
+	static void FillBuckets(const Primitive* prims, int L, int R, const Bound& centerBound, const glm::vec3& scale, int nBuckets, Bucket (*buc)[MAX_BUCKETS]) {
+		for (int i = L; i < R; ++i) {
+			const Primitive& tri = prims[i];
+			SIMDBound b(tri.bound);
+			for (int d = 0; d < 3; ++d) {
+				int pos = BucketIndex(tri.boundCenter[d], centerBound.pMin[d], scale[d], nBuckets);
+				buc[d][pos].nTriangles++;
+				buc[d][pos].bound.Union(b);
+			}
+		}
+	}
+
+	// 分桶并扫描求出代价最小的划分，分桶数组只在该函数中使用，不占用递归构建的栈空间
+	template <typename Primitive>
+	bool FindSplit(const Primitive* prims, int L, int R, const Bound& bound, const Bound& centerBound,
+		glm::vec3* scaleOut, int* axisOut, int* midBucOut, float* costOut) const {
+		int nTriangles = R - L;
+		glm::vec3 diagonal = centerBound.Diagonal();
+		const int nBuckets = BucketCount(nTriangles);
+		glm::vec3 scale;
+		for (int d = 0; d < 3; ++d)
+			scale[d] = diagonal[d] > 0 ? nBuckets / diagonal[d] : 0.f;
+
+		// 三个轴同时分桶，只初始化用到的桶；三角形较多时分块并行填桶再合并
+		BucketArray storage;
+		Bucket (*buc)[MAX_BUCKETS] = storage.buc;
+		storage.Reset(nBuckets);
+		if (nTriangles >= PARALLEL_BUILD_THRESHOLD) {
+			constexpr int CHUNK_SIZE = 16384;
+			int nChunks = (nTriangles + CHUNK_SIZE - 1) / CHUNK_SIZE;
+			std::vector<std::array<std::array<Bucket, MAX_BUCKETS>, 3>> chunkBuc(nChunks);
+			ParallelFor(0, nChunks, 1, [&](int c) {
+				BucketArray local;
+				local.Reset(nBuckets);
+				FillBuckets(prims, L + c * CHUNK_SIZE, std::min(R, L + (c + 1) * CHUNK_SIZE), centerBound, scale, nBuckets, local.buc);
+				for (int d = 0; d < 3; ++d)
+					std::copy(local.buc[d], local.buc[d] + nBuckets, chunkBuc[c][d].begin());
+			});
+			for (int c = 0; c < nChunks; ++c) {
+				for (int d = 0; d < 3; ++d) {
+					for (int i = 0; i < nBuckets; ++i) {
+						buc[d][i].nTriangles += chunkBuc[c][d][i].nTriangles;
+						buc[d][i].bound.Union(chunkBuc[c][d][i].bound);
+					}
+				}
+			}
+		} else {
+			FillBuckets(prims, L, R, centerBound, scale, nBuckets, buc);
 		}
+
+		/*
+			从左向右扫描求前缀包围盒，从右向左扫描求后缀包围盒，线性时间内得到每个划分位置的代价：
+			在第m个桶及其左边的三角形划分到左儿子，其余划分到右儿子
+		*/
+		float minCost = FLOAT_MAX;
+		int midBuc = -1, d = -1;
+		const float invArea = 1.f / bound.SurfaceArea();
+		for (int axis = 0; axis < 3; ++axis) {
+			if (diagonal[axis] <= 0) continue;
+			float rightArea[MAX_BUCKETS];
+			int rightCount[MAX_BUCKETS];
+			SIMDBound b1;
+			int c1 = 0;
+			float area1 = 0.f;
+			for (int m = nBuckets - 1; m > 0; --m) {
+				// 空桶不改变包围盒，沿用上一个位置的表面积
+				if (buc[axis][m].nTriangles) {
+					b1.Union(buc[axis][m].bound);
+					c1 += buc[axis][m].nTriangles;
+					area1 = b1.SurfaceArea();
+				}
+				rightArea[m - 1] = area1;
+				rightCount[m - 1] = c1;
+			}
+			SIMDBound b0;
+			int c0 = 0;
+			for (int m = 0; m < nBuckets - 1; ++m) {
+				// 空桶处的划分与前一个位置相同，不需要重复计算
+				if (buc[axis][m].nTriangles == 0) continue;
+				b0.Union(buc[axis][m].bound);
+				c0 += buc[axis][m].nTriangles;
+				if (rightCount[m] == 0) break;
+				float cost = setting.trav + (b0.SurfaceArea() * c0 + rightArea[m] * rightCount[m]) * invArea;
+				if (cost < minCost) {
+					minCost = cost;
+					midBuc = m;
+					d = axis;
+				}
+			}
+		}
+		*scaleOut = scale;
+		*axisOut = d;
+		*midBucOut = midBuc;
+		*costOut = minCost;
+		return d != -1;
+	}
+
+	// bound为[L, R)中三角形构成的包围盒，centerBound为三角形包围盒中心构成的包围盒，均由父节点划分时求出
+	BVHBuildNode* BuildBVH(BuildArena& arena, int L, int R, const Bound& bound, const Bound& centerBound) {
+		arena.nodes.emplace_back();
+		BVHBuildNode* node = &arena.nodes.back();
+		node->bound = bound;
 		int nTriangles = R - L;
-		// Ҷӽڵ
+		node->nRefs = nTriangles;
+		// 叶子节点
 		if (nTriangles <= 2) {
-			bvh.push_back({ bound, -1, -1, L, R });
-			return nodeId;
+			return MakeLeaf(node, L, R);
 		}
-		Bound centerBound;
-		for (int i = L; i < R; ++i)
-			centerBound.Union(triangles[i].boundCenter);
-		// ȡΧжԽάȽл
 		glm::vec3 diagonal = centerBound.Diagonal();
-		int d;
-		if (diagonal.x >= diagonal.y && diagonal.x >= diagonal.z) d = 0;
-		else if (diagonal.y >= diagonal.x && diagonal.y >= diagonal.z) d = 1;
-		else d = 2;
-		// ΧдСΪ0Ҷӽڵ㴦
-		if (centerBound.pMax[d] == centerBound.pMin[d]) {
-			bvh.push_back({ bound, -1, -1, L, R });
-			return nodeId;
-		}
-		// ỮֳɸͰÿεİΧķֱװӦͰ
-		constexpr int BUCKETSIZE = 12;
-		Bucket buc[BUCKETSIZE];
-		for (int i = L; i < R; ++i) {
-			int pos = ((triangles[i].boundCenter[d] - centerBound.pMin[d]) / diagonal[d]) * BUCKETSIZE;
-			if (pos == BUCKETSIZE) pos = BUCKETSIZE - 1;
-			assert(pos >= 0 && pos < BUCKETSIZE);
-			buc[pos].nTriangles++;
-			buc[pos].bound.Union(triangles[i].bound);
+		// 包围盒大小为0当叶子节点处理
+		if (diagonal.x <= 0 && diagonal.y <= 0 && diagonal.z <= 0) {
+			return MakeLeaf(node, L, R);
+		}
+		// 寻找SAH代价最小的划分轴与划分桶
+		glm::vec3 scale;
+		int d, midBuc;
+		float minCost;
+		if (!FindSplit(triangles.data(), L, R, bound, centerBound, &scale, &d, &midBuc, &minCost)) {
+			return MakeLeaf(node, L, R);
 		}
 
-		// ȡĳƻִСͰڸͰں͸Ͱߵλֵӣ໮ֵҶ
-		float minCost = FLOAT_MAX;
-		int midBuc = 0;
-		for (int m = 0; m < BUCKETSIZE - 1; ++m) {
-			Bound b0, b1;
-			int c0 = 0, c1 = 0;
-			for (int i = 0; i <= m; ++i) {
-				c0 += buc[i].nTriangles;
-				b0.Union(buc[i].bound);
+		float leafCost = nTriangles;
+		// 叶子节点：三角形个数小于限制，并且访问叶子花费小于划分后的花费
+		if (nTriangles <= setting.maxTrianglesInLeaf && leafCost <= minCost) {
+			return MakeLeaf(node, L, R);
+		}
+
+		// 划分三角形，同时求出左右儿子的包围盒与中心包围盒
+		auto goesLeft = [&](const Triangle& t) -> bool {
+			return BucketIndex(t.boundCenter[d], centerBound.pMin[d], scale[d], BucketCount(nTriangles)) <= midBuc;
+		};
+		Bound bound0, bound1, center0, center1;
+		int i = L, j = R;
+		while (true) {
+			while (i < j && goesLeft(triangles[i])) {
+				bound0.Union(triangles[i].bound);
+				center0.Union(triangles[i].boundCenter);
+				++i;
 			}
-			for (int i = m + 1; i < BUCKETSIZE; ++i) {
-				c1 += buc[i].nTriangles;
-				b1.Union(buc[i].bound);
+			while (i < j && !goesLeft(triangles[j - 1])) {
+				bound1.Union(triangles[j - 1].bound);
+				center1.Union(triangles[j - 1].boundCenter);
+				--j;
 			}
-			float cost = trav + (b0.SurfaceArea() * c0 + b1.SurfaceArea() * c1) / bound.SurfaceArea();
-			if (cost < minCost) {
-				minCost = cost;
-				midBuc = m;
+			if (i >= j) break;
+			std::swap(triangles[i], triangles[j - 1]);
+		}
+		int mid = i;
+
+		node->axis = d;
+		node->startIndex = L;
+		node->endIndex = R;
+		// 左右子树的三角形区间互不重叠，可以同时构建；较大的节点把右子树交给线程池
+		if (nTriangles >= PARALLEL_BUILD_THRESHOLD) {
+			TaskGroup group;
+			group.Run([&]() { node->children[1] = BuildBVH(*NewArena(), mid, R, bound1, center1); });
+			node->children[0] = BuildBVH(arena, L, mid, bound0, center0);
+			group.Wait();
+		} else {
+			node->children[0] = BuildBVH(arena, L, mid, bound0, center0);
+			node->children[1] = BuildBVH(arena, mid, R, bound1, center1);
+		}
+		node->nNodes = 1 + node->children[0]->nNodes + node->children[1]->nNodes;
+		return node;
+	}
+
+	// 三角形在axis轴上被裁剪到[lo, hi]内部分的包围盒
+	Bound ClipTriangle(int id, int axis, float lo, float hi) const {
+		const Triangle& tri = triangles[id];
+		Bound b;
+		for (int i = 0; i < 3; ++i) {
+			const glm::vec3& p0 = vertices[tri.indices[i]].position;
+			const glm::vec3& p1 = vertices[tri.indices[(i + 1) % 3]].position;
+			if (p0[axis] >= lo && p0[axis] <= hi) b.Union(p0);
+			// 边与裁剪平面的交点
+			for (float plane : { lo, hi }) {
+				if ((p0[axis] < plane && p1[axis] > plane) || (p0[axis] > plane && p1[axis] < plane)) {
+					float t = (plane - p0[axis]) / (p1[axis] - p0[axis]);
+					glm::vec3 p = p0 + (p1 - p0) * t;
+					p[axis] = plane;
+					b.Union(p);
+				}
 			}
 		}
+		return b;
+	}
 
-		int mid = std::partition(triangles.begin() + L, triangles.begin() + R,
-			[&](const Triangle& t) -> bool {
-				int pos = ((t.boundCenter[d] - centerBound.pMin[d]) / diagonal[d]) * BUCKETSIZE;
-		if (pos == BUCKETSIZE) pos = BUCKETSIZE - 1;
-		return pos <= midBuc;
-			}) - triangles.begin();
+	// 三角形引用在空间划分的桶中所跨越的范围
+	static void SpatialBinRange(const Reference& ref, int axis, float pMin, float scale, int nBins, int* first, int* last) {
+		*first = BucketIndex(ref.bound.pMin[axis], pMin, scale, nBins);
+		*last = std::max(*first, BucketIndex(ref.bound.pMax[axis], pMin, scale, nBins));
+	}
+
+	/*
+		空间划分：把节点包围盒在每个轴上等分为若干桶，跨越多个桶的三角形被裁剪后分别加入各个桶，
+		用进入桶与离开桶的计数得到划分平面两侧的三角形个数，复制的引用数不能超过budget
+	*/
+	bool FindSpatialSplit(const std::vector<Reference>& refs, const Bound& bound, int budget,
+		int* axisOut, int* splitOut, float* costOut) const {
+		const int nRefs = refs.size();
+		const int nBins = BucketCount(nRefs);
+		glm::vec3 diagonal = bound.Diagonal();
+		const float invArea = 1.f / bound.SurfaceArea();
+		float axisCost[3] = { FLOAT_MAX, FLOAT_MAX, FLOAT_MAX };
+		int axisSplit[3] = { -1, -1, -1 };
+		// 三个轴互不影响，引用较多时并行分桶
+		ParallelFor(0, 3, nRefs >= PARALLEL_BUILD_THRESHOLD ? 1 : 3, [&](int axis) {
+			if (diagonal[axis] <= 0) return;
+			SpatialBin bins[MAX_BUCKETS];
+			const float width = diagonal[axis] / nBins, scale = nBins / diagonal[axis];
+			const float pMin = bound.pMin[axis];
+			for (const Reference& ref : refs) {
+				int first, last;
+				SpatialBinRange(ref, axis, pMin, scale, nBins, &first, &last);
+				bins[first].enter++;
+				bins[last].exit++;
+				if (first == last) {
+					bins[first].bound.Union(SIMDBound(ref.bound));
+					continue;
+				}
+				for (int i = first; i <= last; ++i) {
+					float lo = i == first ? FLOAT_MIN : pMin + width * i;
+					float hi = i == last ? FLOAT_MAX : pMin + width * (i + 1);
+					Bound b = ClipTriangle(ref.id, axis, lo, hi);
+					b.Intersect(ref.bound);
+					if (!b.Empty()) bins[i].bound.Union(SIMDBound(b));
+				}
+			}
+			float rightArea[MAX_BUCKETS];
+			int rightCount[MAX_BUCKETS];
+			SIMDBound b1;
+			int c1 = 0;
+			for (int m = nBins - 1; m > 0; --m) {
+				b1.Union(bins[m].bound);
+				c1 += bins[m].exit;
+				rightArea[m - 1] = c1 ? b1.SurfaceArea() : 0.f;
+				rightCount[m - 1] = c1;
+			}
+			SIMDBound b0;
+			int c0 = 0;
+			for (int m = 0; m < nBins - 1; ++m) {
+				b0.Union(bins[m].bound);
+				c0 += bins[m].enter;
+				if (c0 == 0 || rightCount[m] == 0) continue;
+				if (c0 + rightCount[m] - nRefs > budget) continue;
+				float cost = setting.trav + (b0.SurfaceArea() * c0 + rightArea[m] * rightCount[m]) * invArea;
+				if (cost < axisCost[axis]) {
+					axisCost[axis] = cost;
+					axisSplit[axis] = m;
+				}
+			}
+		});
+		int d = -1;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (axisSplit[axis] != -1 && (d == -1 || axisCost[axis] < axisCost[d])) d = axis;
+		}
+		if (d == -1) return false;
+		*axisOut = d;
+		*splitOut = axisSplit[d];
+		*costOut = axisCost[d];
+		return true;
+	}
 
-			float leafCost = nTriangles;
-			// Ҷӽڵ㣺θСƣҷҶӻСڻֺĻ
-			if (nTriangles <= maxTrianglesInLeaf && leafCost <= minCost || mid == L) {
-				bvh.push_back({ bound, -1, -1, L, R });
-				return nodeId;
+	/*
+		按空间划分把引用分到左右儿子：跨越划分平面的三角形在平面处裁剪为两个引用，
+		若只放入一侧的代价更小则不复制（reference unsplitting）
+	*/
+	void SpatialPartition(const std::vector<Reference>& refs, const Bound& bound, int axis, int split,
+		std::vector<Reference>* left, std::vector<Reference>* right) const {
+		const int nBins = BucketCount(refs.size());
+		const float scale = nBins / bound.Diagonal()[axis];
+		const float plane = bound.pMin[axis] + bound.Diagonal()[axis] / nBins * (split + 1);
+		Bound leftBound, rightBound;
+		std::vector<int> straddling;
+		for (int i = 0; i < (int)refs.size(); ++i) {
+			int first, last;
+			SpatialBinRange(refs[i], axis, bound.pMin[axis], scale, nBins, &first, &last);
+			if (last <= split) {
+				left->push_back(refs[i]);
+				leftBound.Union(refs[i].bound);
+			} else if (first > split) {
+				right->push_back(refs[i]);
+				rightBound.Union(refs[i].bound);
+			} else {
+				straddling.push_back(i);
 			}
+		}
+		int nLeft = left->size() + straddling.size(), nRight = right->size() + straddling.size();
+		for (int i : straddling) {
+			const Reference& ref = refs[i];
+			Bound b0 = ClipTriangle(ref.id, axis, FLOAT_MIN, plane), b1 = ClipTriangle(ref.id, axis, plane, FLOAT_MAX);
+			b0.Intersect(ref.bound);
+			b1.Intersect(ref.bound);
+			Bound l = leftBound, r = rightBound;
+			if (!b0.Empty()) l.Union(b0);
+			if (!b1.Empty()) r.Union(b1);
+			Bound lAll = leftBound, rAll = rightBound;
+			lAll.Union(ref.bound);
+			rAll.Union(ref.bound);
+			float splitCost = l.SurfaceArea() * nLeft + r.SurfaceArea() * nRight;
+			float leftCost = lAll.SurfaceArea() * nLeft + rightBound.SurfaceArea() * (nRight - 1);
+			float rightCost = leftBound.SurfaceArea() * (nLeft - 1) + rAll.SurfaceArea() * nRight;
+			if (b1.Empty() || (!b0.Empty() && leftCost < splitCost && leftCost <= rightCost)) {
+				left->push_back(ref);
+				leftBound = lAll;
+				--nRight;
+			} else if (b0.Empty() || rightCost < splitCost) {
+				right->push_back(ref);
+				rightBound = rAll;
+				--nLeft;
+			} else {
+				left->push_back({ ref.id, b0, (b0.pMin + b0.pMax) * .5f });
+				right->push_back({ ref.id, b1, (b1.pMin + b1.pMax) * .5f });
+				leftBound = l;
+				rightBound = r;
+			}
+		}
+	}
 
-			bvh.push_back({ bound, d, 0, L, R });
-			// BVHڵųУҶӽڵұߣֻ¼Ҷӱ
-			int nowId = nodeId;
-			int lc = BuildBVH(L, mid, depth + 1);
-			bvh[nowId].rightChild = BuildBVH(mid, R, depth + 1);
-			return nowId;
+	// 物体划分：与BuildBVH相同的分桶方式把引用分到左右儿子
+	void ObjectPartition(const std::vector<Reference>& refs, const Bound& centerBound, const glm::vec3& scale, int axis, int midBuc,
+		std::vector<Reference>* left, std::vector<Reference>* right) const {
+		const int nBuckets = BucketCount(refs.size());
+		for (const Reference& ref : refs) {
+			if (BucketIndex(ref.boundCenter[axis], centerBound.pMin[axis], scale[axis], nBuckets) <= midBuc)
+				left->push_back(ref);
+			else
+				right->push_back(ref);
+		}
 	}
 
-	int maxTrianglesInLeaf = 255;
-	float trav = 1.f;
+	static void ComputeBounds(const std::vector<Reference>& refs, Bound* bound, Bound* centerBound) {
+		for (const Reference& ref : refs) {
+			bound->Union(ref.bound);
+			centerBound->Union(ref.boundCenter);
+		}
+	}
+
+	/*
+		空间划分BVH：每个节点同时计算物体划分与空间划分的最小代价，物体划分的左右儿子重叠较大时才尝试空间划分
+		budget为该子树还能复制的引用数，划分后按三角形个数分给左右儿子
+	*/
+	BVHBuildNode* BuildSBVH(BuildArena& arena, std::vector<Reference> refs, const Bound& bound, const Bound& centerBound, int budget, int depth) {
+		arena.nodes.emplace_back();
+		BVHBuildNode* node = &arena.nodes.back();
+		node->bound = bound;
+		int nRefs = refs.size();
+		node->nRefs = nRefs;
+		if (nRefs <= 2) {
+			return MakeLeaf(node, arena, refs);
+		}
+
+		// 物体划分
+		std::vector<Reference> left, right;
+		glm::vec3 scale, diagonal = centerBound.Diagonal();
+		int d = -1, midBuc;
+		float minCost = FLOAT_MAX;
+		bool objectSplit = (diagonal.x > 0 || diagonal.y > 0 || diagonal.z > 0) &&
+			FindSplit(refs.data(), 0, nRefs, bound, centerBound, &scale, &d, &midBuc, &minCost);
+		float overlap = rootArea;
+		if (objectSplit) {
+			ObjectPartition(refs, centerBound, scale, d, midBuc, &left, &right);
+			Bound bound0, bound1, center;
+			ComputeBounds(left, &bound0, &center);
+			ComputeBounds(right, &bound1, &center);
+			bound0.Intersect(bound1);
+			overlap = bound0.Empty() ? 0.f : bound0.SurfaceArea();
+		}
+
+		// 空间划分
+		int spatialAxis, split;
+		float spatialCost;
+		bool spatial = budget > 0 && depth < MAX_SPATIAL_DEPTH && overlap > setting.splitAlpha * rootArea &&
+			FindSpatialSplit(refs, bound, budget, &spatialAxis, &split, &spatialCost) && spatialCost < minCost;
+		if (!objectSplit && !spatial) {
+			return MakeLeaf(node, arena, refs);
+		}
+		if (nRefs <= setting.maxTrianglesInLeaf && nRefs <= (spatial ? spatialCost : minCost)) {
+			return MakeLeaf(node, arena, refs);
+		}
+		if (spatial) {
+			std::vector<Reference> spatialLeft, spatialRight;
+			SpatialPartition(refs, bound, spatialAxis, split, &spatialLeft, &spatialRight);
+			// 不复制引用时某一侧可能为空，此时仍使用物体划分
+			if (!spatialLeft.empty() && !spatialRight.empty()) {
+				left.swap(spatialLeft);
+				right.swap(spatialRight);
+				d = spatialAxis;
+			} else if (!objectSplit) {
+				return MakeLeaf(node, arena, refs);
+			}
+		}
+		std::vector<Reference>().swap(refs);
+
+		int nLeft = left.size(), nRight = right.size();
+		int remaining = std::max(0, budget - (nLeft + nRight - nRefs));
+		int leftBudget = (int)((long long)remaining * nLeft / (nLeft + nRight));
+		int rightBudget = remaining - leftBudget;
+		Bound bound0, bound1, center0, center1;
+		ComputeBounds(left, &bound0, &center0);
+		ComputeBounds(right, &bound1, &center1);
+
+		node->axis = d;
+		if (nRefs >= PARALLEL_BUILD_THRESHOLD) {
+			TaskGroup group;
+			group.Run([&]() { node->children[1] = BuildSBVH(*NewArena(), std::move(right), bound1, center1, rightBudget, depth + 1); });
+			node->children[0] = BuildSBVH(arena, std::move(left), bound0, center0, leftBudget, depth + 1);
+			group.Wait();
+		} else {
+			node->children[0] = BuildSBVH(arena, std::move(left), bound0, center0, leftBudget, depth + 1);
+			node->children[1] = BuildSBVH(arena, std::move(right), bound1, center1, rightBudget, depth + 1);
+		}
+		node->nNodes = 1 + node->children[0]->nNodes + node->children[1]->nNodes;
+		node->nRefs = node->children[0]->nRefs + node->children[1]->nRefs;
+		return node;
+	}
+
+	/*
+		LBVH：把三角形包围盒中心量化后交错各个轴的二进制位得到Morton码，按Morton码排序后
+		相邻三角形在空间上也相邻，再按照Karras的方法并行求出每个内部节点覆盖的区间与划分位置
+	*/
+	// Karras树的内部节点，覆盖排序后[first, last]的三角形，在split与split + 1之间划分
+	struct LBVHNode {
+		int first, last, split, axis;
+	};
+
+	static int CountLeadingZeros(uint64_t x) {
+#ifdef _MSC_VER
+		unsigned long index;
+		return _BitScanReverse64(&index, x) ? 63 - (int)index : 64;
+#else
+		return x ? __builtin_clzll(x) : 64;
+#endif
+	}
+
+	// 排序后第i个与第j个Morton码的公共前缀长度，Morton码相同时以下标区分，j越界时返回-1
+	static int Delta(const std::vector<MortonPrimitive>& prims, int i, int j) {
+		if (j < 0 || j >= (int)prims.size()) return -1;
+		if (prims[i].code == prims[j].code) return 64 + CountLeadingZeros((uint64_t)(i ^ j));
+		return CountLeadingZeros(prims[i].code ^ prims[j].code);
+	}
+
+	// Karras(2012)：由相邻Morton码的公共前缀长度确定第i个内部节点的区间方向、另一端点以及划分位置
+	static LBVHNode KarrasNode(const std::vector<MortonPrimitive>& prims, int i) {
+		int d = Delta(prims, i, i + 1) > Delta(prims, i, i - 1) ? 1 : -1;
+		// 先倍增再二分求出区间另一端
+		int deltaMin = Delta(prims, i, i - d);
+		int lMax = 2;
+		while (Delta(prims, i, i + lMax * d) > deltaMin) lMax *= 2;
+		int l = 0;
+		for (int t = lMax / 2; t >= 1; t /= 2) {
+			if (Delta(prims, i, i + (l + t) * d) > deltaMin) l += t;
+		}
+		int j = i + l * d;
+		// 二分求出公共前缀长度大于整个区间公共前缀的最远位置，即划分位置
+		int deltaNode = Delta(prims, i, j);
+		int s = 0;
+		for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+			if (Delta(prims, i, i + (s + t) * d) > deltaNode) s += t;
+			if (t == 1) break;
+		}
+		LBVHNode node;
+		node.first = std::min(i, j);
+		node.last = std::max(i, j);
+		node.split = i + s * d + std::min(d, 0);
+		// 区间内第一个不同的位决定划分轴，Morton码每三位依次为x、y、z
+		node.axis = deltaNode < 64 ? 2 - (63 - deltaNode) % 3 : 0;
+		return node;
+	}
+
+	void BuildLBVH() {
+		const int n = triangles.size();
+		Bound centerBound;
+		for (int i = 0; i < n; ++i) {
+			triangles[i].primitiveId = i;
+			centerBound.Union(triangles[i].boundCenter);
+		}
+		// 中心归一化到[0, 1]后计算Morton码
+		const int bitsPerAxis = setting.mortonBits / 3;
+		glm::vec3 diagonal = centerBound.Diagonal();
+		glm::vec3 invDiagonal;
+		for (int d = 0; d < 3; ++d)
+			invDiagonal[d] = diagonal[d] > 0 ? 1.f / diagonal[d] : 0.f;
+		std::vector<MortonPrimitive> prims(n);
+		ParallelFor(0, n, 4096, [&](int i) {
+			prims[i] = { MortonCode((triangles[i].boundCenter - centerBound.pMin) * invDiagonal, bitsPerAxis), i };
+		});
+		RadixSort(&prims, setting.mortonBits);
+
+		// 按Morton码顺序重排三角形，第i个叶子节点即为第i个三角形
+		std::vector<Triangle> sorted(n);
+		ParallelFor(0, n, 4096, [&](int i) { sorted[i] = triangles[prims[i].index]; });
+		triangles.swap(sorted);
+
+		// n个叶子节点对应n - 1个内部节点，每个内部节点互不依赖，可以并行求出
+		lbvhNodes.resize(std::max(n - 1, 0));
+		ParallelFor(0, n - 1, 1024, [&](int i) { lbvhNodes[i] = KarrasNode(prims, i); });
+
+		// 子树覆盖k个三角形时共有2k - 1个节点，由此直接得到前序展开时每个节点的位置
+		nodeCount = 2 * n - 1;
+		bvh.resize(nodeCount);
+		FlattenLBVH(0, n == 1, 0);
+		std::vector<LBVHNode>().swap(lbvhNodes);
+	}
+
+	// 前序展开Karras树并自底向上求包围盒，id为内部节点或叶子（排序后三角形）的编号
+	void FlattenLBVH(int id, bool leaf, int offset) {
+		if (leaf) {
+			bvh[offset] = { triangles[id].bound, -1, -1, id, id + 1 };
+			return;
+		}
+		const LBVHNode& node = lbvhNodes[id];
+		bool leftLeaf = node.first == node.split, rightLeaf = node.last == node.split + 1;
+		int rightChild = offset + 1 + 2 * (node.split - node.first + 1) - 1;
+		if (node.last - node.first >= PARALLEL_BUILD_THRESHOLD) {
+			TaskGroup group;
+			group.Run([&]() { FlattenLBVH(node.split + 1, rightLeaf, rightChild); });
+			FlattenLBVH(node.split, leftLeaf, offset + 1);
+			group.Wait();
+		} else {
+			FlattenLBVH(node.split, leftLeaf, offset + 1);
+			FlattenLBVH(node.split + 1, rightLeaf, rightChild);
+		}
+		Bound bound = bvh[offset + 1].bound;
+		bound.Union(bvh[rightChild].bound);
+		bvh[offset] = { bound, node.axis, rightChild, node.first, node.last + 1 };
+	}
+
+	/*
+		将构建节点展开到bvh[offset]开始的位置：左儿子紧跟在当前节点之后，只记录右儿子编号
+		子树的三角形从triOffset开始连续存放，空间划分时把叶子引用的三角形复制到refTriangles中
+	*/
+	void FlattenBVH(const BVHBuildNode* node, int offset, int triOffset, std::vector<Triangle>* refTriangles) {
+		if (!node->children[0]) {
+			if (node->refs) {
+				for (int i = 0; i < node->nRefs; ++i)
+					(*refTriangles)[triOffset + i] = triangles[node->refs[i]];
+			}
+			bvh[offset] = { node->bound, -1, -1, triOffset, triOffset + node->nRefs };
+			return;
+		}
+		int rightChild = offset + 1 + node->children[0]->nNodes;
+		int rightTriOffset = triOffset + node->children[0]->nRefs;
+		bvh[offset] = { node->bound, node->axis, rightChild, triOffset, triOffset + node->nRefs };
+		if (node->nNodes >= PARALLEL_BUILD_THRESHOLD) {
+			TaskGroup group;
+			group.Run([&]() { FlattenBVH(node->children[1], rightChild, rightTriOffset, refTriangles); });
+			FlattenBVH(node->children[0], offset + 1, triOffset, refTriangles);
+			group.Wait();
+		} else {
+			FlattenBVH(node->children[0], offset + 1, triOffset, refTriangles);
+			FlattenBVH(node->children[1], rightChild, rightTriOffset, refTriangles);
+		}
+	}
+
+	std::vector<std::unique_ptr<BuildArena>> arenas;
+	std::mutex arenaMutex;
+	float rootArea = 0.f;
+	std::vector<LBVHNode> lbvhNodes;
+	std::vector<OptNode> optNodes;
+	std::vector<WideBVHNode> wideNodes;
+	std::vector<TriangleBlock> triangleBlocks;
+	std::vector<int> leafBlocks;
+	std::vector<int> wideSlots; // 二叉树节点在宽BVH中的位置：宽节点编号 * WIDE_BVH_WIDTH + 槽位，不在任何槽位中（根节点）为-1
 public:
 	std::vector<Vertex> vertices;
 	std::vector<Triangle> triangles;
 	std::vector<BVHNode> bvh;
-};
\ No newline at end of file
+	int nodeCount = 0;
+	float buildCost = 0.f; // 构建完成时的SAH代价，用于判断Refit后树的质量
+	BVHOptimizeResult optimizeResult; // 构造时按setting.optimizePasses进行优化的结果
+	BVHSetting setting;
+};
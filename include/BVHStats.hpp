@@ -0,0 +1,298 @@
+#pragma once
+#include "PnRT.hpp"
+#include "bound.hpp"
+#include "triangle.hpp"
+#include "camera.hpp"
+#include "parallel.hpp"
+#include "BVH.hpp"
+
+/*
+	BVH质量统计，用于比较不同的构建方法以及调整maxTrianglesInLeaf、trav等参数
+	SAH：节点表面积与根节点表面积之比加权的代价
+	EPO：节点包围盒中不属于其子树的三角形面积加权的代价，与SAH互补，能反映SBVH等方法减少的重叠
+	重叠：内部节点左右儿子包围盒交集的表面积
+*/
+struct BVHStats {
+	int nNodes = 0;
+	int nLeaves = 0;
+	int nTriangleRefs = 0; // 三角形引用数，空间划分时大于三角形数
+	int nPrimitives = 0; // 原始三角形数
+	float sahCost = 0.f;
+	float epo = 0.f; // 未计算时为负数
+	int maxDepth = 0;
+	double avgLeafDepth = 0.0;
+	double avgLeafSize = 0.0;
+	std::vector<int> depthHistogram; // 第i项为深度为i的叶子数
+	std::vector<int> leafSizeHistogram; // 第i项为三角形数在(2^(i-1), 2^i]中的叶子数，第0项为三角形数不超过1的叶子数
+	float overlapSAH = 0.f; // 所有内部节点左右儿子包围盒交集的表面积之和与根节点表面积之比
+	float avgOverlapRatio = 0.f; // 内部节点左右儿子包围盒交集的表面积与节点表面积之比的平均值
+};
+
+// 一类光线的求交统计
+struct BVHRayStatsEntry {
+	int64_t rays = 0;
+	int64_t hits = 0;
+	TraversalStats traversal;
+};
+
+struct BVHRayStats {
+	BVHRayStatsEntry primary; // 相机光线
+	BVHRayStatsEntry shadow; // 从主光线交点射向光源的遮挡测试
+	BVHRayStatsEntry diffuse; // 从主光线交点按余弦分布采样的反射光线
+};
+
+// 三角形被包围盒裁剪后的面积，Sutherland-Hodgman逐个平面裁剪多边形
+inline float ClippedTriangleArea(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const Bound& bound) {
+	glm::vec3 polygon[9], clipped[9];
+	polygon[0] = p0, polygon[1] = p1, polygon[2] = p2;
+	int n = 3;
+	for (int axis = 0; axis < 3 && n; ++axis) {
+		for (int side = 0; side < 2 && n; ++side) {
+			float plane = side ? bound.pMax[axis] : bound.pMin[axis];
+			float sign = side ? -1.f : 1.f; // 保留sign * (p[axis] - plane) >= 0的部分
+			int m = 0;
+			for (int i = 0; i < n; ++i) {
+				const glm::vec3& a = polygon[i];
+				const glm::vec3& b = polygon[(i + 1) % n];
+				float da = sign * (a[axis] - plane), db = sign * (b[axis] - plane);
+				if (da >= 0) clipped[m++] = a;
+				if ((da >= 0) != (db >= 0)) {
+					glm::vec3 p = a + (b - a) * (da / (da - db));
+					p[axis] = plane;
+					clipped[m++] = p;
+				}
+			}
+			n = m;
+			for (int i = 0; i < n; ++i) polygon[i] = clipped[i];
+		}
+	}
+	if (n < 3) return 0.f;
+	glm::vec3 cross(0.f);
+	for (int i = 1; i + 1 < n; ++i) cross += glm::cross(polygon[i] - polygon[0], polygon[i + 1] - polygon[0]);
+	return glm::length(cross) * 0.5f;
+}
+
+/*
+	节点包围盒中不属于其子树的三角形面积：从根节点开始查找与节点包围盒相交的叶子，跳过节点自身的子树
+	子树的三角形在数组中连续，因此三角形区间包含于节点区间的子树即为节点自身的子树
+	空间划分时一个三角形引用只代表它在叶子包围盒中的部分，因此用节点与叶子包围盒的交集裁剪
+*/
+inline double ForeignArea(const BVH& bvh, int nodeId) {
+	const BVHNode& target = bvh.bvh[nodeId];
+	double area = 0.0;
+	int nodeStack[128], top = 0;
+	nodeStack[top++] = 0;
+	while (top) {
+		const BVHNode& node = bvh.bvh[nodeStack[--top]];
+		int curId = &node - bvh.bvh.data();
+		Bound overlap = node.bound;
+		overlap.Intersect(target.bound);
+		if (overlap.Empty()) continue;
+		if (node.startIndex >= target.startIndex && node.endIndex <= target.endIndex) continue;
+		if (node.rightChild != -1) {
+			nodeStack[top++] = curId + 1;
+			nodeStack[top++] = node.rightChild;
+			continue;
+		}
+		for (int i = node.startIndex; i < node.endIndex; ++i) {
+			const Triangle& tri = bvh.triangles[i];
+			area += ClippedTriangleArea(bvh.vertices[tri.indices[0]].position, bvh.vertices[tri.indices[1]].position,
+				bvh.vertices[tri.indices[2]].position, overlap);
+		}
+	}
+	return area;
+}
+
+/*
+	统计树的结构与质量，computeEPO为false时跳过EPO（需要对每个节点查询一次树，较慢）
+	EPO的代价与SAH相同：内部节点为trav，叶子为三角形数，再除以所有原始三角形的面积之和
+*/
+inline BVHStats ComputeBVHStats(const BVH& bvh, bool computeEPO = true) {
+	BVHStats stats;
+	const std::vector<BVHNode>& nodes = bvh.bvh;
+	if (nodes.empty()) return stats;
+	stats.nNodes = nodes.size();
+	stats.nTriangleRefs = bvh.triangles.size();
+	stats.sahCost = bvh.SAHCost();
+	float rootArea = nodes[0].bound.SurfaceArea();
+
+	// 按先序遍历计算深度，左儿子紧跟在父节点之后
+	std::vector<int> depth(nodes.size(), 0);
+	double overlapSum = 0.0, overlapRatioSum = 0.0;
+	int64_t leafDepthSum = 0;
+	for (int i = 0; i < (int)nodes.size(); ++i) {
+		const BVHNode& node = nodes[i];
+		if (node.rightChild == -1) {
+			int size = node.endIndex - node.startIndex;
+			++stats.nLeaves;
+			leafDepthSum += depth[i];
+			stats.maxDepth = std::max(stats.maxDepth, depth[i]);
+			if ((int)stats.depthHistogram.size() <= depth[i]) stats.depthHistogram.resize(depth[i] + 1, 0);
+			++stats.depthHistogram[depth[i]];
+			int bucket = 0;
+			while ((1 << bucket) < size) ++bucket;
+			if ((int)stats.leafSizeHistogram.size() <= bucket) stats.leafSizeHistogram.resize(bucket + 1, 0);
+			++stats.leafSizeHistogram[bucket];
+			continue;
+		}
+		depth[i + 1] = depth[node.rightChild] = depth[i] + 1;
+		Bound overlap = nodes[i + 1].bound;
+		overlap.Intersect(nodes[node.rightChild].bound);
+		if (!overlap.Empty()) {
+			float area = overlap.SurfaceArea();
+			overlapSum += area;
+			if (node.bound.SurfaceArea() > 0.f) overlapRatioSum += area / node.bound.SurfaceArea();
+		}
+	}
+	int nInteriors = stats.nNodes - stats.nLeaves;
+	stats.avgLeafDepth = (double)leafDepthSum / stats.nLeaves;
+	stats.avgLeafSize = (double)stats.nTriangleRefs / stats.nLeaves;
+	stats.overlapSAH = rootArea > 0.f ? (float)(overlapSum / rootArea) : 0.f;
+	stats.avgOverlapRatio = nInteriors ? (float)(overlapRatioSum / nInteriors) : 0.f;
+
+	// 空间划分复制的三角形引用只计算一次面积
+	std::vector<bool> counted;
+	double totalArea = 0.0;
+	for (const auto& tri : bvh.triangles) {
+		int id = tri.primitiveId;
+		if (id >= 0) {
+			if (id >= (int)counted.size()) counted.resize(id + 1, false);
+			if (counted[id]) continue;
+			counted[id] = true;
+		}
+		++stats.nPrimitives;
+		totalArea += tri.area;
+	}
+
+	stats.epo = -1.f;
+	if (computeEPO && totalArea > 0.0) {
+		std::vector<double> cost(nodes.size(), 0.0);
+		ParallelFor(0, nodes.size(), 64, [&](int i) {
+			const BVHNode& node = nodes[i];
+			float c = node.rightChild == -1 ? (float)(node.endIndex - node.startIndex) : bvh.setting.trav;
+			cost[i] = c * ForeignArea(bvh, i);
+		});
+		double epo = 0.0;
+		for (double c : cost) epo += c;
+		stats.epo = (float)(epo / totalArea);
+	}
+	return stats;
+}
+
+/*
+	使用CPU求交统计每条光线访问的节点数与三角形求交次数
+	主光线从相机发出，每个像素一条，worldToBVH把世界空间的光线变换到BVH所在的空间（如实例的模型空间）
+	击中后从交点发出一条阴影光线和一条漫反射光线：阴影光线射向自发光三角形上的随机点，
+	BVH中没有自发光三角形时射向根节点包围盒顶面上的随机点；漫反射光线按余弦分布采样
+	每个像素使用独立的随机数种子，结果与线程数无关
+*/
+inline BVHRayStats MeasureBVHRays(const BVH& bvh, const Camera& camera, int width, int height,
+	const glm::mat4& worldToBVH = glm::mat4(1), uint32_t seed = 1) {
+	BVHRayStats result;
+	if (bvh.bvh.empty()) return result;
+	// 自发光三角形按面积的前缀和
+	std::vector<int> emitters;
+	std::vector<float> emitterArea;
+	for (int i = 0; i < (int)bvh.triangles.size(); ++i) {
+		const Triangle& tri = bvh.triangles[i];
+		if (tri.materialId < 0 || tri.materialId >= (int)materials.size()) continue;
+		if (materials[tri.materialId].emssive == glm::vec3(0)) continue;
+		emitters.push_back(i);
+		emitterArea.push_back((emitterArea.empty() ? 0.f : emitterArea.back()) + tri.area);
+	}
+	const Bound& root = bvh.bvh[0].bound;
+
+	std::vector<BVHRayStats> rows(height);
+	ParallelFor(0, height, 1, [&](int y) {
+		BVHRayStats& row = rows[y];
+		for (int x = 0; x < width; ++x) {
+			std::mt19937 rng(seed * 9781u + (uint32_t)(y * width + x) * 6271u);
+			std::uniform_real_distribution<float> uniform(0.f, 1.f);
+			Ray worldRay = CameraGetRay(camera, (x + 0.5f) / width, (y + 0.5f) / height);
+			Ray ray;
+			ray.origin = glm::vec3(worldToBVH * glm::vec4(worldRay.origin, 1.f));
+			ray.dir = glm::vec3(worldToBVH * glm::vec4(worldRay.dir, 0.f));
+			Interaction isect;
+			++row.primary.rays;
+			if (!bvh.Intersect(ray, &isect, &row.primary.traversal)) continue;
+			++row.primary.hits;
+			const glm::vec3 n = isect.normal;
+			const glm::vec3 origin = isect.position + n * ShadowEpsilon;
+
+			glm::vec3 target;
+			if (!emitters.empty()) {
+				float u = uniform(rng) * emitterArea.back();
+				int k = std::lower_bound(emitterArea.begin(), emitterArea.end(), u) - emitterArea.begin();
+				const Triangle& tri = bvh.triangles[emitters[std::min(k, (int)emitters.size() - 1)]];
+				float su = std::sqrt(uniform(rng)), v = uniform(rng);
+				target = bvh.vertices[tri.indices[0]].position * (1.f - su) +
+					bvh.vertices[tri.indices[1]].position * (su * (1.f - v)) + bvh.vertices[tri.indices[2]].position * (su * v);
+			} else {
+				target = glm::vec3(root.pMin.x + uniform(rng) * (root.pMax.x - root.pMin.x), root.pMax.y,
+					root.pMin.z + uniform(rng) * (root.pMax.z - root.pMin.z));
+			}
+			Ray shadowRay;
+			shadowRay.origin = origin;
+			shadowRay.dir = target - origin;
+			shadowRay.tMax = 1.f - ShadowEpsilon;
+			++row.shadow.rays;
+			if (bvh.IntersectP(shadowRay, &row.shadow.traversal)) ++row.shadow.hits;
+
+			// 以法线为z轴的余弦分布采样
+			glm::vec3 t = std::abs(n.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+			glm::vec3 b1 = glm::normalize(glm::cross(n, t)), b2 = glm::cross(n, b1);
+			float r = std::sqrt(uniform(rng)), phi = 2.f * PI * uniform(rng);
+			Ray diffuseRay;
+			diffuseRay.origin = origin;
+			diffuseRay.dir = b1 * (r * std::cos(phi)) + b2 * (r * std::sin(phi)) + n * std::sqrt(std::max(0.f, 1.f - r * r));
+			Interaction diffuseIsect;
+			++row.diffuse.rays;
+			if (bvh.Intersect(diffuseRay, &diffuseIsect, &row.diffuse.traversal)) ++row.diffuse.hits;
+		}
+	});
+	auto accumulate = [](BVHRayStatsEntry& dst, const BVHRayStatsEntry& src) {
+		dst.rays += src.rays;
+		dst.hits += src.hits;
+		dst.traversal.nodeVisits += src.traversal.nodeVisits;
+		dst.traversal.triangleTests += src.traversal.triangleTests;
+	};
+	for (const auto& row : rows) {
+		accumulate(result.primary, row.primary);
+		accumulate(result.shadow, row.shadow);
+		accumulate(result.diffuse, row.diffuse);
+	}
+	return result;
+}
+
+inline void PrintBVHStats(std::ostream& out, const BVHStats& stats) {
+	out << "BVH: " << stats.nNodes << " nodes, " << stats.nLeaves << " leaves, " << stats.nTriangleRefs << " triangle references of "
+		<< stats.nPrimitives << " triangles" << std::endl;
+	out << "  SAH cost: " << stats.sahCost;
+	if (stats.epo >= 0.f) out << ", EPO: " << stats.epo;
+	out << std::endl;
+	out << "  overlap: " << stats.overlapSAH << " of root area, " << stats.avgOverlapRatio * 100.f << "% of node area on average" << std::endl;
+	out << "  depth: max " << stats.maxDepth << ", leaf average " << stats.avgLeafDepth << std::endl;
+	out << "  leaf depth histogram:";
+	for (int i = 0; i < (int)stats.depthHistogram.size(); ++i)
+		if (stats.depthHistogram[i]) out << " " << i << ":" << stats.depthHistogram[i];
+	out << std::endl;
+	out << "  leaf size: average " << stats.avgLeafSize << ", histogram:";
+	for (int i = 0; i < (int)stats.leafSizeHistogram.size(); ++i) {
+		if (!stats.leafSizeHistogram[i]) continue;
+		if (i <= 1) out << " " << (1 << i);
+		else out << " " << (1 << (i - 1)) + 1 << "-" << (1 << i);
+		out << ":" << stats.leafSizeHistogram[i];
+	}
+	out << std::endl;
+}
+
+inline void PrintBVHRayStats(std::ostream& out, const BVHRayStats& stats) {
+	auto print = [&](const char* name, const BVHRayStatsEntry& e) {
+		double rays = std::max<int64_t>(e.rays, 1);
+		out << "  " << name << ": " << e.rays << " rays, " << e.hits * 100.0 / rays << "% hit, "
+			<< e.traversal.nodeVisits / rays << " nodes and " << e.traversal.triangleTests / rays << " triangles per ray" << std::endl;
+	};
+	print("primary", stats.primary);
+	print("shadow", stats.shadow);
+	print("diffuse", stats.diffuse);
+}
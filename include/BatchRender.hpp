@@ -0,0 +1,197 @@
+#pragma once
+#include "PnRT.hpp"
+#include "camera.hpp"
+#include "CPURenderer.hpp"
+
+/*
+	离线批量渲染
+	从命令行读取场景、相机、分辨率以及目标采样数或渲染时间，使用CPU渲染器渲染，不创建窗口
+	渲染结束后输出PNG（与窗口显示相同，线性颜色截断到[0, 1]）与Radiance HDR（线性颜色）并退出
+*/
+struct BatchSetting {
+	bool enabled = false;
+	std::string scene = "CornellBox";
+	// 未指定时使用场景中的相机
+	bool hasEye = false, hasCenter = false, hasFov = false;
+	glm::vec3 eye = glm::vec3(0.f);
+	glm::vec3 center = glm::vec3(0.f);
+	float fov = 45.f;
+	int width = SCREEN_WIDTH;
+	int height = SCREEN_HEIGHT;
+	// 达到任意一个目标即停止，都未指定时渲染64spp
+	int spp = 0;
+	float seconds = 0.f;
+	int maxBounce = 4;
+	bool clampSample = true;
+	bool packet = false; // 主光线与阴影射线使用光线包求交
+	bool stream = false; // 弹射光线与阴影射线排序后成批求交
+	bool occlusionCache = false; // 灯光的阴影射线先测试上一次遮挡同一灯光的三角形
+	std::string hdr; // 环境贴图，为空时使用默认贴图
+	bool noHDR = false;
+	std::string output = "render"; // 输出output.png与output.hdr
+};
+
+inline void PrintBatchUsage() {
+	std::cout << "Usage: PnRayTracing --batch [options]\n"
+		"  --scene <name>        CornellBox, SceneFlat or teapot\n"
+		"  --eye <x,y,z>         camera position\n"
+		"  --center <x,y,z>      camera look-at point\n"
+		"  --fov <degrees>       vertical field of view\n"
+		"  --width <n>           image width\n"
+		"  --height <n>          image height\n"
+		"  --spp <n>             samples per pixel\n"
+		"  --seconds <t>         render time limit\n"
+		"  --bounce <n>          max bounce depth, 1 to 4 like the GPU\n"
+		"  --no-clamp            keep full range samples instead of clamping to [0, 1] like the GPU\n"
+		"  --packet              trace primary and shadow rays in packets of 8\n"
+		"  --stream              sort bounce and shadow rays of a tile before tracing\n"
+		"  --occlusion-cache     test the last occluder of each light first for shadow rays\n"
+		"  --hdr <path>          environment map\n"
+		"  --no-hdr              render without environment map\n"
+		"  --output <path>       output path without extension, writes .png and .hdr\n";
+}
+
+inline bool ParseVec3(const std::string& s, glm::vec3* v) {
+	return std::sscanf(s.c_str(), "%f,%f,%f", &v->x, &v->y, &v->z) == 3;
+}
+
+// 解析命令行，没有--batch时不启用批量渲染；参数错误时输出用法并返回false
+inline bool ParseBatchSetting(int argc, char** argv, BatchSetting* setting) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		std::string value = hasValue ? argv[i + 1] : "";
+		bool ok = true;
+		if (arg == "--batch") {
+			setting->enabled = true;
+			continue;
+		} else if (arg == "--no-clamp") {
+			setting->clampSample = false;
+			continue;
+		} else if (arg == "--packet") {
+			setting->packet = true;
+			continue;
+		} else if (arg == "--stream") {
+			setting->stream = true;
+			continue;
+		} else if (arg == "--occlusion-cache") {
+			setting->occlusionCache = true;
+			continue;
+		} else if (arg == "--no-hdr") {
+			setting->noHDR = true;
+			continue;
+		} else if (arg == "--help" || arg == "-h") {
+			PrintBatchUsage();
+			return false;
+		} else if (!hasValue) {
+			ok = false;
+		} else if (arg == "--scene") {
+			setting->scene = value;
+		} else if (arg == "--eye") {
+			ok = setting->hasEye = ParseVec3(value, &setting->eye);
+		} else if (arg == "--center") {
+			ok = setting->hasCenter = ParseVec3(value, &setting->center);
+		} else if (arg == "--fov") {
+			setting->fov = std::atof(value.c_str());
+			ok = setting->hasFov = setting->fov > 0.f && setting->fov < 180.f;
+		} else if (arg == "--width") {
+			setting->width = std::atoi(value.c_str());
+			ok = setting->width > 0;
+		} else if (arg == "--height") {
+			setting->height = std::atoi(value.c_str());
+			ok = setting->height > 0;
+		} else if (arg == "--spp") {
+			setting->spp = std::atoi(value.c_str());
+			ok = setting->spp > 0;
+		} else if (arg == "--seconds") {
+			setting->seconds = std::atof(value.c_str());
+			ok = setting->seconds > 0.f;
+		} else if (arg == "--bounce") {
+			setting->maxBounce = std::atoi(value.c_str());
+			ok = setting->maxBounce > 0 && setting->maxBounce <= SOBOL_MAX_BOUNCE;
+		} else if (arg == "--hdr") {
+			setting->hdr = value;
+		} else if (arg == "--output") {
+			setting->output = value;
+		} else {
+			ok = false;
+		}
+		if (!ok) {
+			std::cout << "Invalid argument: " << arg << (hasValue ? " " + value : "") << std::endl;
+			PrintBatchUsage();
+			return false;
+		}
+		++i;
+	}
+	if (setting->spp == 0 && setting->seconds == 0.f) setting->spp = 64;
+	// 输出路径带有扩展名时去掉扩展名
+	std::string& output = setting->output;
+	size_t dot = output.find_last_of('.');
+	if (dot != std::string::npos && output.find_first_of("/\\", dot) == std::string::npos) {
+		std::string ext = output.substr(dot);
+		if (ext == ".png" || ext == ".hdr") output = output.substr(0, dot);
+	}
+	return true;
+}
+
+// 在场景设置的相机上应用命令行中的相机与分辨率
+inline void SetupBatchCamera(const BatchSetting& setting, Camera* camera) {
+	glm::vec3 eye = setting.hasEye ? setting.eye : camera->eye;
+	glm::vec3 center = setting.hasCenter ? setting.center : camera->center;
+	float fov = setting.hasFov ? setting.fov : camera->fov;
+	camera->UpdateCamera(eye, center, camera->up, fov, (float)setting.width / setting.height);
+}
+
+// 写出PNG与HDR，图像第0行为顶部，渲染器第0行为底部
+inline bool SaveRenderImage(const CPURenderer& renderer, const std::string& output) {
+	int width = renderer.Setting().width, height = renderer.Setting().height;
+	std::vector<unsigned char> ldr(width * height * 3);
+	std::vector<float> hdr(width * height * 3);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			glm::vec3 color = renderer.GetPixel(x, height - 1 - y);
+			int pos = 3 * (y * width + x);
+			for (int c = 0; c < 3; ++c) {
+				hdr[pos + c] = color[c];
+				ldr[pos + c] = (unsigned char)(Clamp(color[c], 0.f, 1.f) * 255.f + 0.5f);
+			}
+		}
+	}
+	bool ok = true;
+	std::string pngPath = output + ".png", hdrPath = output + ".hdr";
+	if (!stbi_write_png(pngPath.c_str(), width, height, 3, ldr.data(), width * 3)) {
+		std::cout << "Failed to write " << pngPath << std::endl;
+		ok = false;
+	}
+	if (!stbi_write_hdr(hdrPath.c_str(), width, height, 3, hdr.data())) {
+		std::cout << "Failed to write " << hdrPath << std::endl;
+		ok = false;
+	}
+	if (ok) std::cout << "Write " << pngPath << " and " << hdrPath << std::endl;
+	return ok;
+}
+
+// 每轮给所有像素增加1spp，直到达到目标采样数或时间，返回是否成功写出图像
+inline bool RenderBatch(CPURenderer& renderer, const Camera& camera, const BatchSetting& setting) {
+	using Clock = std::chrono::steady_clock;
+	auto begin = Clock::now();
+	double elapsed = 0.0, lastReport = 0.0;
+	while ((setting.spp == 0 || renderer.FrameCount() < setting.spp) &&
+		(setting.seconds == 0.f || elapsed < setting.seconds)) {
+		renderer.Render(camera, 1);
+		elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+		if (elapsed - lastReport >= 1.0) {
+			lastReport = elapsed;
+			std::cout << "Rendered " << renderer.FrameCount() << " spp, " << elapsed << " s" << std::endl;
+		}
+	}
+	double samples = (double)renderer.FrameCount() * setting.width * setting.height;
+	std::cout << "Render " << setting.width << "x" << setting.height << " with " << renderer.FrameCount() << " spp in "
+		<< elapsed << " s, " << samples / std::max(elapsed, 1e-9) << " samples/s on "
+		<< GlobalThreadPool().NumThreads() << " threads" << std::endl;
+	if (renderer.Setting().occlusionCache) {
+		std::cout << "Occlusion cache: " << renderer.OcclusionCacheQueries() << " light shadow rays, "
+			<< renderer.OcclusionCacheHitRate() * 100.f << "% blocked by the cached occluder" << std::endl;
+	}
+	return SaveRenderImage(renderer, setting.output);
+}
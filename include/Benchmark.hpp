@@ -0,0 +1,437 @@
+#pragma once
+#include "PnRT.hpp"
+#include "camera.hpp"
+#include "triangle.hpp"
+#include "light.hpp"
+#include "model.hpp"
+#include "BVH.hpp"
+#include "RayQuery.hpp"
+#include "CompressedBVH.hpp"
+#include "BSDF.hpp"
+#include "sampler.hpp"
+#include "parallel.hpp"
+
+/*
+	光线求交性能测试
+	对内置场景与命令行给出的模型分别构建与渲染时相同设置的BVH，生成三组固定的光线：
+		primary：相机发出的相干光线，每个像素中心一条
+		diffuse：从primary的交点按余弦分布发出的非相干光线
+		shadow：从primary的交点指向灯光上随机一点的阴影光线，场景没有灯光时指向场景上方的一点
+	分别测量最近交点(Intersect)与任意交点(IntersectP)的吞吐量，取多次运行中最快的一次
+	primary与shadow光线另外按相邻的8条组成光线包测量(IntersectPacket/OccludedPacket)，并给出相对单条光线的加速比
+	三组光线另外转换为SoA数组，通过批量查询接口RayQuery测量
+	结果每行一个JSON对象输出，便于不同版本之间比较；加载日志输出到标准错误
+*/
+struct BenchmarkSetting {
+	bool enabled = false;
+	std::vector<std::string> scenes; // 为空时测试所有内置场景
+	std::vector<std::string> meshes; // 额外测试的模型文件
+	int width = 512;
+	int height = 512;
+	int repeat = 5;
+	bool serial = false; // 只使用调用线程，结果不受核心数影响
+	std::string output; // 为空时输出到标准输出
+};
+
+inline void PrintBenchmarkUsage() {
+	std::cout << "Usage: PnRayTracing --benchmark [options]\n"
+		"  --scene <name>        built-in scene to test, can be repeated (default: all)\n"
+		"  --model <path>        extra mesh to test, can be repeated\n"
+		"  --width <n>           primary ray grid width\n"
+		"  --height <n>          primary ray grid height\n"
+		"  --repeat <n>          runs per measurement, the fastest is reported\n"
+		"  --serial              trace on the calling thread only\n"
+		"  --output <path>       write results to a file instead of stdout\n";
+}
+
+// 第一个参数为--benchmark时启用，参数错误时输出用法并返回false
+inline bool ParseBenchmarkSetting(int argc, char** argv, BenchmarkSetting* setting) {
+	if (argc < 2 || std::string(argv[1]) != "--benchmark") return true;
+	setting->enabled = true;
+	for (int i = 2; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		std::string value = hasValue ? argv[i + 1] : "";
+		bool ok = true;
+		if (arg == "--serial") {
+			setting->serial = true;
+			continue;
+		} else if (arg == "--help" || arg == "-h") {
+			PrintBenchmarkUsage();
+			return false;
+		} else if (!hasValue) {
+			ok = false;
+		} else if (arg == "--scene") {
+			setting->scenes.push_back(value);
+		} else if (arg == "--model") {
+			setting->meshes.push_back(value);
+		} else if (arg == "--width") {
+			setting->width = std::atoi(value.c_str());
+			ok = setting->width > 0;
+		} else if (arg == "--height") {
+			setting->height = std::atoi(value.c_str());
+			ok = setting->height > 0;
+		} else if (arg == "--repeat") {
+			setting->repeat = std::atoi(value.c_str());
+			ok = setting->repeat > 0;
+		} else if (arg == "--output") {
+			setting->output = value;
+		} else {
+			ok = false;
+		}
+		if (!ok) {
+			std::cout << "Invalid argument: " << arg << (hasValue ? " " + value : "") << std::endl;
+			PrintBenchmarkUsage();
+			return false;
+		}
+		++i;
+	}
+	return true;
+}
+
+// 输出JSON字符串，模型路径中可能含有反斜杠
+inline std::string JsonString(const std::string& s) {
+	std::string result = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') result += '\\';
+		result += c;
+	}
+	return result + "\"";
+}
+
+struct BenchmarkRayResult {
+	double closestMs = 0.0, anyMs = 0.0; // 最快一次的耗时
+	int64_t closestHits = 0, anyHits = 0;
+	double checksum = 0.0; // 最近交点距离之和，遍历结果改变时随之改变
+};
+
+// 按固定顺序依次对所有光线求交，取repeat次中最快的一次
+inline BenchmarkRayResult BenchmarkRays(const BVH& bvh, const std::vector<Ray>& rays, const BenchmarkSetting& setting) {
+	using Clock = std::chrono::steady_clock;
+	BenchmarkRayResult result;
+	int n = rays.size();
+	std::vector<float> hitTime(n);
+	std::vector<char> anyHit(n);
+	auto run = [&](const std::function<void(int)>& func) {
+		auto begin = Clock::now();
+		if (setting.serial) {
+			for (int i = 0; i < n; ++i) func(i);
+		} else {
+			ParallelFor(0, n, 1024, func);
+		}
+		return std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+	};
+	result.closestMs = result.anyMs = std::numeric_limits<double>::max();
+	for (int r = 0; r < setting.repeat; ++r) {
+		// 求交会缩短光线的tMax，每次使用光线的副本
+		result.closestMs = std::min(result.closestMs, run([&](int i) {
+			Ray ray = rays[i];
+			Interaction isect;
+			hitTime[i] = bvh.Intersect(ray, &isect) ? isect.time : -1.f;
+		}));
+		result.anyMs = std::min(result.anyMs, run([&](int i) {
+			Ray ray = rays[i];
+			anyHit[i] = bvh.IntersectP(ray);
+		}));
+	}
+	for (int i = 0; i < n; ++i) {
+		if (hitTime[i] >= 0.f) {
+			++result.closestHits;
+			result.checksum += hitTime[i];
+		}
+		result.anyHits += anyHit[i];
+	}
+	return result;
+}
+
+// 相邻的RAY_PACKET_SIZE条光线组成一个光线包求交，计时方式与BenchmarkRays相同
+inline BenchmarkRayResult BenchmarkPackets(const BVH& bvh, const std::vector<Ray>& rays, const BenchmarkSetting& setting) {
+	using Clock = std::chrono::steady_clock;
+	BenchmarkRayResult result;
+	int n = rays.size();
+	int nPackets = (n + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+	std::vector<float> hitTime(n);
+	std::vector<char> anyHit(n);
+	// 光线包求交同样会缩短tMax，每次从原始光线重新组包
+	auto makePacket = [&](int p, RayPacket* packet) {
+		int begin = p * RAY_PACKET_SIZE, count = std::min(RAY_PACKET_SIZE, n - begin);
+		for (int i = 0; i < count; ++i) packet->Set(i, rays[begin + i]);
+		return (1 << count) - 1;
+	};
+	auto run = [&](const std::function<void(int)>& func) {
+		auto begin = Clock::now();
+		if (setting.serial) {
+			for (int p = 0; p < nPackets; ++p) func(p);
+		} else {
+			ParallelFor(0, nPackets, 128, func);
+		}
+		return std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+	};
+	result.closestMs = result.anyMs = std::numeric_limits<double>::max();
+	for (int r = 0; r < setting.repeat; ++r) {
+		result.closestMs = std::min(result.closestMs, run([&](int p) {
+			RayPacket packet;
+			int activeMask = makePacket(p, &packet);
+			Interaction isects[RAY_PACKET_SIZE];
+			int hitMask = bvh.IntersectPacket(packet, activeMask, isects);
+			for (int mask = activeMask; mask; mask &= mask - 1) {
+				int i = PacketFirstLane(mask);
+				hitTime[p * RAY_PACKET_SIZE + i] = (hitMask >> i & 1) ? isects[i].time : -1.f;
+			}
+		}));
+		result.anyMs = std::min(result.anyMs, run([&](int p) {
+			RayPacket packet;
+			int activeMask = makePacket(p, &packet);
+			int occluded = bvh.OccludedPacket(packet, activeMask);
+			for (int mask = activeMask; mask; mask &= mask - 1) {
+				int i = PacketFirstLane(mask);
+				anyHit[p * RAY_PACKET_SIZE + i] = occluded >> i & 1;
+			}
+		}));
+	}
+	for (int i = 0; i < n; ++i) {
+		if (hitTime[i] >= 0.f) {
+			++result.closestHits;
+			result.checksum += hitTime[i];
+		}
+		result.anyHits += anyHit[i];
+	}
+	return result;
+}
+
+// 光线转换为SoA数组后通过RayQuery批量求交，计时只包含Trace
+inline BenchmarkRayResult BenchmarkRayQuery(const BVH& bvh, const std::vector<Ray>& rays, const BenchmarkSetting& setting) {
+	using Clock = std::chrono::steady_clock;
+	BenchmarkRayResult result;
+	int n = rays.size();
+	std::vector<float> origin[3], dir[3], tMax(n);
+	for (int axis = 0; axis < 3; ++axis) {
+		origin[axis].resize(n);
+		dir[axis].resize(n);
+		for (int i = 0; i < n; ++i) {
+			origin[axis][i] = rays[i].origin[axis];
+			dir[axis][i] = rays[i].dir[axis];
+		}
+	}
+	for (int i = 0; i < n; ++i) tMax[i] = rays[i].tMax;
+	RayQueryRays queryRays;
+	queryRays.count = n;
+	for (int axis = 0; axis < 3; ++axis) {
+		queryRays.origin[axis] = origin[axis].data();
+		queryRays.dir[axis] = dir[axis].data();
+	}
+	queryRays.tMax = tMax.data();
+	std::vector<float> hitTime(n), anyTime(n);
+	std::vector<int> triangleId(n), materialId(n);
+	std::vector<float> b1(n), b2(n);
+	RayQueryHits closestHits;
+	closestHits.t = hitTime.data();
+	closestHits.triangleId = triangleId.data();
+	closestHits.b1 = b1.data();
+	closestHits.b2 = b2.data();
+	closestHits.materialId = materialId.data();
+	RayQueryHits anyHits;
+	anyHits.t = anyTime.data();
+
+	RayQuery query(bvh);
+	auto run = [&](RayQueryType type, const RayQueryHits& hits) {
+		auto begin = Clock::now();
+		query.Trace(type, queryRays, hits, setting.serial);
+		return std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+	};
+	result.closestMs = result.anyMs = std::numeric_limits<double>::max();
+	for (int r = 0; r < setting.repeat; ++r) {
+		result.closestMs = std::min(result.closestMs, run(RayQueryType::Closest, closestHits));
+		result.anyMs = std::min(result.anyMs, run(RayQueryType::Occlusion, anyHits));
+	}
+	for (int i = 0; i < n; ++i) {
+		if (hitTime[i] >= 0.f) {
+			++result.closestHits;
+			result.checksum += hitTime[i];
+		}
+		result.anyHits += anyTime[i] >= 0.f;
+	}
+	return result;
+}
+
+// 生成三组光线，primary光线击中场景的点作为diffuse与shadow光线的起点
+inline void GenerateBenchmarkRays(const BVH& bvh, const Camera& camera, const BenchmarkSetting& setting,
+	std::vector<Ray>* primary, std::vector<Ray>* diffuse, std::vector<Ray>* shadow) {
+	int n = setting.width * setting.height;
+	primary->resize(n);
+	for (int y = 0; y < setting.height; ++y) {
+		for (int x = 0; x < setting.width; ++x) {
+			Ray ray = CameraGetRay(camera, (x + 0.5f) / setting.width, (y + 0.5f) / setting.height);
+			ray.dir = glm::normalize(ray.dir);
+			(*primary)[y * setting.width + x] = ray;
+		}
+	}
+	// 没有灯光时阴影光线指向场景包围盒上方的一点
+	glm::vec3 fallbackLight(0.f);
+	if (!bvh.bvh.empty()) {
+		const Bound& b = bvh.bvh[0].bound;
+		fallbackLight = glm::vec3((b.pMin.x + b.pMax.x) * .5f, b.pMax.y + (b.pMax.y - b.pMin.y), (b.pMin.z + b.pMax.z) * .5f);
+	}
+	std::vector<Interaction> isects(n);
+	std::vector<char> hit(n);
+	ParallelFor(0, n, 1024, [&](int i) {
+		Ray ray = (*primary)[i];
+		hit[i] = bvh.Intersect(ray, &isects[i]);
+	});
+	diffuse->clear();
+	shadow->clear();
+	for (int i = 0; i < n; ++i) {
+		if (!hit[i]) continue;
+		const Interaction& isect = isects[i];
+		uint32_t seed = uint32_t(i) * 9781u + 1u;
+		glm::vec3 origin = isect.position + isect.normal * 0.0001f;
+		// 余弦加权半球采样
+		glm::vec3 T, B;
+		BuildTangentSpace(isect.normal, &T, &B);
+		float r = std::sqrt(Rand0To1(seed)), phi = 2.f * PI * Rand0To1(seed);
+		glm::vec3 local(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.f, 1.f - r * r)));
+		Ray d;
+		d.origin = origin;
+		d.dir = TangentToWorld(T, B, isect.normal, local);
+		diffuse->push_back(d);
+
+		glm::vec3 target = fallbackLight;
+		int lightIndex = GetLightIndex(Rand0To1(seed));
+		if (lightIndex != -1) {
+			float u0 = Rand0To1(seed);
+			float u1 = Rand0To1(seed);
+			target = TriangleSample(bvh.triangles[lights[lightIndex].index], glm::vec2(u0, u1), bvh.vertices).position;
+		}
+		Ray s;
+		s.origin = origin;
+		s.dir = target - origin;
+		s.tMax = 1.f - ShadowEpsilon;
+		shadow->push_back(s);
+	}
+}
+
+// 清空上一个场景留下的全局数据，纹理按路径复用不需要清空
+inline void ClearSceneData() {
+	models.clear();
+	materials.clear();
+	lights.clear();
+	vertices.clear();
+	triangles.clear();
+}
+
+/*
+	依次测试所有场景，loadScene按名称设置models与相机，名称不存在时返回false
+	bvhSetting与交互渲染时相同
+*/
+inline bool RunBenchmark(const BenchmarkSetting& setting, const BVHSetting& bvhSetting,
+	const std::function<bool(const std::string&, Camera*)>& loadScene) {
+	std::ofstream file;
+	if (!setting.output.empty()) {
+		file.open(setting.output);
+		if (!file) {
+			std::cout << "Cannot open " << setting.output << std::endl;
+			return false;
+		}
+	}
+	std::ostream& out = setting.output.empty() ? std::cout : file;
+	out.precision(10);
+	out << "{\"type\": \"config\", \"threads\": " << (setting.serial ? 1 : GlobalThreadPool().NumThreads())
+		<< ", \"wide_width\": " << WIDE_BVH_WIDTH << ", \"packet_size\": " << RAY_PACKET_SIZE
+		<< ", \"width\": " << setting.width << ", \"height\": " << setting.height
+		<< ", \"repeat\": " << setting.repeat << "}" << std::endl;
+
+	std::vector<std::string> names = setting.scenes;
+	if (names.empty()) names = { "CornellBox", "SceneFlat", "teapot" };
+	int nScenes = names.size() + setting.meshes.size();
+	bool ok = true;
+	for (int s = 0; s < nScenes; ++s) {
+		bool isMesh = s >= (int)names.size();
+		std::string name = isMesh ? setting.meshes[s - names.size()] : names[s];
+		std::cerr << "Benchmark " << name << std::endl;
+		ClearSceneData();
+		Camera camera;
+		if (isMesh) {
+			models.push_back(Model(name, glm::mat4(1), Material(), name));
+		} else if (!loadScene(name, &camera)) {
+			std::cerr << "Unknown scene: " << name << std::endl;
+			ok = false;
+			continue;
+		}
+		LoadModels(models);
+		ModelOutput(models);
+		int nTriangles = triangles.size();
+		if (nTriangles == 0) {
+			std::cerr << "Scene " << name << " has no triangles" << std::endl;
+			ok = false;
+			continue;
+		}
+		auto buildBegin = std::chrono::steady_clock::now();
+		BVH bvh(vertices, triangles, bvhSetting);
+		double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildBegin).count();
+		TriangleLightsOutput(bvh.triangles);
+
+		const Bound& root = bvh.bvh[0].bound;
+		if (isMesh) {
+			// 相机从斜上方看向模型包围盒中心
+			glm::vec3 center = (root.pMin + root.pMax) * .5f;
+			float radius = glm::length(root.pMax - root.pMin) * .5f;
+			camera.UpdateCamera(center + glm::normalize(glm::vec3(1.f, 0.6f, 1.2f)) * radius * 2.2f, center,
+				glm::vec3(0, 1, 0), 45.f, (float)setting.width / setting.height);
+		} else {
+			camera.UpdateCamera(camera.eye, camera.center, camera.up, camera.fov, (float)setting.width / setting.height);
+		}
+
+		/*
+			CPU求交使用的内存：顶点、重排后的三角形、二叉树节点、宽BVH节点，以及叶子的三角形块、每个节点的第一个块编号与宽BVH槽位
+			GPU中为打包后的顶点、三角形与压缩节点
+		*/
+		CompressedBVH compressed;
+		compressed.Build(bvh.bvh, std::vector<int>{ 0 });
+		size_t cpuBytes = sizeof(Vertex) * bvh.vertices.size() + sizeof(Triangle) * bvh.triangles.size() +
+			sizeof(BVHNode) * bvh.bvh.size() + sizeof(WideBVHNode) * bvh.WideNodeCount() +
+			sizeof(TriangleBlock) * bvh.TriangleBlockCount() + sizeof(int) * bvh.bvh.size() * (bvh.WideNodeCount() > 0 ? 2 : 1);
+		size_t gpuBytes = sizeof(float) * (VERTEX_SIZE * bvh.vertices.size() + TRIANGLE_SIZE * bvh.triangles.size()) +
+			sizeof(uint32_t) * compressed.data.size();
+		out << "{\"type\": \"scene\", \"scene\": " << JsonString(name) << ", \"triangles\": " << nTriangles
+			<< ", \"references\": " << bvh.triangles.size() << ", \"nodes\": " << bvh.bvh.size()
+			<< ", \"wide_nodes\": " << bvh.WideNodeCount() << ", \"triangle_blocks\": " << bvh.TriangleBlockCount()
+			<< ", \"lights\": " << lights.size()
+			<< ", \"build_ms\": " << buildMs << ", \"sah_cost\": " << bvh.optimizeResult.sahAfter
+			<< ", \"cpu_bytes_per_triangle\": " << (double)cpuBytes / nTriangles
+			<< ", \"gpu_bytes_per_triangle\": " << (double)gpuBytes / nTriangles << "}" << std::endl;
+
+		std::vector<Ray> primary, diffuse, shadow;
+		GenerateBenchmarkRays(bvh, camera, setting, &primary, &diffuse, &shadow);
+		const std::vector<Ray>* rays[3] = { &primary, &diffuse, &shadow };
+		const char* rayNames[3] = { "primary", "diffuse", "shadow" };
+		for (int k = 0; k < 3; ++k) {
+			if (rays[k]->empty()) continue;
+			BenchmarkRayResult r = BenchmarkRays(bvh, *rays[k], setting);
+			double count = rays[k]->size();
+			out << "{\"type\": \"rays\", \"scene\": " << JsonString(name) << ", \"rays\": \"" << rayNames[k]
+				<< "\", \"count\": " << rays[k]->size()
+				<< ", \"closest_mrays_per_s\": " << count / (r.closestMs * 1000.0)
+				<< ", \"any_mrays_per_s\": " << count / (r.anyMs * 1000.0)
+				<< ", \"closest_hits\": " << r.closestHits << ", \"any_hits\": " << r.anyHits
+				<< ", \"checksum\": " << r.checksum << "}" << std::endl;
+			BenchmarkRayResult q = BenchmarkRayQuery(bvh, *rays[k], setting);
+			out << "{\"type\": \"rays\", \"scene\": " << JsonString(name) << ", \"rays\": \"" << rayNames[k]
+				<< "_batch\", \"count\": " << rays[k]->size()
+				<< ", \"closest_mrays_per_s\": " << count / (q.closestMs * 1000.0)
+				<< ", \"any_mrays_per_s\": " << count / (q.anyMs * 1000.0)
+				<< ", \"closest_hits\": " << q.closestHits << ", \"any_hits\": " << q.anyHits
+				<< ", \"checksum\": " << q.checksum << "}" << std::endl;
+			// 非相干的diffuse光线不适合光线包
+			if (k == 1) continue;
+			BenchmarkRayResult p = BenchmarkPackets(bvh, *rays[k], setting);
+			out << "{\"type\": \"rays\", \"scene\": " << JsonString(name) << ", \"rays\": \"" << rayNames[k]
+				<< "_packet\", \"count\": " << rays[k]->size()
+				<< ", \"closest_mrays_per_s\": " << count / (p.closestMs * 1000.0)
+				<< ", \"any_mrays_per_s\": " << count / (p.anyMs * 1000.0)
+				<< ", \"closest_speedup\": " << r.closestMs / p.closestMs << ", \"any_speedup\": " << r.anyMs / p.anyMs
+				<< ", \"closest_hits\": " << p.closestHits << ", \"any_hits\": " << p.anyHits
+				<< ", \"checksum\": " << p.checksum << "}" << std::endl;
+		}
+	}
+	return ok;
+}
@@ -0,0 +1,581 @@
+#pragma once
+#include "PnRT.hpp"
+#include "camera.hpp"
+#include "triangle.hpp"
+#include "light.hpp"
+#include "BVH.hpp"
+#include "TLAS.hpp"
+#include "BSDF.hpp"
+#include "HDRImage.hpp"
+#include "sampler.hpp"
+#include "parallel.hpp"
+#include "RayPacket.hpp"
+#include "RayStream.hpp"
+
+/*
+	CPU路径追踪渲染器，不需要GL上下文
+	与ray_tracing.comp中的PathTracing使用相同的积分器、DisneyBRDF与随机序列，
+	第i个样本与GPU第i帧的结果对应，可以作为GPU输出的参照
+	图像划分为tileSize大小的块，每块作为一个任务提交到工作窃取线程池，空闲的线程会窃取其他线程剩余的块
+	材质、灯光与纹理使用全局的materials、lights、textures，顶点与三角形为上传到GPU的数组，灯光的index指向其中
+*/
+struct CPURenderSetting {
+	int width = SCREEN_WIDTH;
+	int height = SCREEN_HEIGHT;
+	int maxBounce = 4; // 范围为[1, SOBOL_MAX_BOUNCE]，超出时截断
+	int tileSize = 16;
+	bool clampSample = true; // 与GPU相同，每个样本截断到[0, 1]后再累计
+	// 每行相邻的8个像素组成光线包，主光线与阴影射线使用光线包求交，单层BVH与两层加速结构都支持
+	bool packetTracing = false;
+	/*
+		光线流：块内所有路径的阴影射线与弹射光线按方向与起点排序后再求交，提高弹射后非相干光线的缓存命中率
+		启用时每个任务处理streamTileSize大小的块，块越大排序后相邻光线越接近
+	*/
+	bool streamTracing = false;
+	int streamTileSize = 64;
+	// 每个块使用一个遮挡缓存，灯光的阴影射线先与上一次遮挡同一灯光的三角形求交，环境贴图的阴影射线不使用
+	bool occlusionCache = false;
+};
+
+class CPURenderer {
+public:
+	// bvh与tlas只需提供一个，tlas不为空时使用两层加速结构
+	CPURenderer(const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles,
+		const BVH* bvh, const TLAS* tlas, const HDRImage* hdr, const CPURenderSetting& setting)
+		: vertices(vertices), triangles(triangles), bvh(bvh), tlas(tlas), hdr(hdr), setting(setting),
+		accum(setting.width * setting.height, glm::vec3(0.f)) {
+		// 每次反弹使用两个sobol维度，方向数只有SOBOL_DIMENSIONS个维度
+		this->setting.maxBounce = glm::clamp(setting.maxBounce, 1, SOBOL_MAX_BOUNCE);
+		lightsSumArea = lights.empty() ? 0.f : lights.back().prefixArea;
+		const std::vector<BVHNode>& nodes = tlas ? tlas->bvh : bvh->bvh;
+		if (!nodes.empty()) sceneBound = nodes[0].bound;
+	}
+
+	// 相机或场景改变后清空累计的样本
+	void Reset() {
+		std::fill(accum.begin(), accum.end(), glm::vec3(0.f));
+		frameCount = 0;
+		occlusionQueries = 0;
+		occlusionHits = 0;
+	}
+
+	// 每个像素追加spp个样本
+	void Render(const Camera& camera, int spp = 1) {
+		int tileSize = std::max(1, setting.streamTracing ? setting.streamTileSize : setting.tileSize);
+		TaskGroup group;
+		for (int y0 = 0; y0 < setting.height; y0 += tileSize) {
+			for (int x0 = 0; x0 < setting.width; x0 += tileSize) {
+				int x1 = std::min(x0 + tileSize, setting.width);
+				int y1 = std::min(y0 + tileSize, setting.height);
+				const Camera* c = &camera;
+				group.Run([this, c, x0, y0, x1, y1, spp]() {
+					if (setting.streamTracing) RenderTileStream(*c, x0, y0, x1, y1, spp);
+					else if (setting.packetTracing) RenderTilePacket(*c, x0, y0, x1, y1, spp);
+					else RenderTile(*c, x0, y0, x1, y1, spp);
+				});
+			}
+		}
+		group.Wait();
+		frameCount += spp;
+	}
+
+	// 累计样本的平均值，第0行为图像底部，与GPU输出图像的坐标相同
+	glm::vec3 GetPixel(int x, int y) const {
+		if (frameCount == 0) return glm::vec3(0.f);
+		return accum[y * setting.width + x] / (float)frameCount;
+	}
+
+	int FrameCount() const {
+		return frameCount;
+	}
+
+	const CPURenderSetting& Setting() const {
+		return setting;
+	}
+
+	// 启用遮挡缓存时，灯光阴影射线的测试次数与被缓存的三角形遮挡的比例
+	int64_t OcclusionCacheQueries() const {
+		return occlusionQueries;
+	}
+
+	float OcclusionCacheHitRate() const {
+		int64_t queries = occlusionQueries;
+		return queries ? (float)occlusionHits / queries : 0.f;
+	}
+
+private:
+	void RenderTile(const Camera& camera, int x0, int y0, int x1, int y1, int spp) {
+		OcclusionCache cache(lights.size());
+		OcclusionCache* occlusionCache = setting.occlusionCache ? &cache : nullptr;
+		for (int y = y0; y < y1; ++y) {
+			for (int x = x0; x < x1; ++x) {
+				glm::vec3 sum(0.f);
+				for (int s = 0; s < spp; ++s) {
+					glm::vec3 color = RenderSample(camera, x, y, frameCount + s, occlusionCache);
+					// 数值异常的样本会使像素一直保持异常，直接丢弃
+					if (!std::isfinite(color.x) || !std::isfinite(color.y) || !std::isfinite(color.z)) continue;
+					sum += color;
+				}
+				accum[y * setting.width + x] += sum;
+			}
+		}
+		AddOcclusionStats(cache);
+	}
+
+	void AddOcclusionStats(const OcclusionCache& cache) {
+		occlusionQueries += cache.queries;
+		occlusionHits += cache.hits;
+	}
+
+	// 与着色器的main相同，occlusionCache为空时不使用遮挡缓存
+	glm::vec3 RenderSample(const Camera& camera, int x, int y, uint32_t frame, OcclusionCache* occlusionCache) const {
+		uint32_t seed = uint32_t(uint32_t(x) * 1973u + uint32_t(y) * 9277u + frame * 26699u) | 1u; // 初始化种子
+		Ray ray = CameraGetRay(camera, float(x) / float(setting.width), float(y) / float(setting.height));
+		ray.dir = glm::normalize(ray.dir);
+		Interaction isect;
+		glm::vec3 color;
+		if (!Intersect(ray, &isect)) {
+			color = hdr && !hdr->Empty() ? hdr->GetColor(ray.dir) : glm::vec3(0.f);
+		} else {
+			color = materials[isect.materialId].emssive + PathTracing(isect, -ray.dir, x, y, frame, seed, occlusionCache);
+		}
+		if (setting.clampSample) color = glm::clamp(color, glm::vec3(0.f), glm::vec3(1.f));
+		return color;
+	}
+
+	glm::vec3 PathTracing(Interaction isect, glm::vec3 V, int x, int y, uint32_t frame, uint32_t& seed,
+		OcclusionCache* occlusionCache) const {
+		glm::vec3 Lo(0.f);
+		glm::vec3 c(1.f); // 第i次弹射光照的累计权重
+		bool hasHDR = hdr && !hdr->Empty();
+
+		for (int bounce = 0; bounce < setting.maxBounce; ++bounce) {
+			glm::vec3 P = isect.position;
+			glm::vec3 N = isect.normal;
+
+			Material material = materials[isect.materialId];
+			if (isect.textureId != -1) { // 将材质baseColor修改为纹理颜色
+				material.baseColor = TextureGetColorBilinear(isect.textureId, isect.texcoord);
+			}
+			// 建立切线空间
+			glm::vec3 T, B;
+			BuildTangentSpace(N, &T, &B);
+
+			// 灯光的直接光照
+			glm::vec3 LDirect(0.f);
+			float lightPDF = 0.f;
+			Interaction triangleIsect;
+			int lightIndex;
+			if (SampleLight(seed, &triangleIsect, &lightIndex)) { // 找到其中一个灯光
+				// 发射阴影射线，判断灯光与当前点之间有无遮挡
+				Ray r;
+				r.dir = triangleIsect.position - P;
+				r.tMax = 1.f - ShadowEpsilon; // 防止光线与目标物体相交
+				r.origin = P + N * 0.0001f; // 防止自相交
+				if (!LightIntersectP(r, occlusionCache, lightIndex)) {
+					float dis2 = glm::dot(r.dir, r.dir);
+					glm::vec3 lightL = glm::normalize(r.dir);
+					lightPDF = dis2 / (std::abs(glm::dot(triangleIsect.normal, -lightL)) * lightsSumArea);
+					glm::vec3 li = materials[triangleIsect.materialId].emssive;
+					// 针对灯光方向计算的brdf
+					glm::vec3 lightBRDF = DisneyBRDF(V, N, lightL, T, B, material);
+					LDirect = lightBRDF * li * std::abs(glm::dot(N, lightL)) / lightPDF;
+				}
+			}
+
+			glm::vec3 LEnvironment(0.f);
+			float enPDF = 0.f;
+			// 来自环境贴图的光照
+			if (hasHDR) {
+				glm::vec3 enL;
+				float r1 = Rand0To1(seed);
+				float r2 = Rand0To1(seed);
+				glm::vec3 enLi = hdr->Sample(r1, r2, &enL, &enPDF);
+				Ray enR;
+				enR.origin = P;
+				enR.dir = enL;
+				enR.tMax = FLOAT_MAX;
+				// 判断贴图与当前点之间有无遮挡
+				if (glm::dot(enL, N) > 0 && !IntersectP(enR)) {
+					glm::vec3 dBRDF = DisneyBRDF(V, N, enL, T, B, material);
+					LEnvironment = dBRDF * enLi * glm::dot(enL, N) / enPDF;
+				}
+			}
+
+			glm::vec2 uv = SobolVec2(frame + 1, bounce);
+			uv = CranleyPattersonRotation(uv, x, y, setting.width, setting.height);
+			// 随机采样入射光L作为下一次光线方向
+			float dPDF;
+			glm::vec3 L = SampleDisneyBRDF(V, N, T, B, material, uv.x, uv.y, seed, &dPDF);
+			glm::vec3 dBRDF = DisneyBRDF(V, N, L, T, B, material);
+			float NdotL = std::abs(glm::dot(N, L));
+
+			// 多重重要性采样
+			float invPDFSum = 1.f / (enPDF + lightPDF + dPDF);
+			Lo += c * (LEnvironment * enPDF + LDirect * lightPDF) * invPDFSum;
+
+			Ray ray;
+			ray.origin = P + N * 0.0001f;
+			ray.dir = L;
+			ray.tMax = FLOAT_MAX;
+
+			// 计算下一次弹射到的交点
+			if (!Intersect(ray, &isect)) {
+				if (hasHDR) {
+					glm::vec3 enL = glm::normalize(ray.dir);
+					glm::vec3 enLi = hdr->GetColor(enL);
+					Lo += c * enLi * dBRDF * NdotL / dPDF;
+				}
+				return Lo;
+			}
+
+			// 自发光
+			Lo += c * materials[isect.materialId].emssive * dBRDF * NdotL / dPDF;
+
+			c *= dBRDF * NdotL / dPDF;
+			V = -ray.dir;
+		}
+		return Lo;
+	}
+
+	// 选择一个灯光三角形并在其上采样，没有灯光时返回false
+	bool SampleLight(uint32_t& seed, Interaction* triangleIsect, int* lightIndexOut) const {
+		int lightIndex = GetLightIndex(Rand0To1(seed));
+		if (lightIndex == -1) return false;
+		*lightIndexOut = lightIndex;
+		// 在该三角形上采样
+		const Light& light = lights[lightIndex];
+		float u0 = Rand0To1(seed);
+		float u1 = Rand0To1(seed);
+		*triangleIsect = TriangleSample(triangles[light.index], glm::vec2(u0, u1), vertices);
+		if (tlas && light.instanceId != -1) {
+			// 实例的三角形在模型空间中，采样点变换到世界空间
+			const Instance& instance = tlas->instances[light.instanceId];
+			triangleIsect->position = glm::vec3(instance.objectToWorld * glm::vec4(triangleIsect->position, 1.f));
+			triangleIsect->normal = glm::normalize(glm::transpose(glm::mat3(instance.worldToObject)) * triangleIsect->normal);
+			triangleIsect->materialId = instance.materialId;
+		}
+		return true;
+	}
+
+	/*
+		光线包与光线流渲染中一条路径在两次弹射之间需要保存的状态
+		多条路径按弹射次数同步推进，每次弹射分为三个阶段，中间分别集中求交阴影射线与弹射光线：
+		BeginBounce生成阴影射线，ScatterBounce计算直接光照并采样弹射方向，EndBounce处理弹射光线的交点
+		每条路径的计算与消耗随机数的顺序与PathTracing相同，结果与逐条光线渲染一致
+	*/
+	struct PathState {
+		int x, y;
+		uint32_t seed;
+		Interaction isect;
+		glm::vec3 V;
+		glm::vec3 Lo = glm::vec3(0.f);
+		glm::vec3 c = glm::vec3(1.f);
+		Material material;
+		glm::vec3 T, B;
+		bool hasLightRay, hasEnRay;
+		Ray lightRay, enRay; // 灯光与环境贴图的阴影射线
+		int lightIndex; // 灯光阴影射线指向的灯光
+		Interaction lightPoint; // 灯光上的采样点
+		glm::vec3 enL, enLi;
+		float enPDF;
+		glm::vec3 dBRDF;
+		float NdotL, dPDF;
+		Ray next; // 下一次弹射的光线
+	};
+
+	// 初始化路径并生成主光线，与RenderSample相同
+	Ray BeginPath(const Camera& camera, int x, int y, uint32_t frame, PathState* path) const {
+		path->x = x;
+		path->y = y;
+		path->seed = uint32_t(uint32_t(x) * 1973u + uint32_t(y) * 9277u + frame * 26699u) | 1u; // 初始化种子
+		path->Lo = glm::vec3(0.f);
+		path->c = glm::vec3(1.f);
+		Ray ray = CameraGetRay(camera, float(x) / float(setting.width), float(y) / float(setting.height));
+		ray.dir = glm::normalize(ray.dir);
+		return ray;
+	}
+
+	void BeginBounce(PathState& path) const {
+		const Interaction& isect = path.isect;
+		path.material = materials[isect.materialId];
+		if (isect.textureId != -1) { // 将材质baseColor修改为纹理颜色
+			path.material.baseColor = TextureGetColorBilinear(isect.textureId, isect.texcoord);
+		}
+		// 建立切线空间
+		BuildTangentSpace(isect.normal, &path.T, &path.B);
+		// 灯光的阴影射线
+		path.hasLightRay = SampleLight(path.seed, &path.lightPoint, &path.lightIndex);
+		if (path.hasLightRay) {
+			path.lightRay.dir = path.lightPoint.position - isect.position;
+			path.lightRay.tMax = 1.f - ShadowEpsilon; // 防止光线与目标物体相交
+			path.lightRay.origin = isect.position + isect.normal * 0.0001f; // 防止自相交
+		}
+		// 环境贴图的阴影射线
+		path.hasEnRay = false;
+		path.enPDF = 0.f;
+		if (hdr && !hdr->Empty()) {
+			float r1 = Rand0To1(path.seed);
+			float r2 = Rand0To1(path.seed);
+			path.enLi = hdr->Sample(r1, r2, &path.enL, &path.enPDF);
+			if (glm::dot(path.enL, isect.normal) > 0) {
+				path.hasEnRay = true;
+				path.enRay.origin = isect.position;
+				path.enRay.dir = path.enL;
+				path.enRay.tMax = FLOAT_MAX;
+			}
+		}
+	}
+
+	// lightVisible、enVisible为对应的阴影射线存在且没有被遮挡
+	void ScatterBounce(PathState& path, int bounce, uint32_t frame, bool lightVisible, bool enVisible) const {
+		const glm::vec3& P = path.isect.position;
+		const glm::vec3& N = path.isect.normal;
+		glm::vec3 LDirect(0.f);
+		float lightPDF = 0.f;
+		if (lightVisible) {
+			float dis2 = glm::dot(path.lightRay.dir, path.lightRay.dir);
+			glm::vec3 lightL = glm::normalize(path.lightRay.dir);
+			lightPDF = dis2 / (std::abs(glm::dot(path.lightPoint.normal, -lightL)) * lightsSumArea);
+			glm::vec3 li = materials[path.lightPoint.materialId].emssive;
+			glm::vec3 lightBRDF = DisneyBRDF(path.V, N, lightL, path.T, path.B, path.material);
+			LDirect = lightBRDF * li * std::abs(glm::dot(N, lightL)) / lightPDF;
+		}
+		glm::vec3 LEnvironment(0.f);
+		if (enVisible) {
+			glm::vec3 dBRDF = DisneyBRDF(path.V, N, path.enL, path.T, path.B, path.material);
+			LEnvironment = dBRDF * path.enLi * glm::dot(path.enL, N) / path.enPDF;
+		}
+
+		glm::vec2 uv = SobolVec2(frame + 1, bounce);
+		uv = CranleyPattersonRotation(uv, path.x, path.y, setting.width, setting.height);
+		// 随机采样入射光L作为下一次光线方向
+		glm::vec3 L = SampleDisneyBRDF(path.V, N, path.T, path.B, path.material, uv.x, uv.y, path.seed, &path.dPDF);
+		path.dBRDF = DisneyBRDF(path.V, N, L, path.T, path.B, path.material);
+		path.NdotL = std::abs(glm::dot(N, L));
+
+		// 多重重要性采样
+		float invPDFSum = 1.f / (path.enPDF + lightPDF + path.dPDF);
+		path.Lo += path.c * (LEnvironment * path.enPDF + LDirect * lightPDF) * invPDFSum;
+
+		path.next.origin = P + N * 0.0001f;
+		path.next.dir = L;
+		path.next.tMax = FLOAT_MAX;
+	}
+
+	// hit为弹射光线是否击中，击中时交点已写入path.isect，返回路径是否继续弹射
+	bool EndBounce(PathState& path, bool hit) const {
+		if (!hit) {
+			if (hdr && !hdr->Empty()) {
+				glm::vec3 enLi = hdr->GetColor(glm::normalize(path.next.dir));
+				path.Lo += path.c * enLi * path.dBRDF * path.NdotL / path.dPDF;
+			}
+			return false;
+		}
+		// 自发光
+		path.Lo += path.c * materials[path.isect.materialId].emssive * path.dBRDF * path.NdotL / path.dPDF;
+		path.c *= path.dBRDF * path.NdotL / path.dPDF;
+		path.V = -path.next.dir;
+		return true;
+	}
+
+	// 光线包渲染：每行相邻的8个像素组成一个包
+	void RenderTilePacket(const Camera& camera, int x0, int y0, int x1, int y1, int spp) {
+		OcclusionCache cache(lights.size());
+		OcclusionCache* occlusionCache = setting.occlusionCache ? &cache : nullptr;
+		for (int y = y0; y < y1; ++y) {
+			for (int xBegin = x0; xBegin < x1; xBegin += RAY_PACKET_SIZE) {
+				int n = std::min(RAY_PACKET_SIZE, x1 - xBegin);
+				glm::vec3 sum[RAY_PACKET_SIZE];
+				for (int i = 0; i < n; ++i) sum[i] = glm::vec3(0.f);
+				for (int s = 0; s < spp; ++s) {
+					glm::vec3 color[RAY_PACKET_SIZE];
+					RenderSamplePacket(camera, xBegin, y, n, frameCount + s, occlusionCache, color);
+					for (int i = 0; i < n; ++i) {
+						if (!std::isfinite(color[i].x) || !std::isfinite(color[i].y) || !std::isfinite(color[i].z)) continue;
+						sum[i] += color[i];
+					}
+				}
+				for (int i = 0; i < n; ++i) accum[y * setting.width + xBegin + i] += sum[i];
+			}
+		}
+		AddOcclusionStats(cache);
+	}
+
+	// 第y行从x0开始的n个像素各生成一个样本
+	void RenderSamplePacket(const Camera& camera, int x0, int y, int n, uint32_t frame, OcclusionCache* occlusionCache,
+		glm::vec3* colors) const {
+		PathState paths[RAY_PACKET_SIZE];
+		RayPacket packet;
+		for (int i = 0; i < n; ++i) packet.Set(i, BeginPath(camera, x0 + i, y, frame, &paths[i]));
+		Interaction isects[RAY_PACKET_SIZE];
+		int aliveMask = IntersectPacket(packet, (1 << n) - 1, isects);
+		for (int i = 0; i < n; ++i) {
+			glm::vec3 dir(packet.dir[0][i], packet.dir[1][i], packet.dir[2][i]);
+			if (aliveMask >> i & 1) {
+				paths[i].isect = isects[i];
+				paths[i].V = -dir;
+				colors[i] = materials[isects[i].materialId].emssive;
+			} else {
+				colors[i] = hdr && !hdr->Empty() ? hdr->GetColor(dir) : glm::vec3(0.f);
+			}
+		}
+		for (int bounce = 0; bounce < setting.maxBounce && aliveMask; ++bounce) {
+			RayPacket lightPacket, enPacket;
+			int lightMask = 0, enMask = 0;
+			for (int mask = aliveMask; mask; mask &= mask - 1) {
+				int i = PacketFirstLane(mask);
+				BeginBounce(paths[i]);
+				if (paths[i].hasLightRay) {
+					lightPacket.Set(i, paths[i].lightRay);
+					lightMask |= 1 << i;
+				}
+				if (paths[i].hasEnRay) {
+					enPacket.Set(i, paths[i].enRay);
+					enMask |= 1 << i;
+				}
+			}
+			int lightVisible = lightMask & ~Occluded(lightPacket, lightMask, bounce, paths, occlusionCache);
+			int enVisible = enMask & ~Occluded(enPacket, enMask, bounce, nullptr, nullptr);
+			// 弹射后的光线方向分散，逐条光线在宽BVH上求交更快
+			for (int mask = aliveMask; mask; mask &= mask - 1) {
+				int i = PacketFirstLane(mask);
+				ScatterBounce(paths[i], bounce, frame, lightVisible >> i & 1, enVisible >> i & 1);
+				if (!EndBounce(paths[i], Intersect(paths[i].next, &paths[i].isect))) aliveMask &= ~(1 << i);
+			}
+		}
+		for (int i = 0; i < n; ++i) {
+			colors[i] += paths[i].Lo;
+			if (setting.clampSample) colors[i] = glm::clamp(colors[i], glm::vec3(0.f), glm::vec3(1.f));
+		}
+	}
+
+	/*
+		第一次弹射的起点为相邻像素的主光线交点，阴影射线一致性高，使用光线包；之后起点分散，逐条光线求交
+		paths不为空时为灯光的阴影射线，逐条求交时使用遮挡缓存
+	*/
+	int Occluded(const RayPacket& packet, int activeMask, int bounce, const PathState* paths, OcclusionCache* occlusionCache) const {
+		if (!activeMask) return 0;
+		if (bounce == 0) return OccludedPacket(packet, activeMask);
+		int occluded = 0;
+		for (int mask = activeMask; mask; mask &= mask - 1) {
+			int i = PacketFirstLane(mask);
+			if (LightIntersectP(packet.Get(i), occlusionCache, paths ? paths[i].lightIndex : -1)) occluded |= 1 << i;
+		}
+		return occluded;
+	}
+
+	/*
+		光线流渲染：块内所有像素的路径同步弹射，每次弹射的阴影射线与弹射光线各自收集为一个光线流，
+		按方向卦限与起点的Morton码排序后求交，结果按编号写回对应的路径
+		主光线按扫描线顺序生成，本身已经相干，不需要排序
+	*/
+	void RenderTileStream(const Camera& camera, int x0, int y0, int x1, int y1, int spp) {
+		int width = x1 - x0, n = width * (y1 - y0);
+		std::vector<PathState> paths(n);
+		std::vector<glm::vec3> sum(n, glm::vec3(0.f)), colors(n);
+		std::vector<int> alive, lightRayId(n), enRayId(n);
+		std::vector<int> shadowLight; // 阴影射线指向的灯光，环境贴图的阴影射线为-1
+		std::vector<char> visible, hits;
+		RayStream shadowStream(sceneBound), bounceStream(sceneBound);
+		OcclusionCache cache(lights.size());
+		OcclusionCache* occlusionCache = setting.occlusionCache ? &cache : nullptr;
+		for (int s = 0; s < spp; ++s) {
+			uint32_t frame = frameCount + s;
+			alive.clear();
+			for (int i = 0; i < n; ++i) {
+				PathState& path = paths[i];
+				Ray ray = BeginPath(camera, x0 + i % width, y0 + i / width, frame, &path);
+				if (Intersect(ray, &path.isect)) {
+					path.V = -ray.dir;
+					colors[i] = materials[path.isect.materialId].emssive;
+					alive.push_back(i);
+				} else {
+					colors[i] = hdr && !hdr->Empty() ? hdr->GetColor(ray.dir) : glm::vec3(0.f);
+				}
+			}
+			for (int bounce = 0; bounce < setting.maxBounce && !alive.empty(); ++bounce) {
+				shadowStream.Clear();
+				shadowLight.clear();
+				for (int i : alive) {
+					BeginBounce(paths[i]);
+					lightRayId[i] = -1;
+					if (paths[i].hasLightRay) {
+						lightRayId[i] = shadowStream.Add(paths[i].lightRay);
+						shadowLight.push_back(paths[i].lightIndex);
+					}
+					enRayId[i] = -1;
+					if (paths[i].hasEnRay) {
+						enRayId[i] = shadowStream.Add(paths[i].enRay);
+						shadowLight.push_back(-1);
+					}
+				}
+				shadowStream.Sort();
+				visible.resize(shadowStream.Size());
+				shadowStream.Trace([&](int id, const Ray& r) {
+					visible[id] = !LightIntersectP(r, occlusionCache, shadowLight[id]);
+				});
+
+				bounceStream.Clear();
+				for (int i : alive) {
+					ScatterBounce(paths[i], bounce, frame, lightRayId[i] != -1 && visible[lightRayId[i]],
+						enRayId[i] != -1 && visible[enRayId[i]]);
+					bounceStream.Add(paths[i].next);
+				}
+				bounceStream.Sort();
+				// 弹射光线的编号即为路径在alive中的位置，交点直接写回路径
+				hits.resize(bounceStream.Size());
+				bounceStream.Trace([&](int id, const Ray& r) {
+					hits[id] = Intersect(r, &paths[alive[id]].isect);
+				});
+				int nAlive = 0;
+				for (int k = 0; k < (int)alive.size(); ++k) {
+					if (EndBounce(paths[alive[k]], hits[k])) alive[nAlive++] = alive[k];
+				}
+				alive.resize(nAlive);
+			}
+			for (int i = 0; i < n; ++i) {
+				glm::vec3 color = colors[i] + paths[i].Lo;
+				if (setting.clampSample) color = glm::clamp(color, glm::vec3(0.f), glm::vec3(1.f));
+				if (!std::isfinite(color.x) || !std::isfinite(color.y) || !std::isfinite(color.z)) continue;
+				sum[i] += color;
+			}
+		}
+		for (int i = 0; i < n; ++i) accum[(y0 + i / width) * setting.width + x0 + i % width] += sum[i];
+		AddOcclusionStats(cache);
+	}
+
+	bool Intersect(const Ray& r, Interaction* isect) const {
+		return tlas ? tlas->Intersect(r, isect) : bvh->Intersect(r, isect);
+	}
+
+	bool IntersectP(const Ray& r) const {
+		return tlas ? tlas->IntersectP(r) : bvh->IntersectP(r);
+	}
+
+	int IntersectPacket(RayPacket& packet, int activeMask, Interaction* isects) const {
+		return tlas ? tlas->IntersectPacket(packet, activeMask, isects) : bvh->IntersectPacket(packet, activeMask, isects);
+	}
+
+	int OccludedPacket(const RayPacket& packet, int activeMask) const {
+		return tlas ? tlas->OccludedPacket(packet, activeMask) : bvh->OccludedPacket(packet, activeMask);
+	}
+
+	// 灯光的阴影射线，启用遮挡缓存时以灯光编号作为缓存的槽位，lightIndex为-1时不使用缓存
+	bool LightIntersectP(const Ray& r, OcclusionCache* occlusionCache, int lightIndex) const {
+		if (!occlusionCache || lightIndex == -1) return IntersectP(r);
+		return tlas ? tlas->IntersectP(r, occlusionCache, lightIndex) : bvh->IntersectP(r, occlusionCache, lightIndex);
+	}
+
+	const std::vector<Vertex>& vertices;
+	const std::vector<Triangle>& triangles;
+	const BVH* bvh;
+	const TLAS* tlas;
+	const HDRImage* hdr;
+	CPURenderSetting setting;
+	float lightsSumArea;
+	Bound sceneBound; // 光线流排序时量化光线起点
+	std::vector<glm::vec3> accum; // 每个像素所有样本的和
+	int frameCount = 0;
+	std::atomic<int64_t> occlusionQueries{ 0 }, occlusionHits{ 0 }; // 各个块的遮挡缓存统计之和
+};
@@ -0,0 +1,405 @@
+#pragma once
+#include "PnRT.hpp"
+#include "bound.hpp"
+#include "triangle.hpp"
+#include "BVH.hpp"
+
+/*
+	上传到GPU的压缩BVH节点，以RGBA32UI纹素（4个uint）为单位寻址
+	内部节点占2个纹素：
+		[0, 3) 节点包围盒最小点（量化原点）
+		[3]    三个轴的缩放指数（各8位，加127偏移）、划分轴（2位）
+		[4, 7) 两个儿子的包围盒，相对于原点按2的幂缩放量化到8位，依次为左儿子最小点、最大点、右儿子最小点、最大点
+		[7]    右儿子的纹素位置，左儿子紧跟在当前节点之后
+	叶子节点占1个纹素：三角形区间的起点、终点，[3]为叶子标志
+	量化时最小点向下取整、最大点向上取整，解码出的包围盒总是包含原包围盒
+*/
+constexpr uint32_t COMPRESSED_LEAF_FLAG = 0x80000000u;
+constexpr int COMPRESSED_INTERIOR_TEXELS = 2;
+constexpr int COMPRESSED_LEAF_TEXELS = 1;
+
+// 解码后的节点：内部节点给出两个儿子的包围盒，叶子节点给出三角形区间
+struct CompressedBVHNode {
+	Bound childBound[2];
+	int axis = 0;
+	int rightChild = -1; // 叶子为-1
+	int startIndex = 0;
+	int endIndex = 0;
+};
+
+/*
+	着色器遍历使用的栈：内部节点的两个儿子按访问顺序分为近儿子与远儿子，先访问近儿子
+	Children返回下一个访问的儿子，两个儿子都不相交时返回-1；Pop在当前子树遍历完后返回下一个访问的节点，遍历结束时返回-1
+	栈中记录远儿子的进入时刻tFar，Pop跳过进入时刻超过tMax的节点；对应着色器的USE_ORDERED_TRAVERSAL，不需要时tFar传0
+*/
+struct CompressedFullStack {
+	int Children(int nearChild, int farChild, bool hitNear, bool hitFar, float tFar) {
+		if (hitNear && hitFar) {
+			nodeT[top] = tFar;
+			nodes[top++] = farChild;
+		}
+		return hitNear ? nearChild : (hitFar ? farChild : -1);
+	}
+	int Pop(int /*root*/, float tMax) {
+		while (top > 0 && nodeT[top - 1] > tMax) --top;
+		return top > 0 ? nodes[--top] : -1;
+	}
+	int nodes[128];
+	float nodeT[128];
+	int top = 0;
+};
+
+/*
+	短栈（Laine的restart trail）：只保存最近SIZE个远儿子，栈满时覆盖最早的一项
+	trail的第d位为1表示当前路径上深度d的节点是父节点最后访问的儿子（近儿子已遍历完，或只有一个儿子相交）
+	栈为空而树没有遍历完时，从根节点按trail重新下降，重新下降时用缩短后的tMax测试包围盒，访问的叶子是完整栈的子集，交点相同
+	着色器中trail为uvec2，树的深度不能超过COMPRESSED_TRAIL_MAX_DEPTH
+*/
+constexpr int COMPRESSED_SHORT_STACK_SIZE = 4;
+constexpr int COMPRESSED_TRAIL_MAX_DEPTH = 63;
+
+template <int SIZE = COMPRESSED_SHORT_STACK_SIZE>
+struct CompressedShortStack {
+	int Children(int nearChild, int farChild, bool hitNear, bool hitFar, float tFar) {
+		if (!hitNear && !hitFar) return -1;
+		const int d = ++depth;
+		const bool nearDone = (trail & Bit(d)) != 0;
+		if (hitNear && hitFar) {
+			if (nearDone) return farChild;
+			top = (top + 1) % SIZE;
+			entries[top][0] = farChild;
+			entries[top][1] = d;
+			entryT[top] = tFar;
+			count = std::min(count + 1, SIZE);
+			return nearChild;
+		}
+		if (!nearDone) {
+			// 只有一个儿子相交，遍历完它父节点也就完成了；重新下降时近儿子不再相交，则远儿子从未访问过
+			if (hitFar) trail &= LowBits(d);
+			trail |= Bit(d);
+		}
+		return hitNear ? nearChild : farChild;
+	}
+	int Pop(int root, float tMax) {
+		for (;;) {
+			// 最深的、远儿子还没有访问的层，深度0为根节点不计
+			const uint64_t pending = ~trail & LowBits(depth + 1) & ~(uint64_t)1;
+			if (!pending) return -1;
+			int d = 63;
+			while (!(pending & Bit(d))) --d;
+			trail = (trail & LowBits(d)) | Bit(d);
+			depth = d;
+			if (count > 0 && entries[top][1] == d) {
+				const int id = entries[top][0];
+				const float t = entryT[top];
+				top = (top + SIZE - 1) % SIZE;
+				--count;
+				// 远儿子在已找到的交点之后，它的子树视为遍历完
+				if (t > tMax) continue;
+				return id;
+			}
+			depth = 0;
+			return root;
+		}
+	}
+	static uint64_t Bit(int d) {
+		return (uint64_t)1 << d;
+	}
+	static uint64_t LowBits(int n) {
+		return n >= 64 ? ~(uint64_t)0 : Bit(n) - 1;
+	}
+	int entries[SIZE][2]; // 远儿子的纹素位置与深度
+	float entryT[SIZE];
+	int top = 0, count = 0;
+	uint64_t trail = 0;
+	int depth = 0; // 当前节点的深度
+};
+
+class CompressedBVH {
+public:
+	// 依次编码以roots中每个节点为根的树，nodes中的编号在每棵树内部有效（左儿子为curId + 1）
+	void Build(const std::vector<BVHNode>& nodes, const std::vector<int>& roots) {
+		int size = Layout(nodes, roots);
+		data.assign(size * 4, 0);
+		for (int root : roots) EncodeTree(nodes, root, recordOffset[root]);
+	}
+
+	// 使用之前由Build编码好的数据（如从场景缓存中读取），只重新计算节点的位置
+	bool Assign(const std::vector<BVHNode>& nodes, const std::vector<int>& roots, const uint32_t* encoded, size_t count) {
+		int size = Layout(nodes, roots);
+		if (count != (size_t)size * 4) return false;
+		data.assign(encoded, encoded + count);
+		return true;
+	}
+
+	/*
+		树的拓扑不变、部分节点的包围盒改变后（Refit），重新编码受影响的记录
+		节点自身的记录使用它的包围盒作为量化原点，父节点的记录中存储了它的量化包围盒，两者都需要更新
+		dirtyRuns为Refit返回的节点区间，texelRuns返回需要重新上传的纹素区间，按位置升序
+	*/
+	void Update(const std::vector<BVHNode>& nodes, const std::vector<IndexRange>& dirtyRuns, std::vector<IndexRange>* texelRuns) {
+		std::vector<int> ids;
+		for (const IndexRange& run : dirtyRuns) {
+			for (int id = run.begin; id < run.end; ++id) {
+				ids.push_back(id);
+				if (parent[id] != -1) ids.push_back(parent[id]);
+			}
+		}
+		std::sort(ids.begin(), ids.end(), [&](int a, int b) { return recordOffset[a] < recordOffset[b]; });
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+		texelRuns->clear();
+		for (int id : ids) {
+			EncodeNode(nodes, id);
+			AppendRange(texelRuns, recordOffset[id], recordOffset[id] + RecordTexels(nodes[id]));
+		}
+	}
+
+	/*
+		重新编码拓扑改变但节点数不变的树（如实例移动后重建的顶层BVH），写回原来的位置
+		返回需要重新上传的纹素区间
+	*/
+	void Rebuild(const std::vector<BVHNode>& nodes, int root, int* texelBegin, int* texelEnd) {
+		*texelBegin = recordOffset[root];
+		*texelEnd = EncodeTree(nodes, root, *texelBegin);
+	}
+
+	CompressedBVHNode GetNode(int offset) const {
+		const uint32_t* record = &data[offset * 4];
+		CompressedBVHNode node;
+		if (record[3] & COMPRESSED_LEAF_FLAG) {
+			node.startIndex = (int)record[0];
+			node.endIndex = (int)record[1];
+			return node;
+		}
+		glm::vec3 origin, scale;
+		for (int axis = 0; axis < 3; ++axis) {
+			origin[axis] = UintToFloat(record[axis]);
+			scale[axis] = UintToFloat(((record[3] >> (8 * axis)) & 0xff) << 23);
+		}
+		const uint32_t* quantized = record + 4;
+		for (int child = 0; child < 2; ++child) {
+			for (int axis = 0; axis < 3; ++axis) {
+				node.childBound[child].pMin[axis] = origin[axis] + (float)GetByte(quantized, child * 6 + axis) * scale[axis];
+				node.childBound[child].pMax[axis] = origin[axis] + (float)GetByte(quantized, child * 6 + 3 + axis) * scale[axis];
+			}
+		}
+		node.axis = (record[3] >> 24) & 0x3;
+		node.rightChild = (int)record[7];
+		return node;
+	}
+
+	/*
+		与计算着色器相同的遍历方式，用于在CPU上验证编码
+		Stack对应着色器中是否定义USE_SHORT_STACK，ordered对应USE_ORDERED_TRAVERSAL
+	*/
+	template <typename Stack = CompressedFullStack, bool ordered = false>
+	bool Intersect(const Ray& r, const std::vector<Triangle>& triangles, const std::vector<Vertex>& vertices,
+		Interaction* isect, int root = 0) const {
+		Stack stack;
+		int curId = root;
+		TraversalRay ray(r);
+		TriangleHit hit;
+		while (curId != -1) {
+			const CompressedBVHNode node = GetNode(curId);
+			if (node.rightChild == -1) {
+				for (int i = node.startIndex; i < node.endIndex; ++i) {
+					if (TriangleIntersect(triangles[i], r, vertices, &hit)) hit.triangle = i;
+				}
+				curId = -1;
+			} else {
+				curId = Interior<ordered>(&stack, curId, node, ray, r.tMax);
+			}
+			if (curId == -1) curId = stack.Pop(root, ordered ? r.tMax : INFINITY);
+		}
+		// 与着色器相同，表面信息只对最近的交点计算
+		if (hit.triangle == -1) return false;
+		TriangleInteraction(triangles[hit.triangle], r.dir, hit.t, hit.b0, hit.b1, hit.b2, vertices, isect);
+		return true;
+	}
+
+	template <typename Stack = CompressedFullStack, bool ordered = false>
+	bool IntersectP(const Ray& r, const std::vector<Triangle>& triangles, const std::vector<Vertex>& vertices,
+		int root = 0) const {
+		Stack stack;
+		int curId = root;
+		TraversalRay ray(r);
+		while (curId != -1) {
+			const CompressedBVHNode node = GetNode(curId);
+			if (node.rightChild == -1) {
+				for (int i = node.startIndex; i < node.endIndex; ++i) {
+					if (TriangleIntersectP(triangles[i], r, vertices)) return true;
+				}
+				curId = -1;
+			} else {
+				curId = Interior<ordered>(&stack, curId, node, ray, r.tMax);
+			}
+			if (curId == -1) curId = stack.Pop(root, ordered ? r.tMax : INFINITY);
+		}
+		return false;
+	}
+
+	// 所有树中最深节点的深度，根节点深度为0，nodes中每个节点的儿子编号都大于它自己
+	static int MaxDepth(const std::vector<BVHNode>& nodes) {
+		std::vector<int> depth(nodes.size(), 0);
+		int maxDepth = 0;
+		for (int id = 0; id < (int)nodes.size(); ++id) {
+			maxDepth = std::max(maxDepth, depth[id]);
+			if (nodes[id].rightChild == -1) continue;
+			depth[id + 1] = depth[nodes[id].rightChild] = depth[id] + 1;
+		}
+		return maxDepth;
+	}
+
+	std::vector<uint32_t> data; // 每4个uint为一个纹素
+	std::vector<int> recordOffset; // 二叉树节点编号对应的纹素位置，用于查找BLAS的根节点
+private:
+	/*
+		ordered为true时先访问进入时刻较小的儿子，相同时先访问左儿子，否则在划分轴上光线方向为负方向时先访问右儿子
+		与着色器相同，未相交的儿子也给出进入时刻，短栈重新下降时顺序不变
+	*/
+	template <bool ordered, typename Stack>
+	static int Interior(Stack* stack, int curId, const CompressedBVHNode& node, const TraversalRay& ray, float tMax) {
+		const int leftChild = curId + COMPRESSED_INTERIOR_TEXELS;
+		const float tLeft = EntryTime(node.childBound[0], ray), tRight = EntryTime(node.childBound[1], ray);
+		const bool hitLeft = BoundIntersect(node.childBound[0], ray, tMax);
+		const bool hitRight = BoundIntersect(node.childBound[1], ray, tMax);
+		const bool rightFirst = ordered ? tRight < tLeft : ray.dirNegative[node.axis] != 0;
+		if (rightFirst) return stack->Children(node.rightChild, leftChild, hitRight, hitLeft, tLeft);
+		return stack->Children(leftChild, node.rightChild, hitLeft, hitRight, tRight);
+	}
+
+	// 光线进入包围盒的时刻，不与tMax比较
+	static float EntryTime(const Bound& bound, const TraversalRay& ray) {
+		float t0 = 0.f;
+		for (int i = 0; i < 3; ++i) {
+			float nearPlane = ray.dirNegative[i] ? bound.pMax[i] : bound.pMin[i];
+			float tNear = (nearPlane - ray.origin[i]) * ray.invDir[i];
+			t0 = tNear > t0 ? tNear : t0;
+		}
+		return t0;
+	}
+
+	static int RecordTexels(const BVHNode& node) {
+		return node.rightChild == -1 ? COMPRESSED_LEAF_TEXELS : COMPRESSED_INTERIOR_TEXELS;
+	}
+
+	// 按先序计算每个节点记录的位置与父节点，返回纹素总数
+	int Layout(const std::vector<BVHNode>& nodes, const std::vector<int>& roots) {
+		recordOffset.assign(nodes.size(), -1);
+		parent.assign(nodes.size(), -1);
+		int offset = 0;
+		for (int root : roots) offset = LayoutTree(nodes, root, offset);
+		return offset;
+	}
+
+	int LayoutTree(const std::vector<BVHNode>& nodes, int id, int offset) {
+		const BVHNode& node = nodes[id];
+		recordOffset[id] = offset;
+		if (node.rightChild == -1) return offset + COMPRESSED_LEAF_TEXELS;
+		parent[id + 1] = parent[node.rightChild] = id;
+		int end = LayoutTree(nodes, id + 1, offset + COMPRESSED_INTERIOR_TEXELS);
+		return LayoutTree(nodes, node.rightChild, end);
+	}
+
+	// 按先序把以id为根的树编码到offset开始的位置，返回结束位置
+	int EncodeTree(const std::vector<BVHNode>& nodes, int id, int offset) {
+		const BVHNode& node = nodes[id];
+		recordOffset[id] = offset;
+		if (node.rightChild == -1) {
+			EncodeNode(nodes, id);
+			return offset + COMPRESSED_LEAF_TEXELS;
+		}
+		parent[id + 1] = parent[node.rightChild] = id;
+		int end = EncodeTree(nodes, id + 1, offset + COMPRESSED_INTERIOR_TEXELS);
+		end = EncodeTree(nodes, node.rightChild, end);
+		EncodeNode(nodes, id);
+		return end;
+	}
+
+	// 儿子的记录位置必须已经确定
+	void EncodeNode(const std::vector<BVHNode>& nodes, int id) {
+		const BVHNode& node = nodes[id];
+		uint32_t* record = &data[recordOffset[id] * 4];
+		if (node.rightChild == -1) {
+			record[0] = (uint32_t)node.startIndex;
+			record[1] = (uint32_t)node.endIndex;
+			record[2] = 0;
+			record[3] = COMPRESSED_LEAF_FLAG;
+			return;
+		}
+		const Bound* children[2] = { &nodes[id + 1].bound, &nodes[node.rightChild].bound };
+		// 量化原点与范围使用两个儿子包围盒的并，与节点包围盒相同，但不依赖节点自身是否已经更新
+		Bound bound = *children[0];
+		bound.Union(*children[1]);
+		uint32_t exponents = 0;
+		float scale[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			float origin = bound.pMin[axis];
+			int exponent = ScaleExponent(origin, bound.pMax[axis]);
+			scale[axis] = UintToFloat((uint32_t)exponent << 23);
+			record[axis] = FloatToUint(origin);
+			exponents |= (uint32_t)exponent << (8 * axis);
+		}
+		record[3] = exponents | ((uint32_t)node.axis << 24);
+		uint32_t* quantized = record + 4;
+		quantized[0] = quantized[1] = quantized[2] = 0;
+		for (int child = 0; child < 2; ++child) {
+			for (int axis = 0; axis < 3; ++axis) {
+				float origin = bound.pMin[axis];
+				SetByte(quantized, child * 6 + axis, QuantizeMin(children[child]->pMin[axis], origin, scale[axis]));
+				SetByte(quantized, child * 6 + 3 + axis, QuantizeMax(children[child]->pMax[axis], origin, scale[axis]));
+			}
+		}
+		record[7] = (uint32_t)recordOffset[node.rightChild];
+	}
+
+	// 选取最小的偏移后指数e，使origin + 255 * 2^(e - 127)不小于maxValue，2的幂缩放使q * scale没有舍入误差
+	static int ScaleExponent(float origin, float maxValue) {
+		float extent = maxValue - origin;
+		int exponent = 1;
+		if (extent > 0.f) {
+			int e;
+			std::frexp(extent / 255.f, &e); // extent / 255 = m * 2^e, m∈[0.5, 1)
+			exponent = std::max(1, std::min(254, e + 127));
+		}
+		while (exponent < 254 && origin + 255.f * UintToFloat((uint32_t)exponent << 23) < maxValue) ++exponent;
+		return exponent;
+	}
+
+	static uint32_t QuantizeMin(float value, float origin, float scale) {
+		int q = (int)std::floor((value - origin) / scale);
+		q = std::min(std::max(q, 0), 255);
+		// 保证解码结果不大于原值
+		while (q > 0 && origin + (float)q * scale > value) --q;
+		return (uint32_t)q;
+	}
+
+	static uint32_t QuantizeMax(float value, float origin, float scale) {
+		int q = (int)std::ceil((value - origin) / scale);
+		q = std::min(std::max(q, 0), 255);
+		while (q < 255 && origin + (float)q * scale < value) ++q;
+		return (uint32_t)q;
+	}
+
+	static uint32_t GetByte(const uint32_t* words, int i) {
+		return (words[i >> 2] >> (8 * (i & 3))) & 0xff;
+	}
+
+	static void SetByte(uint32_t* words, int i, uint32_t value) {
+		words[i >> 2] |= value << (8 * (i & 3));
+	}
+
+	static uint32_t FloatToUint(float f) {
+		uint32_t u;
+		std::memcpy(&u, &f, sizeof(u));
+		return u;
+	}
+
+	static float UintToFloat(uint32_t u) {
+		float f;
+		std::memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+
+	std::vector<int> parent;
+};
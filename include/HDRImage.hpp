@@ -0,0 +1,129 @@
+#pragma once
+#include "PnRT.hpp"
+
+/*
+	HDR环境贴图
+	读取时同时生成重要性采样表randomHDR：第(i, j)个像素存储随机数(i / width, j / height)
+	经过亮度分布的CDF逆函数后得到的像素位置(x, y)以及该像素的概率密度
+	GPU渲染时两者上传为纹理，CPU渲染时按相同的规则直接采样
+*/
+struct HDRImage {
+	bool Load(const char* path) {
+		float* hdrImage = stbi_loadf(path, &width, &height, &comp, 3);
+		if (!hdrImage) {
+			std::cout << "Failed to load HDR image: " << path << std::endl;
+			return false;
+		}
+		pixels.assign(hdrImage, hdrImage + width * height * 3);
+		stbi_image_free(hdrImage);
+
+		std::vector<std::vector<float>> pdf;
+		pdf.resize(width);
+		float pdfSum = 0.0;
+		for (int x = 0; x < width; ++x) {
+			pdf[x].resize(height);
+			for (int y = 0; y < height; ++y) {
+				int pos = y * width + x;
+				// R * 0.2 + G * 0.7 + B * 0.1
+				float lumen = pixels[pos * 3 + 0] * 0.2 + pixels[pos * 3 + 1] * 0.7 + pixels[pos * 3 + 2] * 0.1;
+				pdf[x][y] = lumen;
+				pdfSum += lumen;
+			}
+		}
+		// 横向位置变量x的概率边缘密度函数
+		std::vector<float> cdfMarginX, pdfMarginX;
+		cdfMarginX.resize(width);
+		pdfMarginX.resize(width);
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				pdf[x][y] /= pdfSum; // 归一化
+				pdfMarginX[x] += pdf[x][y];
+			}
+		}
+		cdfMarginX[0] = pdfMarginX[0];
+		for (int x = 1; x < width; ++x) {
+			cdfMarginX[x] = cdfMarginX[x - 1] + pdfMarginX[x];
+		}
+		// 选定x条件下对于y变量的条件概率密度函数
+		std::vector<std::vector<float>> cdfYConditionX;
+		cdfYConditionX.resize(width);
+		for (int x = 0; x < width; ++x) {
+			cdfYConditionX[x].resize(height);
+			for (int y = 0; y < height; ++y) {
+				cdfYConditionX[x][y] = (y > 0 ? cdfYConditionX[x][y - 1] : 0.0)
+					+ pdf[x][y] / pdfMarginX[x];
+			}
+		}
+
+		randomHDR.resize(width * height * 3);
+		// 当着色器随机出两个数r1 = i / width, r2 = j / height时，在CDF逆函数查找对应的x, y
+		for (int i = 0; i < width; ++i) {
+			for (int j = 0; j < height; ++j) {
+				int x = (int)(std::lower_bound(cdfMarginX.begin(), cdfMarginX.end(),
+					(float)i / width) - cdfMarginX.begin());
+				if (x >= width) x = width - 1;
+				if (x < 0) x = 0;
+				int y = (int)(std::lower_bound(cdfYConditionX[x].begin(), cdfYConditionX[x].end(),
+					(float)j / height) - cdfYConditionX[x].begin());
+				if (y >= height) y = height - 1;
+				if (y < 0) y = 0;
+				int pos = 3 * (j * width + i);
+
+				randomHDR[pos + 0] = (float)x / width;
+				randomHDR[pos + 1] = (float)y / height;
+				randomHDR[pos + 2] = pdf[x][y];
+			}
+		}
+		std::cout << "Success to load HDR Image: " << path << std::endl;
+		return true;
+	}
+
+	bool Empty() const {
+		return pixels.empty();
+	}
+
+	// 与着色器中的GetHDRImageColor相同，方向v转为球面坐标后采样
+	glm::vec3 GetColor(const glm::vec3& v) const {
+		glm::vec2 uv = glm::vec2(std::atan2(v.z, v.x), std::asin(v.y));
+		uv *= glm::vec2(0.1591f, 0.3183f);
+		uv += 0.5f;
+		uv.y = 1.f - uv.y;
+		return Bilinear(pixels, uv);
+	}
+
+	// 与着色器中的SampleHDRImage相同，在环境贴图上重要性采样，返回入射方向L的颜色与概率密度
+	glm::vec3 Sample(float r1, float r2, glm::vec3* L, float* pdf) const {
+		glm::vec3 param = Bilinear(randomHDR, glm::vec2(r1, r2));
+		param.y = 1.f - param.y; // flip
+
+		// 根据xy球坐标获取入射方向
+		float phi = 2.f * PI * (param.x - 0.5f);
+		float theta = PI * (param.y - 0.5f);
+		*L = glm::vec3(std::cos(theta) * std::cos(phi), std::sin(theta), std::cos(theta) * std::sin(phi));
+
+		// pdf从2D平面向球坐标进行积分域转换
+		float sinTheta = std::max(1e-10f, std::sin(theta));
+		float convert = float(width * height / 2) / (2.f * PI * PI * sinTheta);
+		*pdf = param.z * convert;
+		return Bilinear(pixels, glm::vec2(param.x, param.y));
+	}
+
+	// 与GL_LINEAR、GL_CLAMP_TO_EDGE相同的双线性采样，image为RGB三通道
+	glm::vec3 Bilinear(const std::vector<float>& image, const glm::vec2& uv) const {
+		float fx = Clamp(uv.x * width - 0.5f, 0.f, (float)(width - 1));
+		float fy = Clamp(uv.y * height - 0.5f, 0.f, (float)(height - 1));
+		int x0 = (int)fx, y0 = (int)fy;
+		int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+		float tx = fx - x0, ty = fy - y0;
+		auto texel = [&](int x, int y) {
+			const float* p = &image[3 * (y * width + x)];
+			return glm::vec3(p[0], p[1], p[2]);
+		};
+		return glm::mix(glm::mix(texel(x0, y0), texel(x1, y0), tx),
+			glm::mix(texel(x0, y1), texel(x1, y1), tx), ty);
+	}
+
+	int width = 0, height = 0, comp = 0;
+	std::vector<float> pixels; // RGB
+	std::vector<float> randomHDR; // 每个像素存储x, y, pdf
+};
@@ -26,11 +26,18 @@ public:
 	void updateModel(const std::vector<Model>& models) {
 		modelNames.clear();
 		materialId.clear();
+		baseMatrix.clear();
+		translation.clear();
+		rotation.clear();
 		for (const auto& m : models) {
 			modelNames.push_back(m.name.c_str());
 			materialId.push_back(m.materialId);
+			baseMatrix.push_back(m.modelMatrix);
+			translation.push_back(glm::vec3(0));
+			rotation.push_back(glm::vec3(0));
 		}
 		modelSettingCurrentItem = modelNames[0];
+		currentModelId = 0;
 		currentMaterialId = models[0].materialId;
 	}
 
@@ -40,6 +47,7 @@ public:
 				bool is_selected = modelSettingCurrentItem == modelNames[n];
 				if (ImGui::Selectable(modelNames[n], is_selected)) {
 					modelSettingCurrentItem = modelNames[n];
+					currentModelId = n;
 					currentMaterialId = materialId[n];
 				}
 				if (is_selected)
@@ -51,7 +59,7 @@ public:
 		bool change = false;
 		glActiveTexture(GL_TEXTURE0 + 1);
 		glBindTexture(GL_TEXTURE_1D, materialTex);
-		int offset = MATERIAL_SIZE * currentMaterialId / 3; // ڼأһRGBһ
+		int offset = MATERIAL_SIZE * currentMaterialId / 3; // 第几个像素，一组RGB组成一个像素
 		if (materials[currentMaterialId].emssive != glm::vec3(0)) {
 			change |= ImGui::ColorEdit3("emssive", glm::value_ptr(materials[currentMaterialId].emssive));
 		} else {
@@ -84,9 +92,30 @@ public:
 		return change;
 	}
 
+	// 平移与绕模型原位置旋转当前模型，返回模型是否移动
+	bool showModelTransform(std::vector<Model>& models) {
+		bool change = false;
+		change |= ImGui::DragFloat3("translate", glm::value_ptr(translation[currentModelId]), 0.05f);
+		change |= ImGui::SliderFloat3("rotate", glm::value_ptr(rotation[currentModelId]), -180.0, 180.0);
+		if (change) {
+			const glm::vec3& r = rotation[currentModelId];
+			glm::vec3 center = glm::vec3(baseMatrix[currentModelId][3]);
+			glm::mat4 m = glm::translate(glm::mat4(1), translation[currentModelId] + center);
+			m = glm::rotate(m, glm::radians(r.y), glm::vec3(0, 1, 0));
+			m = glm::rotate(m, glm::radians(r.x), glm::vec3(1, 0, 0));
+			m = glm::rotate(m, glm::radians(r.z), glm::vec3(0, 0, 1));
+			m = glm::translate(m, -center);
+			models[currentModelId].modelMatrix = m * baseMatrix[currentModelId];
+		}
+		return change;
+	}
+
 	const char* modelSettingCurrentItem;
+	int currentModelId;
 	int currentMaterialId;
 	unsigned int materialTex;
 	std::vector<const char*> modelNames;
 	std::vector<int> materialId;
+	std::vector<glm::mat4> baseMatrix;
+	std::vector<glm::vec3> translation, rotation;
 };
\ No newline at end of file
@@ -8,6 +8,17 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 #endif
+#ifdef _WIN32
+// 场景缓存使用文件映射，需要在glad之前包含，避免APIENTRY重定义
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "glad/glad.h"
 #include "GLFW/glfw3.h"
 #include "ImGui/imgui.h"
@@ -19,15 +30,33 @@
 #include "assimp/Importer.hpp"
 #include "assimp/scene.h"
 #include "assimp/postprocess.h"
+#include "assimp/DefaultIOSystem.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <limits>
 #include <vector>
 #include <map>
+#include <deque>
 #include <set>
 #include <algorithm>
 #include <random>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #pragma comment(lib, "./lib/glfw3.lib")
 #pragma comment(lib, "./lib/assimp-vc143-mt.lib")
@@ -45,8 +74,8 @@ constexpr int SCREEN_HEIGHT = 512;
 constexpr int VERTEX_SIZE = 15;
 constexpr int MATERIAL_SIZE = 18; 
 constexpr int TRIANGLE_SIZE = 6;
-constexpr int BVHNODE_SIZE = 12;
 constexpr int LIGHT_SIZE = 3;
+constexpr int INSTANCE_SIZE = 27;
 
 
 struct Vertex {
@@ -111,9 +140,10 @@ std::vector<Vertex> vertices;
 std::vector<Triangle> triangles;
 std::vector<Material> materials;
 std::vector<unsigned char*> textures; 
-// ͬ·ָtexturesͬһʡռ
+// 相同路径指向textures中同一个纹理，节省空间
 std::map<std::string, int> texturePathToId;
 std::vector<TextureInfo> textureInfos;
+std::vector<std::string> texturePaths; // 与textures顺序相同，写入场景缓存
 std::vector<Light> lights;
 std::vector<Model> models;
 
@@ -142,6 +172,25 @@ inline glm::vec3 TextureGetColor1(int i, float u, float v) {
 	return color / 255.f;
 }
 
+// 与GL_LINEAR、GL_REPEAT相同的双线性采样，单通道纹理与GL_RED相同只有红色分量
+inline glm::vec3 TextureGetColorBilinear(int i, const glm::vec2& uv) {
+	const TextureInfo& info = textureInfos[i];
+	float fx = (uv.x - std::floor(uv.x)) * info.width - 0.5f;
+	float fy = (uv.y - std::floor(uv.y)) * info.height - 0.5f;
+	int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+	float tx = fx - x0, ty = fy - y0;
+	auto texel = [&](int x, int y) {
+		x = (x % info.width + info.width) % info.width;
+		y = (y % info.height + info.height) % info.height;
+		const unsigned char* p = textures[i] + info.nChannels * (y * info.width + x);
+		if (info.nChannels < 3) return glm::vec3(p[0], 0, 0);
+		return glm::vec3(p[0], p[1], p[2]);
+	};
+	glm::vec3 color = glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), tx),
+		glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), tx), ty);
+	return color / 255.f;
+}
+
 inline float Rand0To1() {
 	static std::default_random_engine e;
 	static std::uniform_real_distribution<float> real(0, 1);
@@ -0,0 +1,173 @@
+#pragma once
+#include "PnRT.hpp"
+
+/*
+	光线包：RAY_PACKET_SIZE条光线按分量连续存储(SoA)，一次SIMD运算同时处理所有光线
+	启用AVX时每个分量为一个8宽寄存器，否则为两个SSE寄存器，两种情况下包的大小都为8
+	activeMask的第i位表示第i条光线参与求交，不足8条时其余光线不需要初始化
+*/
+constexpr int RAY_PACKET_SIZE = 8;
+
+struct alignas(32) RayPacket {
+	void Set(int i, const Ray& ray) {
+		for (int axis = 0; axis < 3; ++axis) {
+			origin[axis][i] = ray.origin[axis];
+			dir[axis][i] = ray.dir[axis];
+		}
+		tMax[i] = ray.tMax;
+	}
+	Ray Get(int i) const {
+		Ray ray;
+		ray.origin = glm::vec3(origin[0][i], origin[1][i], origin[2][i]);
+		ray.dir = glm::vec3(dir[0][i], dir[1][i], dir[2][i]);
+		ray.tMax = tMax[i];
+		return ray;
+	}
+	float origin[3][RAY_PACKET_SIZE];
+	float dir[3][RAY_PACKET_SIZE];
+	float tMax[RAY_PACKET_SIZE]; // 与Ray相同，最近交点求交后缩短为交点距离
+};
+
+constexpr int RAY_PACKET_FULL_MASK = (1 << RAY_PACKET_SIZE) - 1;
+
+// 位掩码中编号最小的光线
+inline int PacketFirstLane(int mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// 光线包的8宽浮点数，比较结果同样以每个分量全1或全0的形式存储
+struct PacketFloat {
+#ifdef __AVX__
+	__m256 v;
+#else
+	__m128 lo, hi;
+#endif
+};
+
+inline PacketFloat PacketLoad(const float* p) {
+	PacketFloat r;
+#ifdef __AVX__
+	r.v = _mm256_load_ps(p);
+#else
+	r.lo = _mm_load_ps(p);
+	r.hi = _mm_load_ps(p + 4);
+#endif
+	return r;
+}
+
+inline void PacketStore(float* p, const PacketFloat& a) {
+#ifdef __AVX__
+	_mm256_store_ps(p, a.v);
+#else
+	_mm_store_ps(p, a.lo);
+	_mm_store_ps(p + 4, a.hi);
+#endif
+}
+
+inline PacketFloat PacketSet1(float f) {
+	PacketFloat r;
+#ifdef __AVX__
+	r.v = _mm256_set1_ps(f);
+#else
+	r.lo = r.hi = _mm_set1_ps(f);
+#endif
+	return r;
+}
+
+#ifdef __AVX__
+#define PACKET_BINARY_OP(name, avx, sse) \
+	inline PacketFloat name(const PacketFloat& a, const PacketFloat& b) { \
+		PacketFloat r; \
+		r.v = avx(a.v, b.v); \
+		return r; \
+	}
+#define PACKET_COMPARE_OP(name, avxPredicate, sse) \
+	inline PacketFloat name(const PacketFloat& a, const PacketFloat& b) { \
+		PacketFloat r; \
+		r.v = _mm256_cmp_ps(a.v, b.v, avxPredicate); \
+		return r; \
+	}
+#else
+#define PACKET_BINARY_OP(name, avx, sse) \
+	inline PacketFloat name(const PacketFloat& a, const PacketFloat& b) { \
+		PacketFloat r; \
+		r.lo = sse(a.lo, b.lo); \
+		r.hi = sse(a.hi, b.hi); \
+		return r; \
+	}
+#define PACKET_COMPARE_OP(name, avxPredicate, sse) PACKET_BINARY_OP(name, , sse)
+#endif
+
+PACKET_BINARY_OP(operator+, _mm256_add_ps, _mm_add_ps)
+PACKET_BINARY_OP(operator-, _mm256_sub_ps, _mm_sub_ps)
+PACKET_BINARY_OP(operator*, _mm256_mul_ps, _mm_mul_ps)
+PACKET_BINARY_OP(operator/, _mm256_div_ps, _mm_div_ps)
+PACKET_BINARY_OP(operator&, _mm256_and_ps, _mm_and_ps)
+PACKET_BINARY_OP(operator|, _mm256_or_ps, _mm_or_ps)
+PACKET_BINARY_OP(PacketMin, _mm256_min_ps, _mm_min_ps)
+PACKET_BINARY_OP(PacketMax, _mm256_max_ps, _mm_max_ps)
+PACKET_COMPARE_OP(operator<, _CMP_LT_OQ, _mm_cmplt_ps)
+PACKET_COMPARE_OP(operator<=, _CMP_LE_OQ, _mm_cmple_ps)
+PACKET_COMPARE_OP(operator>, _CMP_GT_OQ, _mm_cmpgt_ps)
+PACKET_COMPARE_OP(operator>=, _CMP_GE_OQ, _mm_cmpge_ps)
+PACKET_COMPARE_OP(operator==, _CMP_EQ_OQ, _mm_cmpeq_ps)
+PACKET_COMPARE_OP(operator!=, _CMP_NEQ_UQ, _mm_cmpneq_ps)
+
+#undef PACKET_BINARY_OP
+#undef PACKET_COMPARE_OP
+
+// mask对应的分量取a，否则取b
+inline PacketFloat PacketSelect(const PacketFloat& mask, const PacketFloat& a, const PacketFloat& b) {
+	PacketFloat r;
+#ifdef __AVX__
+	r.v = _mm256_blendv_ps(b.v, a.v, mask.v);
+#else
+	r.lo = _mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo));
+	r.hi = _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi));
+#endif
+	return r;
+}
+
+inline PacketFloat PacketAbs(const PacketFloat& a) {
+	PacketFloat r;
+#ifdef __AVX__
+	r.v = _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v);
+#else
+	r.lo = _mm_andnot_ps(_mm_set1_ps(-0.f), a.lo);
+	r.hi = _mm_andnot_ps(_mm_set1_ps(-0.f), a.hi);
+#endif
+	return r;
+}
+
+// 比较结果转为位掩码，第i位对应第i条光线
+inline int PacketMoveMask(const PacketFloat& mask) {
+#ifdef __AVX__
+	return _mm256_movemask_ps(mask.v);
+#else
+	return _mm_movemask_ps(mask.lo) | (_mm_movemask_ps(mask.hi) << 4);
+#endif
+}
+
+// 位掩码转为比较结果的形式
+inline PacketFloat PacketMaskFromBits(int bits) {
+	alignas(32) static const int lanes[RAY_PACKET_SIZE] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	// AVX没有256位整数比较，按两个SSE寄存器计算
+	__m128i bitLo = _mm_load_si128((const __m128i*)lanes), bitHi = _mm_load_si128((const __m128i*)(lanes + 4));
+	__m128i b = _mm_set1_epi32(bits);
+	__m128 lo = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, bitLo), bitLo));
+	__m128 hi = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(b, bitHi), bitHi));
+	PacketFloat r;
+#ifdef __AVX__
+	r.v = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+#else
+	r.lo = lo;
+	r.hi = hi;
+#endif
+	return r;
+}
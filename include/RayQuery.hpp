@@ -0,0 +1,94 @@
+#pragma once
+#include "PnRT.hpp"
+#include "BVH.hpp"
+#include "TraversalQuery.hpp"
+#include "parallel.hpp"
+
+/*
+	批量光线查询：不经过渲染器，直接用场景的BVH对大量光线求交，供烘焙可见性、传感器仿真等工具使用
+	场景与渲染时相同由ModelOutput生成：
+		LoadModels(models);
+		ModelOutput(models);
+		BVH bvh(vertices, triangles, bvhSetting);
+		RayQuery query(bvh);
+		query.Trace(RayQueryType::Closest, rays, hits);
+	光线与结果都按分量连续存储(SoA)，内存由调用者持有并可在多次调用之间复用，Trace本身不分配内存
+	光线分块后由全局线程池并行求交，块内按顺序逐条遍历宽BVH
+*/
+enum class RayQueryType {
+	Closest, // 最近交点
+	Occlusion // 光线范围内是否有任意交点，找到后立即停止，结果为遇到的第一个交点而不一定是最近的
+};
+
+struct RayQueryRays {
+	int count = 0;
+	const float* origin[3] = { nullptr, nullptr, nullptr };
+	const float* dir[3] = { nullptr, nullptr, nullptr }; // 不需要归一化，交点距离以dir的长度为单位
+	const float* tMax = nullptr; // 为空时光线范围不限
+};
+
+/*
+	每条光线的结果，不需要的分量可以为空
+	未击中时t为-1，triangleId与materialId为-1，重心坐标不写入
+	triangleId为三角形在ModelOutput输出的triangles中的编号，不受BVH重排与空间划分的影响
+	交点为b0 * p0 + b1 * p1 + b2 * p2，b0 = 1 - b1 - b2
+*/
+struct RayQueryHits {
+	float* t = nullptr;
+	int* triangleId = nullptr;
+	float* b1 = nullptr;
+	float* b2 = nullptr;
+	int* materialId = nullptr;
+};
+
+class RayQuery {
+public:
+	// 每块光线的个数，块内连续求交，块之间由线程池分配
+	static constexpr int BLOCK_SIZE = 256;
+
+	// bvh在查询期间需要保持不变
+	explicit RayQuery(const BVH& bvh) : bvh(bvh) {}
+
+	// 对rays中的所有光线求交并写入hits，serial为true时只使用调用线程
+	void Trace(RayQueryType type, const RayQueryRays& rays, const RayQueryHits& hits, bool serial = false) const {
+		int nBlocks = (rays.count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		auto func = [&](int block) {
+			int begin = block * BLOCK_SIZE, end = std::min(begin + BLOCK_SIZE, rays.count);
+			if (type == RayQueryType::Closest) TraceBlock<ClosestHitQuery>(rays, hits, begin, end);
+			else TraceBlock<AnyHitQuery>(rays, hits, begin, end);
+		};
+		if (serial) {
+			for (int block = 0; block < nBlocks; ++block) func(block);
+		} else {
+			ParallelFor(0, nBlocks, 1, func);
+		}
+	}
+
+private:
+	template <typename Query>
+	void TraceBlock(const RayQueryRays& rays, const RayQueryHits& hits, int begin, int end) const {
+		for (int i = begin; i < end; ++i) {
+			Ray ray;
+			ray.origin = glm::vec3(rays.origin[0][i], rays.origin[1][i], rays.origin[2][i]);
+			ray.dir = glm::vec3(rays.dir[0][i], rays.dir[1][i], rays.dir[2][i]);
+			if (rays.tMax) ray.tMax = rays.tMax[i];
+			Query query;
+			bvh.Traverse(ray, &query);
+			const TriangleHit& hit = query.hit;
+			if (hit.triangle == -1) {
+				if (hits.t) hits.t[i] = -1.f;
+				if (hits.triangleId) hits.triangleId[i] = -1;
+				if (hits.materialId) hits.materialId[i] = -1;
+				continue;
+			}
+			const Triangle& tri = bvh.triangles[hit.triangle];
+			if (hits.t) hits.t[i] = hit.t;
+			if (hits.triangleId) hits.triangleId[i] = tri.primitiveId;
+			if (hits.b1) hits.b1[i] = hit.b1;
+			if (hits.b2) hits.b2[i] = hit.b2;
+			if (hits.materialId) hits.materialId[i] = tri.materialId;
+		}
+	}
+
+	const BVH& bvh;
+};
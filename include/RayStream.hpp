@@ -0,0 +1,67 @@
+#pragma once
+#include "PnRT.hpp"
+#include "bound.hpp"
+#include "morton.hpp"
+
+/*
+	光线流：收集一批光线，排序后按新的顺序连续存放并求交，结果仍按加入时的编号写回
+	排序键高3位为方向所在的卦限，低27位为起点在场景包围盒中的Morton码（每个轴9位），
+	方向相同、起点相近的光线连续求交，访问的BVH节点与三角形基本相同，缓存命中率更高
+	排序后光线按新顺序复制到连续的数组中，求交时顺序读取，避免按编号随机访问
+*/
+class RayStream {
+public:
+	explicit RayStream(const Bound& sceneBound) : sceneBound(sceneBound) {
+		glm::vec3 diagonal = sceneBound.Diagonal();
+		for (int axis = 0; axis < 3; ++axis)
+			invDiagonal[axis] = diagonal[axis] > 0.f ? 1.f / diagonal[axis] : 0.f;
+	}
+
+	void Clear() {
+		rays.clear();
+		sorted.clear();
+	}
+
+	// 加入一条光线，返回其编号
+	int Add(const Ray& ray) {
+		rays.push_back(ray);
+		return (int)rays.size() - 1;
+	}
+
+	int Size() const {
+		return rays.size();
+	}
+
+	void Sort() {
+		int n = rays.size();
+		keys.resize(n);
+		for (int i = 0; i < n; ++i) keys[i] = { SortKey(rays[i]), i };
+		RadixSort(&keys, SORT_KEY_BITS);
+		sorted.resize(n);
+		for (int i = 0; i < n; ++i) sorted[i] = rays[keys[i].index];
+	}
+
+	// 按排序后的顺序对每条光线调用func(编号, 光线)，没有排序时按加入的顺序
+	template <typename F>
+	void Trace(const F& func) const {
+		if (sorted.size() != rays.size()) {
+			for (int i = 0; i < (int)rays.size(); ++i) func(i, rays[i]);
+			return;
+		}
+		for (int i = 0; i < (int)sorted.size(); ++i) func(keys[i].index, sorted[i]);
+	}
+
+private:
+	static constexpr int SORT_KEY_BITS = 30;
+
+	uint64_t SortKey(const Ray& ray) const {
+		uint64_t octant = (ray.dir.x < 0) << 2 | (ray.dir.y < 0) << 1 | (ray.dir.z < 0);
+		glm::vec3 p = (ray.origin - sceneBound.pMin) * invDiagonal;
+		return octant << 27 | MortonCode(p, 9);
+	}
+
+	Bound sceneBound;
+	glm::vec3 invDiagonal;
+	std::vector<Ray> rays, sorted;
+	std::vector<MortonPrimitive> keys;
+};
@@ -0,0 +1,338 @@
+#pragma once
+#include "PnRT.hpp"
+#include "triangle.hpp"
+#include "light.hpp"
+#include "model.hpp"
+#include "BVH.hpp"
+
+/*
+	场景缓存
+	把导入模型、构建BVH并打包后得到的数据写入一个二进制文件，下次启动时若场景没有改变则直接映射该文件
+	文件由文件头、段表和若干段组成，每段按16字节对齐：
+		上传到GPU的段与缓冲纹理中的布局完全相同，映射后直接交给glBufferData
+		其余段是CPU求交、移动模型时需要的结构体数组
+	文件头中记录格式版本与场景的键，键由模型路径、模型文件内容、变换、材质以及BVH设置计算得到，任意一项改变都会使缓存失效
+	材质库与纹理只有导入模型后才知道路径，冷启动时记录在Dependencies段中，热启动时重新计算这些文件的键并与DependencyKey段比较
+*/
+constexpr uint32_t SCENE_CACHE_MAGIC = 0x43546e50; // "PnTC"
+constexpr uint32_t SCENE_CACHE_VERSION = 2;
+
+enum class SceneCacheSection : uint32_t {
+	// 上传到GPU的数据
+	VertexBuffer,
+	TriangleBuffer,
+	BVHNodeBuffer,
+	LightBuffer,
+	// CPU使用的数据
+	Vertices,
+	Triangles,
+	Nodes,
+	Lights,
+	BLASRanges, // 每个BLAS在合并数组中的节点、三角形、顶点偏移与数量
+	InstanceBLAS, // 每个实例引用的BLAS
+	ModelRanges, // 不使用实例时每个模型的顶点区间
+	TexturePaths, // 按纹理编号排列，以'\0'分隔
+	Dependencies, // 模型文件以外导入时读取的文件（材质库）与网格引用的纹理路径，以'\0'分隔
+	DependencyKey, // Dependencies中文件的路径与内容的哈希
+	Count
+};
+
+// 指向连续内存的只读区间，不拥有内存
+template <typename T>
+struct Span {
+	const T* data = nullptr;
+	size_t size = 0;
+	Span() = default;
+	Span(const T* data, size_t size) : data(data), size(size) {}
+	Span(const std::vector<T>& v) : data(v.data()), size(v.size()) {}
+	const T& operator[](size_t i) const { return data[i]; }
+	const T* begin() const { return data; }
+	const T* end() const { return data + size; }
+	size_t Bytes() const { return sizeof(T) * size; }
+};
+
+struct SceneCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	struct {
+		uint64_t offset;
+		uint64_t size;
+	} sections[(int)SceneCacheSection::Count];
+};
+
+// FNV-1a哈希
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+template <typename T>
+inline uint64_t HashValue(const T& value, uint64_t hash) {
+	return HashBytes(&value, sizeof(T), hash);
+}
+
+inline uint64_t HashString(const std::string& s, uint64_t hash) {
+	hash = HashValue(s.size(), hash);
+	return HashBytes(s.data(), s.size(), hash);
+}
+
+// 哈希文件内容，文件不存在时返回false
+inline bool HashFile(const std::string& path, uint64_t* hash) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return false;
+	std::vector<char> buffer(1 << 16);
+	while (file) {
+		file.read(buffer.data(), buffer.size());
+		*hash = HashBytes(buffer.data(), (size_t)file.gcount(), *hash);
+	}
+	return true;
+}
+
+/*
+	计算场景缓存的键：缓存格式、数据结构的大小、BVH设置，以及每个模型的路径、文件内容、变换和材质
+	模型文件不存在时返回0，此时不使用缓存
+*/
+inline uint64_t SceneCacheKey(const std::vector<Model>& models, const BVHSetting& setting, bool instancing) {
+	uint64_t hash = HashValue(SCENE_CACHE_VERSION, 14695981039346656037ull);
+	hash = HashValue(sizeof(Vertex), hash);
+	hash = HashValue(sizeof(Triangle), hash);
+	hash = HashValue(sizeof(BVHNode), hash);
+	hash = HashValue(sizeof(Light), hash);
+	hash = HashValue(instancing, hash);
+	// BVHSetting中有填充字节，逐个成员计算
+	hash = HashValue(setting.method, hash);
+	hash = HashValue(setting.mortonBits, hash);
+	hash = HashValue(setting.nBuckets, hash);
+	hash = HashValue(setting.maxTrianglesInLeaf, hash);
+	hash = HashValue(setting.trav, hash);
+	hash = HashValue(setting.spatialSplit, hash);
+	hash = HashValue(setting.splitBudget, hash);
+	hash = HashValue(setting.splitAlpha, hash);
+	hash = HashValue(setting.optimizePasses, hash);
+	hash = HashValue(setting.treeletSize, hash);
+	for (const auto& model : models) {
+		hash = HashString(model.path, hash);
+		if (!HashFile(model.path, &hash)) return 0;
+		hash = HashBytes(glm::value_ptr(model.modelMatrix), sizeof(float) * 16, hash);
+		hash = HashValue(model.material, hash);
+	}
+	return hash == 0 ? 1 : hash;
+}
+
+// 场景依赖的模型文件以外的文件：导入时读取的材质库等文件，以及网格引用的纹理（包括读取失败的纹理），按路径排序
+inline std::vector<std::string> SceneDependencies(const std::vector<Model>& models) {
+	std::set<std::string> files;
+	for (const auto& model : models) {
+		for (const auto& file : model.openedFiles)
+			if (file != model.path) files.insert(file);
+		for (const auto& mesh : model.meshes)
+			if (!mesh.texturePath.empty()) files.insert(mesh.texturePath);
+	}
+	return std::vector<std::string>(files.begin(), files.end());
+}
+
+// 依赖文件的键，文件不存在时只计入路径，之后文件出现也会使缓存失效
+inline uint64_t SceneDependencyKey(const std::vector<std::string>& files) {
+	uint64_t hash = 14695981039346656037ull;
+	for (const auto& file : files) {
+		hash = HashString(file, hash);
+		bool exists = HashFile(file, &hash);
+		hash = HashValue(exists, hash);
+	}
+	return hash;
+}
+
+// 只读的文件映射
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() {
+		Close();
+	}
+
+	bool Open(const std::string& path) {
+		Close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			Close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping) {
+			Close();
+			return false;
+		}
+		data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if (!data) {
+			Close();
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return false;
+		data = static_cast<const unsigned char*>(p);
+		size = (size_t)st.st_size;
+#endif
+		return true;
+	}
+
+	void Close() {
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data) munmap(const_cast<unsigned char*>(data), size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+class SceneCache {
+public:
+	// 映射缓存文件，文件不存在、格式版本、键或依赖文件的键不一致时返回false
+	bool Open(const std::string& path, uint64_t key) {
+		if (key == 0 || !file.Open(path)) return false;
+		if (file.size < sizeof(SceneCacheHeader)) return Fail();
+		std::memcpy(&header, file.data, sizeof(header));
+		if (header.magic != SCENE_CACHE_MAGIC || header.version != SCENE_CACHE_VERSION || header.key != key) return Fail();
+		for (const auto& section : header.sections) {
+			if (section.offset % 16 != 0 || section.offset > file.size || section.size > file.size - section.offset) return Fail();
+		}
+		Span<uint64_t> dependencyKey = Get<uint64_t>(SceneCacheSection::DependencyKey);
+		if (dependencyKey.size != 1 || dependencyKey[0] != SceneDependencyKey(GetStrings(SceneCacheSection::Dependencies))) return Fail();
+		return true;
+	}
+
+	// 段的大小不是元素大小的整数倍时返回空区间
+	template <typename T>
+	Span<T> Get(SceneCacheSection id) const {
+		const auto& section = header.sections[(int)id];
+		if (!file.data || section.size % sizeof(T) != 0) return Span<T>();
+		return Span<T>(reinterpret_cast<const T*>(file.data + section.offset), section.size / sizeof(T));
+	}
+
+	template <typename T>
+	std::vector<T> GetVector(SceneCacheSection id) const {
+		Span<T> span = Get<T>(id);
+		return std::vector<T>(span.begin(), span.end());
+	}
+
+	std::vector<std::string> GetStrings(SceneCacheSection id) const {
+		std::vector<std::string> strings;
+		Span<char> span = Get<char>(id);
+		const char* begin = span.begin();
+		for (const char* p = span.begin(); p != span.end(); ++p) {
+			if (*p == '\0') {
+				strings.emplace_back(begin, p);
+				begin = p + 1;
+			}
+		}
+		return strings;
+	}
+
+	void Close() {
+		file.Close();
+	}
+
+private:
+	bool Fail() {
+		file.Close();
+		return false;
+	}
+
+	MappedFile file;
+	SceneCacheHeader header;
+};
+
+// 收集各段数据并写入缓存文件，写入的数据在Save之前必须保持有效
+class SceneCacheWriter {
+public:
+	template <typename T>
+	void Add(SceneCacheSection id, Span<T> span) {
+		sections[(int)id] = { static_cast<const void*>(span.data), span.Bytes() };
+	}
+
+	void AddStrings(SceneCacheSection id, const std::vector<std::string>& strings) {
+		std::string& buffer = stringBuffers[(int)id];
+		buffer.clear();
+		for (const auto& s : strings) {
+			buffer += s;
+			buffer.push_back('\0');
+		}
+		sections[(int)id] = { static_cast<const void*>(buffer.data()), buffer.size() };
+	}
+
+	// 先写入临时文件再替换，避免程序中断留下不完整的缓存
+	bool Save(const std::string& path, uint64_t key) const {
+		if (key == 0) return false;
+		SceneCacheHeader header;
+		std::memset(&header, 0, sizeof(header));
+		header.magic = SCENE_CACHE_MAGIC;
+		header.version = SCENE_CACHE_VERSION;
+		header.key = key;
+		uint64_t offset = AlignUp(sizeof(header));
+		for (int i = 0; i < (int)SceneCacheSection::Count; ++i) {
+			header.sections[i].offset = offset;
+			header.sections[i].size = sections[i].size;
+			offset = AlignUp(offset + sections[i].size);
+		}
+		std::string tempPath = path + ".tmp";
+		{
+			std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+			if (!out) return false;
+			static const char padding[16] = {};
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			uint64_t written = sizeof(header);
+			for (int i = 0; i < (int)SceneCacheSection::Count; ++i) {
+				out.write(padding, header.sections[i].offset - written);
+				if (sections[i].size) out.write(static_cast<const char*>(sections[i].data), sections[i].size);
+				written = header.sections[i].offset + sections[i].size;
+			}
+			if (!out) return false;
+		}
+		std::remove(path.c_str());
+		return std::rename(tempPath.c_str(), path.c_str()) == 0;
+	}
+
+private:
+	static uint64_t AlignUp(uint64_t x) {
+		return (x + 15) & ~(uint64_t)15;
+	}
+
+	struct Section {
+		const void* data = nullptr;
+		size_t size = 0;
+	} sections[(int)SceneCacheSection::Count];
+	std::string stringBuffers[(int)SceneCacheSection::Count];
+};
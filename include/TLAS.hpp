@@ -0,0 +1,499 @@
+#pragma once
+#include "PnRT.hpp"
+#include "bound.hpp"
+#include "BVH.hpp"
+#include "model.hpp"
+
+// 场景中的一个实例：引用一个模型空间中的网格BVH（BLAS），以及实例的变换和材质
+struct Instance {
+	int blasId = 0;
+	int materialId = 0; // 实例的材质覆盖BLAS中三角形的材质
+	glm::mat4 objectToWorld = glm::mat4(1);
+	glm::mat4 worldToObject = glm::mat4(1);
+	Bound bound; // 世界空间中的包围盒
+};
+
+/*
+	两层加速结构
+	每个不同的网格只在模型空间中构建一次BLAS，顶层BVH以实例在世界空间中的包围盒构建
+	顶层的每个叶子只包含一个实例，startIndex即为实例编号，节点数固定为2n - 1
+	实例移动后只需重建顶层，BLAS与GPU中的顶点、三角形都不需要改变
+*/
+class TLAS {
+public:
+	// setting中只使用orderedTraversal，决定顶层的遍历顺序，BLAS按各自的setting遍历
+	TLAS(std::vector<std::shared_ptr<BVH>> blases, std::vector<Instance> instances, const BVHSetting& setting = BVHSetting())
+		: blases(std::move(blases)), instances(std::move(instances)), setting(setting) {
+		Build();
+		// GPU中顶层节点在前，之后依次为各个BLAS的节点，顶层节点数不随实例移动改变
+		int nodeOffset = bvh.size(), triangleOffset = 0, vertexOffset = 0;
+		for (const auto& blas : this->blases) {
+			blasNodeOffset.push_back(nodeOffset);
+			blasTriangleOffset.push_back(triangleOffset);
+			blasVertexOffset.push_back(vertexOffset);
+			nodeOffset += blas->bvh.size();
+			triangleOffset += blas->triangles.size();
+			vertexOffset += blas->vertices.size();
+		}
+	}
+
+	// 修改实例的变换，之后需要调用Build重建顶层
+	void SetTransform(int id, const glm::mat4& objectToWorld) {
+		instances[id].objectToWorld = objectToWorld;
+		instances[id].worldToObject = glm::inverse(objectToWorld);
+	}
+
+	// 重新计算实例的世界空间包围盒并构建顶层BVH
+	void Build() {
+		for (auto& instance : instances) {
+			instance.bound = Bound();
+			const BVH& blas = *blases[instance.blasId];
+			if (blas.bvh.empty()) continue;
+			// 变换BLAS根节点包围盒的8个顶点
+			const Bound& b = blas.bvh[0].bound;
+			for (int i = 0; i < 8; ++i) {
+				glm::vec3 corner((i & 1) ? b.pMax.x : b.pMin.x,
+					(i & 2) ? b.pMax.y : b.pMin.y,
+					(i & 4) ? b.pMax.z : b.pMin.z);
+				instance.bound.Union(glm::vec3(instance.objectToWorld * glm::vec4(corner, 1.0)));
+			}
+		}
+		bvh.clear();
+		if (instances.empty()) return;
+		bvh.reserve(2 * instances.size() - 1);
+		std::vector<int> ids(instances.size());
+		for (int i = 0; i < ids.size(); ++i) ids[i] = i;
+		BuildNode(ids.data(), ids.size());
+	}
+
+	bool Intersect(const Ray& r, Interaction* isect) const {
+		TriangleHit hit;
+		if (!IntersectHit(r, &hit)) return false;
+		SurfaceInteraction(hit, r, isect);
+		return true;
+	}
+
+	// 最近交点求交，只记录交点所在的实例、三角形编号、距离与重心坐标，表面信息由SurfaceInteraction计算
+	bool IntersectHit(const Ray& r, TriangleHit* hit) const {
+		ClosestHitQuery query;
+		Traverse(r, &query);
+		*hit = query.hit;
+		return hit->triangle != -1;
+	}
+
+	// 所有交点：与BVH的IntersectAll相同，交点的instance为所在的实例，t为世界空间中的距离
+	template <typename F>
+	void IntersectAll(const Ray& r, const F& onHit) const {
+		AllHitsQuery<F> query(onHit);
+		Traverse(r, &query);
+	}
+
+	// 最近的K个交点，按距离从近到远写入hits，返回交点个数
+	template <int K>
+	int IntersectNearest(const Ray& r, TriangleHit* hits) const {
+		NearestHitsQuery<K> query;
+		Traverse(r, &query);
+		for (int i = 0; i < query.nHits; ++i) hits[i] = query.hits[i];
+		return query.nHits;
+	}
+
+	/*
+		以查询策略Query遍历两层加速结构，见TraversalQuery.hpp
+		顶层叶子中的光线变换到模型空间后交给实例的BLAS，由BLAS的Traverse遍历，query->instance记录当前的实例
+		模型空间中的t与世界空间相同，BLAS中缩短的tMax直接用于之后的顶层节点
+		与BVH::Traverse相同，需要排序的查询在启用orderedTraversal时顶层也按距离排序
+		query->Block返回false而提前结束时返回false
+	*/
+	template <typename Query>
+	bool Traverse(const Ray& r, Query* query) const {
+		auto leaf = [&](int instanceId) {
+			const Instance& instance = instances[instanceId];
+			const BVH& blas = *blases[instance.blasId];
+			EnterInstance(query, instanceId, blas);
+			Ray objectRay = ToObjectRay(instance, r);
+			bool finished = blas.Traverse(objectRay, query);
+			r.tMax = objectRay.tMax;
+			return finished;
+		};
+		if (Query::SORT_CHILDREN && setting.orderedTraversal) return TopOrderedTraverse(r, leaf);
+		return TopTraverse(r, leaf);
+	}
+
+	// 由IntersectHit的结果计算世界空间中交点的表面信息
+	void SurfaceInteraction(const TriangleHit& hit, const Ray& r, Interaction* isect) const {
+		const Instance& instance = instances[hit.instance];
+		Interaction objectIsect;
+		blases[instance.blasId]->SurfaceInteraction(hit, ToObjectRay(instance, r), &objectIsect);
+		isect->position = r.origin + r.dir * objectIsect.time;
+		// 法线使用逆转置矩阵变换
+		isect->normal = glm::normalize(glm::transpose(glm::mat3(instance.worldToObject)) * objectIsect.normal);
+		isect->texcoord = objectIsect.texcoord;
+		isect->textureId = objectIsect.textureId;
+		isect->materialId = instance.materialId;
+		isect->time = objectIsect.time;
+	}
+
+	bool IntersectP(const Ray& r) const {
+		return FindOccluder(r).triangle != -1;
+	}
+
+	// 与BVH的IntersectP相同，缓存中记录遮挡三角形所在的实例与三角形编号
+	bool IntersectP(const Ray& r, OcclusionCache* cache, int slot) const {
+		OcclusionCache::Occluder& occluder = cache->occluders[slot];
+		++cache->queries;
+		if (occluder.triangle != -1) {
+			const Instance& instance = instances[occluder.instance];
+			const BVH& blas = *blases[instance.blasId];
+			const Triangle& tri = blas.triangles[occluder.triangle];
+			Ray objectRay = ToObjectRay(instance, r);
+			// 与遍历相同，先测试实例与三角形的包围盒
+			if (BoundIntersect(instance.bound, TraversalRay(r), r.tMax) &&
+				BoundIntersect(tri.bound, TraversalRay(objectRay), objectRay.tMax) &&
+				TriangleIntersectP(tri, objectRay, blas.vertices)) {
+				++cache->hits;
+				return true;
+			}
+		}
+		OcclusionCache::Occluder found = FindOccluder(r);
+		if (found.triangle == -1) return false;
+		occluder = found;
+		return true;
+	}
+
+	// 相交测试，返回遮挡光线的任意一个三角形，没有遮挡时triangle为-1
+	OcclusionCache::Occluder FindOccluder(const Ray& r) const {
+		AnyHitQuery query;
+		Traverse(r, &query);
+		OcclusionCache::Occluder occluder;
+		occluder.triangle = query.hit.triangle;
+		occluder.instance = query.hit.instance;
+		return occluder;
+	}
+
+	/*
+		光线包求交：顶层逐条光线测试实例的包围盒，击中同一个实例的光线变换到模型空间后组成新的包在BLAS中求交
+		返回击中的光线的位掩码，击中的光线的tMax缩短为交点距离，isects[i]为第i条光线的交点
+	*/
+	int IntersectPacket(RayPacket& packet, int activeMask, Interaction* isects) const {
+		TriangleHit hits[RAY_PACKET_SIZE];
+		int hitMask = 0;
+		PacketTraverse(packet, activeMask, [&](int instanceId, int laneMask) {
+			const Instance& instance = instances[instanceId];
+			RayPacket objectPacket = ToObjectPacket(instance, packet, laneMask);
+			TriangleHit instanceHits[RAY_PACKET_SIZE];
+			int instanceMask = blases[instance.blasId]->IntersectPacketHits(objectPacket, laneMask, instanceHits);
+			for (int mask = instanceMask; mask; mask &= mask - 1) {
+				int i = PacketFirstLane(mask);
+				hits[i] = instanceHits[i];
+				hits[i].instance = instanceId;
+				packet.tMax[i] = objectPacket.tMax[i];
+			}
+			hitMask |= instanceMask;
+			return 0;
+		});
+		for (int mask = hitMask; mask; mask &= mask - 1) {
+			int i = PacketFirstLane(mask);
+			SurfaceInteraction(hits[i], packet.Get(i), &isects[i]);
+		}
+		return hitMask;
+	}
+
+	// 光线包相交测试，返回被遮挡的光线的位掩码，被遮挡的光线不再参与之后的求交
+	int OccludedPacket(const RayPacket& packet, int activeMask) const {
+		int occluded = 0;
+		PacketTraverse(packet, activeMask, [&](int instanceId, int laneMask) {
+			const Instance& instance = instances[instanceId];
+			RayPacket objectPacket = ToObjectPacket(instance, packet, laneMask);
+			int instanceMask = blases[instance.blasId]->OccludedPacket(objectPacket, laneMask);
+			occluded |= instanceMask;
+			return instanceMask;
+		});
+		return occluded;
+	}
+
+	/*
+		合并为GPU使用的顶点、三角形与节点数组
+		顶层节点在前（根节点编号为0），之后是各个BLAS的节点，BLAS节点的儿子和三角形区间加上各自的偏移
+		顶层叶子的startIndex为实例编号
+	*/
+	void Merge(std::vector<Vertex>* vertices, std::vector<Triangle>* triangles, std::vector<BVHNode>* nodes) const {
+		vertices->clear();
+		triangles->clear();
+		*nodes = bvh;
+		for (int b = 0; b < blases.size(); ++b) {
+			const BVH& blas = *blases[b];
+			vertices->insert(vertices->end(), blas.vertices.begin(), blas.vertices.end());
+			for (Triangle tri : blas.triangles) {
+				for (int k = 0; k < 3; ++k) tri.indices[k] += blasVertexOffset[b];
+				triangles->push_back(tri);
+			}
+			for (BVHNode node : blas.bvh) {
+				if (node.rightChild != -1) node.rightChild += blasNodeOffset[b];
+				node.startIndex += blasTriangleOffset[b];
+				node.endIndex += blasTriangleOffset[b];
+				nodes->push_back(node);
+			}
+		}
+	}
+
+	std::vector<std::shared_ptr<BVH>> blases;
+	std::vector<Instance> instances; // 与场景中模型的顺序相同
+	std::vector<BVHNode> bvh; // 顶层BVH
+	BVHSetting setting;
+	// 各个BLAS在合并后数组中的偏移，blasNodeOffset即为BLAS根节点的编号
+	std::vector<int> blasNodeOffset, blasTriangleOffset, blasVertexOffset;
+private:
+	// 光线变换到模型空间，方向不归一化，因此模型空间中的t与世界空间相同
+	static Ray ToObjectRay(const Instance& instance, const Ray& r) {
+		Ray ray;
+		ray.origin = glm::vec3(instance.worldToObject * glm::vec4(r.origin, 1.0));
+		ray.dir = glm::vec3(instance.worldToObject * glm::vec4(r.dir, 0.0));
+		ray.tMax = r.tMax;
+		return ray;
+	}
+
+	// 光线包中laneMask对应的光线变换到模型空间，其余光线不需要初始化
+	static RayPacket ToObjectPacket(const Instance& instance, const RayPacket& packet, int laneMask) {
+		RayPacket objectPacket;
+		for (int mask = laneMask; mask; mask &= mask - 1) {
+			int i = PacketFirstLane(mask);
+			objectPacket.Set(i, ToObjectRay(instance, packet.Get(i)));
+		}
+		return objectPacket;
+	}
+
+	// 进入实例的BLAS之前设置查询的当前实例
+	template <typename Query>
+	static void EnterInstance(Query* query, int instanceId, const BVH& /*blas*/) {
+		query->instance = instanceId;
+	}
+
+	// 最近的K个交点还需要按BLAS的三角形去掉空间划分产生的重复交点
+	template <int K>
+	static void EnterInstance(NearestHitsQuery<K>* query, int instanceId, const BVH& blas) {
+		query->instance = instanceId;
+		query->triangles = blas.setting.spatialSplit ? blas.triangles.data() : nullptr;
+	}
+
+	/*
+		顶层遍历：在划分轴上光线方向为负时先访问右儿子，节点出栈时再用当前的tMax测试包围盒
+		叶子中的实例交给leaf(实例编号)处理，leaf返回false时结束遍历并返回false
+	*/
+	template <typename F>
+	bool TopTraverse(const Ray& r, const F& leaf) const {
+		if (bvh.empty()) return true;
+		int nodeStack[128], top = 0;
+		nodeStack[top++] = 0;
+		TraversalRay ray(r);
+		while (top) {
+			const int curId = nodeStack[--top];
+			const BVHNode& node = bvh[curId];
+			if (!BoundIntersect(node.bound, ray, r.tMax)) continue;
+			if (node.rightChild == -1) { // 叶子节点，每个叶子只有一个实例
+				if (!leaf(node.startIndex)) return false;
+			} else if (ray.dirNegative[node.axis]) {
+				nodeStack[top++] = curId + 1;
+				nodeStack[top++] = node.rightChild;
+			} else {
+				nodeStack[top++] = node.rightChild;
+				nodeStack[top++] = curId + 1;
+			}
+		}
+		return true;
+	}
+
+	/*
+		按距离排序的顶层遍历，与BVH::OrderedTraverse相同：两个儿子的包围盒都在父节点中测试，先访问进入时刻较小的儿子
+		出栈时若已找到比进入时刻更近的交点则跳过，与GPU中USE_ORDERED_TRAVERSAL的顶层一致
+	*/
+	template <typename F>
+	bool TopOrderedTraverse(const Ray& r, const F& leaf) const {
+		if (bvh.empty()) return true;
+		struct StackEntry {
+			int node;
+			float t;
+		};
+		StackEntry stack[128];
+		int top = 0;
+		TraversalRay ray(r);
+		float tRoot;
+		if (!BoundIntersect(bvh[0].bound, ray, r.tMax, &tRoot)) return true;
+		stack[top++] = { 0, tRoot };
+		while (top) {
+			const StackEntry entry = stack[--top];
+			if (entry.t > r.tMax) continue;
+			const BVHNode& node = bvh[entry.node];
+			if (node.rightChild == -1) {
+				if (!leaf(node.startIndex)) return false;
+				continue;
+			}
+			const int children[2] = { entry.node + 1, node.rightChild };
+			float t[2];
+			const bool hit0 = BoundIntersect(bvh[children[0]].bound, ray, r.tMax, &t[0]);
+			const bool hit1 = BoundIntersect(bvh[children[1]].bound, ray, r.tMax, &t[1]);
+			if (hit0 && hit1) {
+				// 较远的儿子先压栈，进入时刻相同时先访问左儿子
+				const int nearChild = t[1] < t[0];
+				stack[top++] = { children[1 - nearChild], t[1 - nearChild] };
+				stack[top++] = { children[nearChild], t[nearChild] };
+			} else if (hit0) {
+				stack[top++] = { children[0], t[0] };
+			} else if (hit1) {
+				stack[top++] = { children[1], t[1] };
+			}
+		}
+		return true;
+	}
+
+	/*
+		光线包遍历顶层BVH：实例数量少，节点逐条光线求交，儿子按第一条活跃光线的方向从近到远访问
+		叶子中击中实例包围盒的光线交给leaf(实例编号, 光线掩码)处理，返回值中的光线不再参与遍历
+		leaf缩短packet.tMax后，之后的节点按缩短后的tMax测试
+	*/
+	template <typename F>
+	void PacketTraverse(const RayPacket& packet, int activeMask, const F& leaf) const {
+		activeMask &= RAY_PACKET_FULL_MASK;
+		if (bvh.empty() || !activeMask) return;
+		int dirNegative[3];
+		glm::vec3 dir = packet.Get(PacketFirstLane(activeMask)).dir;
+		for (int axis = 0; axis < 3; ++axis) dirNegative[axis] = std::signbit(dir[axis]);
+		int nodeStack[128], top = 0;
+		nodeStack[top++] = 0;
+		while (top && activeMask) {
+			const int curId = nodeStack[--top];
+			const BVHNode& node = bvh[curId];
+			int nodeMask = 0;
+			for (int mask = activeMask; mask; mask &= mask - 1) {
+				int i = PacketFirstLane(mask);
+				if (BoundIntersect(node.bound, packet.Get(i))) nodeMask |= 1 << i;
+			}
+			if (!nodeMask) continue;
+			if (node.rightChild == -1) {
+				activeMask &= ~leaf(node.startIndex, nodeMask);
+			} else if (dirNegative[node.axis]) {
+				nodeStack[top++] = curId + 1;
+				nodeStack[top++] = node.rightChild;
+			} else {
+				nodeStack[top++] = node.rightChild;
+				nodeStack[top++] = curId + 1;
+			}
+		}
+	}
+
+	// 实例数量较少，按中心排序后扫描所有划分位置，返回节点编号
+	int BuildNode(int* ids, int n) {
+		int curId = bvh.size();
+		bvh.emplace_back();
+		Bound bound, centerBound;
+		for (int i = 0; i < n; ++i) {
+			const Bound& b = instances[ids[i]].bound;
+			bound.Union(b);
+			centerBound.Union((b.pMin + b.pMax) * .5f);
+		}
+		if (n == 1) {
+			bvh[curId] = { bound, -1, -1, ids[0], ids[0] + 1 };
+			return curId;
+		}
+		int bestAxis = 0, bestSplit = n / 2;
+		float minCost = FLOAT_MAX;
+		std::vector<float> rightArea(n);
+		for (int axis = 0; axis < 3; ++axis) {
+			if (centerBound.pMax[axis] <= centerBound.pMin[axis]) continue;
+			SortInstances(ids, n, axis);
+			Bound right;
+			for (int i = n - 1; i > 0; --i) {
+				right.Union(instances[ids[i]].bound);
+				rightArea[i] = right.SurfaceArea();
+			}
+			Bound left;
+			for (int i = 1; i < n; ++i) {
+				left.Union(instances[ids[i - 1]].bound);
+				float cost = left.SurfaceArea() * i + rightArea[i] * (n - i);
+				if (cost < minCost) {
+					minCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+		SortInstances(ids, n, bestAxis);
+		BuildNode(ids, bestSplit);
+		int rightChild = BuildNode(ids + bestSplit, n - bestSplit);
+		bvh[curId] = { bound, bestAxis, rightChild, 0, 0 };
+		return curId;
+	}
+
+	// 中心相同时按编号排序，保证构建结果确定
+	void SortInstances(int* ids, int n, int axis) const {
+		std::sort(ids, ids + n, [&](int a, int b) {
+			float ca = instances[a].bound.pMin[axis] + instances[a].bound.pMax[axis];
+			float cb = instances[b].bound.pMin[axis] + instances[b].bound.pMax[axis];
+			return ca < cb || (ca == cb && a < b);
+		});
+	}
+};
+
+// 相同路径的模型共享一个BLAS，每个模型作为一个实例，实例顺序与models相同
+inline std::shared_ptr<TLAS> InstanceOutput(const std::vector<Model>& models, const BVHSetting& setting = BVHSetting()) {
+	std::map<std::string, int> pathToBLAS;
+	std::vector<std::shared_ptr<BVH>> blases;
+	std::vector<Instance> instances;
+	for (const auto& model : models) {
+		auto it = pathToBLAS.find(model.path);
+		int blasId;
+		if (it == pathToBLAS.end()) {
+			std::vector<Vertex> meshVertices;
+			std::vector<Triangle> meshTriangles;
+			ModelOutput(model, glm::mat4(1), meshVertices, meshTriangles);
+			blasId = pathToBLAS[model.path] = blases.size();
+			blases.push_back(std::make_shared<BVH>(std::move(meshVertices), std::move(meshTriangles), setting));
+		} else {
+			blasId = it->second;
+		}
+		Instance instance;
+		instance.blasId = blasId;
+		instance.materialId = model.materialId;
+		instance.objectToWorld = model.modelMatrix;
+		instance.worldToObject = glm::inverse(model.modelMatrix);
+		instances.push_back(instance);
+	}
+	return std::make_shared<TLAS>(std::move(blases), std::move(instances), setting);
+}
+
+/*
+	Merge的逆过程：从合并后的数组中取出各个BLAS并重新构建顶层（如从场景缓存中读取），BLAS不重新构建
+	blasOffsets为每个BLAS的节点、三角形、顶点偏移，instanceBLAS为每个实例引用的BLAS，实例顺序与models相同
+*/
+inline std::shared_ptr<TLAS> InstanceRestore(const std::vector<Model>& models, const std::vector<int>& blasOffsets,
+	const std::vector<int>& instanceBLAS, const std::vector<Vertex>& vertices, const std::vector<Triangle>& triangles,
+	const std::vector<BVHNode>& nodes, const BVHSetting& setting = BVHSetting()) {
+	int nBLAS = blasOffsets.size() / 3;
+	std::vector<std::shared_ptr<BVH>> blases;
+	for (int b = 0; b < nBLAS; ++b) {
+		int nodeOffset = blasOffsets[3 * b], triangleOffset = blasOffsets[3 * b + 1], vertexOffset = blasOffsets[3 * b + 2];
+		int nodeEnd = b + 1 < nBLAS ? blasOffsets[3 * (b + 1)] : (int)nodes.size();
+		int triangleEnd = b + 1 < nBLAS ? blasOffsets[3 * (b + 1) + 1] : (int)triangles.size();
+		int vertexEnd = b + 1 < nBLAS ? blasOffsets[3 * (b + 1) + 2] : (int)vertices.size();
+		std::vector<Vertex> blasVertices(vertices.begin() + vertexOffset, vertices.begin() + vertexEnd);
+		std::vector<Triangle> blasTriangles(triangles.begin() + triangleOffset, triangles.begin() + triangleEnd);
+		for (Triangle& tri : blasTriangles)
+			for (int k = 0; k < 3; ++k) tri.indices[k] -= vertexOffset;
+		std::vector<BVHNode> blasNodes(nodes.begin() + nodeOffset, nodes.begin() + nodeEnd);
+		for (BVHNode& node : blasNodes) {
+			if (node.rightChild != -1) node.rightChild -= nodeOffset;
+			node.startIndex -= triangleOffset;
+			node.endIndex -= triangleOffset;
+		}
+		blases.push_back(std::make_shared<BVH>(blasVertices, blasTriangles, blasNodes, setting));
+	}
+	std::vector<Instance> instances;
+	for (int i = 0; i < models.size(); ++i) {
+		Instance instance;
+		instance.blasId = instanceBLAS[i];
+		instance.materialId = models[i].materialId;
+		instance.objectToWorld = models[i].modelMatrix;
+		instance.worldToObject = glm::inverse(models[i].modelMatrix);
+		instances.push_back(instance);
+	}
+	return std::make_shared<TLAS>(std::move(blases), std::move(instances), setting);
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "PnRT.hpp"
+#include "triangle.hpp"
+
+/*
+	BVH遍历的查询策略：BVH::Traverse只负责遍历节点，叶子中的三角形块交给查询处理
+	查询需要提供：
+		SORT_CHILDREN：是否按距离由近到远访问儿子，只需要最近的若干交点时排序才有意义
+		bool Block(block, count, firstTriangle, blockRay, float* tMax)：与叶子中的一个三角形块求交，
+			可以缩短*tMax以剔除更远的节点，返回false时立即结束遍历
+		int instance：两层加速结构中当前遍历的实例，由TLAS在进入每个BLAS前设置，写入交点的instance
+	查询作为模板参数传入，Block在遍历中内联展开，各种查询与手写的遍历相比没有额外开销
+*/
+
+// 最近交点
+struct ClosestHitQuery {
+	static constexpr bool SORT_CHILDREN = true;
+	bool Block(const TriangleBlock& block, int count, int firstTriangle, const TriangleBlockRay& ray, float* tMax) {
+		if (TriangleBlockIntersect(block, count, firstTriangle, ray, tMax, &hit)) hit.instance = instance;
+		return true;
+	}
+	TriangleHit hit;
+	int instance = -1;
+};
+
+// 任意一个交点，用于阴影射线的遮挡测试，找到后立即结束遍历
+struct AnyHitQuery {
+	static constexpr bool SORT_CHILDREN = false;
+	bool Block(const TriangleBlock& block, int count, int firstTriangle, const TriangleBlockRay& ray, float* tMax) {
+		return TriangleBlockHits(block, count, firstTriangle, ray, tMax, [this](const TriangleHit& h) {
+			hit = h;
+			hit.instance = instance;
+			return false;
+		});
+	}
+	TriangleHit hit;
+	int instance = -1;
+};
+
+/*
+	所有交点：对光线范围内的每个交点调用onHit(const TriangleHit&)，不按距离排序
+	onHit返回false时结束遍历，用于半透明、镂空材质等需要逐个处理交点的情况，不需要反复发射光线
+*/
+template <typename F>
+struct AllHitsQuery {
+	static constexpr bool SORT_CHILDREN = false;
+	explicit AllHitsQuery(const F& onHit) : onHit(onHit) {}
+	bool Block(const TriangleBlock& block, int count, int firstTriangle, const TriangleBlockRay& ray, float* tMax) {
+		return TriangleBlockHits(block, count, firstTriangle, ray, tMax, [this](TriangleHit h) {
+			h.instance = instance;
+			return onHit(h);
+		});
+	}
+	const F& onHit;
+	int instance = -1;
+};
+
+/*
+	最近的K个交点：hits按距离从近到远排列，找到K个交点后把*tMax缩短为第K个交点的距离，剔除更远的节点
+	空间划分的BVH中同一个三角形可能位于多个叶子，triangles不为空时按primitiveId去掉同一实例中重复的交点
+	两层加速结构中triangles为当前实例的BLAS的三角形，由TLAS在进入每个BLAS前设置
+*/
+template <int K>
+struct NearestHitsQuery {
+	static constexpr bool SORT_CHILDREN = true;
+	explicit NearestHitsQuery(const Triangle* triangles = nullptr) : triangles(triangles) {}
+	bool Block(const TriangleBlock& block, int count, int firstTriangle, const TriangleBlockRay& ray, float* tMax) {
+		return TriangleBlockHits(block, count, firstTriangle, ray, tMax, [this, tMax](const TriangleHit& h) {
+			if (triangles) {
+				for (int i = 0; i < nHits; ++i)
+					if (hits[i].instance == instance &&
+						triangles[hits[i].triangle].primitiveId == triangles[h.triangle].primitiveId) return true;
+			}
+			// 插入排序，已满时丢弃最远的交点
+			int j = nHits < K ? nHits++ : K - 1;
+			while (j > 0 && hits[j - 1].t > h.t) {
+				hits[j] = hits[j - 1];
+				--j;
+			}
+			hits[j] = h;
+			hits[j].instance = instance;
+			if (nHits == K) *tMax = hits[K - 1].t;
+			return true;
+		});
+	}
+	const Triangle* triangles;
+	TriangleHit hits[K];
+	int nHits = 0;
+	int instance = -1;
+};
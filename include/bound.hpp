@@ -6,7 +6,7 @@ struct Bound {
 		pMin = glm::vec3(FLOAT_MAX, FLOAT_MAX, FLOAT_MAX);
 		pMax = glm::vec3(FLOAT_MIN, FLOAT_MIN, FLOAT_MIN);
 	}
-	// Χ
+	// 包围盒求并
 	void Union(const Bound& b) {
 		pMin = glm::min(pMin, b.pMin);
 		pMax = glm::max(pMax, b.pMax);
@@ -15,33 +15,100 @@ struct Bound {
 		pMin = glm::min(pMin, p);
 		pMax = glm::max(pMax, p);
 	}
-	// ΧжԽ
-	glm::vec3 Diagonal() {
+	// 包围盒求交
+	void Intersect(const Bound& b) {
+		pMin = glm::max(pMin, b.pMin);
+		pMax = glm::min(pMax, b.pMax);
+	}
+	// 包围盒为空（未加入任何点或求交结果为空）
+	bool Empty() const {
+		return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z;
+	}
+	// 包围盒对角线
+	glm::vec3 Diagonal() const {
 		return pMax - pMin;
 	}
-	// Χб
-	float SurfaceArea() {
+	// 包围盒表面积
+	float SurfaceArea() const {
 		glm::vec3 d = Diagonal();
 		return (d.x * d.y + d.x * d.z + d.y * d.z) * 2.f;
 	}
 	glm::vec3 pMin, pMax;
 };
 
+// 使用SSE寄存器存储的包围盒，第四个分量不使用，用于构建时大量的包围盒合并
+struct SIMDBound {
+	SIMDBound() {
+		pMin = _mm_set1_ps(FLOAT_MAX);
+		pMax = _mm_set1_ps(FLOAT_MIN);
+	}
+	explicit SIMDBound(const Bound& b) {
+		pMin = _mm_setr_ps(b.pMin.x, b.pMin.y, b.pMin.z, 0.f);
+		pMax = _mm_setr_ps(b.pMax.x, b.pMax.y, b.pMax.z, 0.f);
+	}
+	void Union(const SIMDBound& b) {
+		pMin = _mm_min_ps(pMin, b.pMin);
+		pMax = _mm_max_ps(pMax, b.pMax);
+	}
+	float SurfaceArea() const {
+		alignas(16) float d[4];
+		_mm_store_ps(d, _mm_sub_ps(pMax, pMin));
+		return (d[0] * d[1] + d[0] * d[2] + d[1] * d[2]) * 2.f;
+	}
+	Bound ToBound() const {
+		alignas(16) float lo[4], hi[4];
+		_mm_store_ps(lo, pMin);
+		_mm_store_ps(hi, pMax);
+		Bound b;
+		b.pMin = glm::vec3(lo[0], lo[1], lo[2]);
+		b.pMax = glm::vec3(hi[0], hi[1], hi[2]);
+		return b;
+	}
+	__m128 pMin, pMax;
+};
+
 
-inline bool BoundIntersect(const Bound& bound, const Ray& ray, float* hit0 = nullptr, float* hit1 = nullptr) {
-	float t0 = 0.f, t1 = ray.tMax;
+// 1 + 2 * gamma(3)，gamma(n) = n * eps / (1 - n * eps)，eps为单精度的相对舍入误差
+constexpr float FLOAT_ROUNDING = std::numeric_limits<float>::epsilon() * 0.5f;
+constexpr float BOUND_FAR_SCALE = 1.f + 2.f * (3.f * FLOAT_ROUNDING / (1.f - 3.f * FLOAT_ROUNDING));
+
+/*
+	遍历用的光线：方向倒数与各轴方向符号在遍历开始时计算一次，包围盒求交时不再做除法
+	按方向符号（包括-0）直接选出近、远平面，不需要比较交换
+	方向分量为0时倒数为inf，起点恰好在平面上时0 * inf = NaN，比较时NaN总是不取，该轴不参与裁剪
+	离开时刻使用放大BOUND_FAR_SCALE倍的方向倒数（Ize的保守求交），减法、求倒数与乘法的舍入误差不会使光线漏过包围盒
+*/
+struct TraversalRay {
+	explicit TraversalRay(const Ray& ray) : origin(ray.origin) {
+		for (int axis = 0; axis < 3; ++axis) {
+			dirNegative[axis] = std::signbit(ray.dir[axis]);
+			invDir[axis] = 1.f / ray.dir[axis];
+			invDirFar[axis] = invDir[axis] * BOUND_FAR_SCALE;
+		}
+	}
+	glm::vec3 origin, invDir, invDirFar;
+	int dirNegative[3];
+};
+
+inline bool BoundIntersect(const Bound& bound, const TraversalRay& ray, float tMax, float* hit0 = nullptr, float* hit1 = nullptr) {
+	float t0 = 0.f, t1 = tMax;
 	for (int i = 0; i < 3; ++i) {
-		float invDir = 1.f / ray.dir[i];
-		float tNear = (bound.pMin[i] - ray.origin[i]) * invDir;
-		float tFar = (bound.pMax[i] - ray.origin[i]) * invDir;
-		if (tNear > tFar) std::swap(tNear, tFar);
-		// ΧеʱΪ߽Χеʱ
-		t0 = std::max(t0, tNear);
-		// 뿪ΧеʱΪ뿪Χеʱ
-		t1 = std::min(t1, tFar);
+		float nearPlane = ray.dirNegative[i] ? bound.pMax[i] : bound.pMin[i];
+		float farPlane = ray.dirNegative[i] ? bound.pMin[i] : bound.pMax[i];
+		float tNear = (nearPlane - ray.origin[i]) * ray.invDir[i];
+		float tFar = (farPlane - ray.origin[i]) * ray.invDirFar[i];
+		// 各个分量最晚进入包围盒的时刻为光线进入包围盒的时刻
+		t0 = tNear > t0 ? tNear : t0;
+		// 各个分量最早离开包围盒的时刻为光线离开包围盒的时刻
+		t1 = tFar < t1 ? tFar : t1;
 		if (t0 > t1) return false;
 	}
 	if (hit0) *hit0 = t0;
 	if (hit1) *hit1 = t1;
 	return true;
-}
\ No newline at end of file
+}
+
+// 单次求交，需要反复求交的遍历应预先构造TraversalRay
+inline bool BoundIntersect(const Bound& bound, const Ray& ray, float* hit0 = nullptr, float* hit1 = nullptr) {
+	return BoundIntersect(bound, TraversalRay(ray), ray.tMax, hit0, hit1);
+}
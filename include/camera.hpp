@@ -16,7 +16,7 @@ struct Camera {
 		this->fov = fov;
 		this->aspect = aspect;
 		float theta = glm::radians(fov);
-		// 趨Ļz-1ƽxyƽ
+		// 设定屏幕在z轴的-1处，平行于xy平面
 		float halfHeight = glm::tan(theta * 0.5);
 		float halfWidth = aspect * halfHeight;
 
@@ -62,7 +62,7 @@ struct Camera {
 	}
 
 
-	// 
+	// 均处于世界坐标
 	glm::vec3 eye;
 	glm::vec3 center;
 	glm::vec3 up;
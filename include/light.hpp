@@ -2,11 +2,12 @@
 #include "PnRT.hpp"
 
 struct Light {
-	int index; // е
-	float prefixArea; // ǰiε
+	int index; // 在三角形数组中的索引
+	float prefixArea; // 前i个三角形的面积和
+	int instanceId = -1; // 使用两层加速结构时三角形所属的实例，三角形在该实例的模型空间中
 };
 
-// u[0, 1], u͵Ƶıһάֲѡƹ
+// 输入随机数u[0, 1], 根据u和灯的表面积的一维分布选出灯光，返回灯光在lights中的索引
 inline int GetLightIndex(float u) {
 	if (lights.empty()) return -1;
 	int L = 0, R = lights.size() - 1, ans = -1;
@@ -20,5 +21,5 @@ inline int GetLightIndex(float u) {
 			L = mid + 1;
 		}
 	}
-	return lights[ans].index;
+	return ans;
 }
\ No newline at end of file
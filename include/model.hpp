@@ -2,43 +2,164 @@
 #include "PnRT.hpp"
 #include "light.hpp"
 #include "triangle.hpp"
+#include "parallel.hpp"
 
 /*	
-	MaterialModelΪλTextureMeshΪλ
-	TextureId == -1ڣMaterialbaseColorȡɫ
-	MaterialIdTextureIdTriangle
+	Material以Model为单位，Texture以Mesh为单位
+	若TextureId == -1（不存在），则从Material的baseColor获取物体颜色
+	MaterialId和TextureId由Triangle管理
 */
 
 struct Mesh {
-	Mesh(const std::vector<Vertex>& vertices, const std::vector<int>& indices, int textureId)
-		:vertices(vertices), indices(indices), textureId(textureId) { }
+	Mesh(const std::vector<Vertex>& vertices, const std::vector<int>& indices, const std::string& texturePath)
+		:vertices(vertices), indices(indices), texturePath(texturePath) { }
 	std::vector<Vertex> vertices;
 	std::vector<int> indices;
-	int textureId;
+	std::string texturePath; // 为空时没有纹理
+	int textureId = -1;
+};
+
+struct DecodedTexture {
+	unsigned char* data = nullptr;
+	TextureInfo info = {};
+};
+
+// 解码纹理文件，不访问全局的纹理数组，可以在多个线程中同时调用
+inline DecodedTexture DecodeTexture(const std::string& filePath) {
+	DecodedTexture texture;
+	texture.data = stbi_load(filePath.c_str(), &texture.info.width, &texture.info.height, &texture.info.nChannels, 0);
+	return texture;
+}
+
+// 把解码后的纹理加入全局的纹理数组，返回纹理编号，解码失败返回-1
+inline int AddTexture(const std::string& filePath, const DecodedTexture& texture) {
+	if (!texture.data) {
+		std::cout << "Cannot load texture from: " << filePath << std::endl;
+		return -1;
+	}
+	int textureId = texturePathToId[filePath] = textures.size();
+	textureInfos.push_back(texture.info);
+	textures.push_back(texture.data);
+	texturePaths.push_back(filePath);
+	return textureId;
+}
+
+// 读取纹理，相同路径只读取一次，返回纹理编号，读取失败返回-1
+inline int LoadTexture(const std::string& filePath) {
+	if (texturePathToId.count(filePath)) { // 之前读取过相同纹理
+		return texturePathToId[filePath];
+	}
+	return AddTexture(filePath, DecodeTexture(filePath));
+}
+
+/*
+	读取一组纹理：之前没有读取过的路径在线程池中并行解码，再按paths中的顺序加入纹理数组
+	纹理编号与依次调用LoadTexture相同，不受解码完成的先后影响
+	读取失败的纹理不占用编号，其后的纹理编号前移，全部读取成功时返回true
+*/
+inline bool LoadTextures(const std::vector<std::string>& paths) {
+	std::vector<std::string> pending;
+	std::set<std::string> seen;
+	for (const auto& path : paths) {
+		if (texturePathToId.count(path) || !seen.insert(path).second) continue;
+		pending.push_back(path);
+	}
+	std::vector<DecodedTexture> decoded(pending.size());
+	ParallelFor(0, pending.size(), 1, [&](int i) {
+		decoded[i] = DecodeTexture(pending[i]);
+	});
+	bool loaded = true;
+	for (int i = 0; i < pending.size(); ++i)
+		if (AddTexture(pending[i], decoded[i]) == -1) loaded = false;
+	return loaded;
+}
+
+// 释放并清空所有纹理，之后读取的纹理编号从0开始
+inline void ClearTextures() {
+	for (unsigned char* data : textures) stbi_image_free(data);
+	textures.clear();
+	textureInfos.clear();
+	texturePaths.clear();
+	texturePathToId.clear();
+}
+
+// 记录Assimp导入时打开的文件，如OBJ的材质库，用于计算场景缓存的键
+class RecordingIOSystem : public Assimp::DefaultIOSystem {
+public:
+	explicit RecordingIOSystem(std::vector<std::string>* files) : files(files) {}
+	Assimp::IOStream* Open(const char* file, const char* mode = "rb") override {
+		Assimp::IOStream* stream = Assimp::DefaultIOSystem::Open(file, mode);
+		if (stream) files->push_back(file);
+		return stream;
+	}
+private:
+	std::vector<std::string>* files;
 };
 
 class Model {
 public:
+	// 构造时只记录模型的描述，网格在Load时才读取，场景缓存命中时不需要读取模型文件
 	Model(const std::string& path, const glm::mat4& modelMatrix, const Material& material, const std::string& name)
-		: modelMatrix(modelMatrix), materialId(materialId), name(name) {
+		: modelMatrix(modelMatrix), materialId(materials.size()), name(name), path(path), material(material) {
+		materials.push_back(material);
+	}
+
+	bool Load() {
+		if (loaded) return true;
+		if (!Import()) return false;
+		for (const auto& mesh : meshes)
+			if (!mesh.texturePath.empty()) LoadTexture(mesh.texturePath);
+		ResolveTextures();
+		return true;
+	}
+
+	/*
+		读取模型文件中的网格，只记录纹理路径，不访问全局的纹理数组
+		每个模型使用各自的Assimp::Importer，不同的模型可以在多个线程中同时导入
+	*/
+	bool Import() {
 		Assimp::Importer importer;
+		// 由importer负责释放
+		openedFiles.clear();
+		importer.SetIOHandler(new RecordingIOSystem(&openedFiles));
 		const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
 		if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
 			std::cout << "ERROR::ASSIMP::" << importer.GetErrorString() << std::endl;
-			return;
-		}		
+			return false;
+		}
 
-		directory = path.substr(0, path.find_last_of('/'));		
-		materialId = materials.size();
-		materials.push_back(material);
+		directory = path.substr(0, path.find_last_of('/'));
+		meshes.clear();
 		processNode(scene->mRootNode, scene);
+		return true;
 	}
+
+	// 纹理读取后按路径设置每个网格的纹理编号，读取失败的纹理为-1
+	void ResolveTextures() {
+		for (auto& mesh : meshes) {
+			auto it = texturePathToId.find(mesh.texturePath);
+			mesh.textureId = it == texturePathToId.end() ? -1 : it->second;
+		}
+		loaded = true;
+	}
+
+	bool Loaded() const {
+		return loaded;
+	}
+
 	std::vector<Mesh> meshes;
 	glm::mat4 modelMatrix;
 	int materialId;
 	std::string name;
+	std::string path; // 模型文件路径，路径相同的模型共享同一个BLAS
+	// 模型的顶点在ModelOutput输出的顶点数组中的区间，移动模型时只更新这一段顶点
+	int vertexOffset = 0;
+	int vertexCount = 0;
+	Material material; // 构造时的材质，用于计算场景缓存的键
+	std::vector<std::string> openedFiles; // Import时读取的文件，包括模型文件本身与材质库
 private:
-	std::string directory; // ģ·ڶȡλ
+	bool loaded = false;
+	std::string directory; // 模型所在路径，用于读取纹理所在位置
 	void processNode(const aiNode* node, const aiScene* scene) {
 		for (unsigned int i = 0; i < node->mNumMeshes; ++i) {
 			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
@@ -51,29 +172,14 @@ private:
 	Mesh processMesh(const aiMesh* mesh, const aiScene* scene) {
 		std::vector<Vertex> vertices;
 		std::vector<int> indices;
-		int textureId = -1;
+		std::string texturePath;
 		if (mesh->mMaterialIndex >= 0) {
 			aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
 			if (material->GetTextureCount(aiTextureType_DIFFUSE)) {
 				aiString path;
-				// ȡһDIFFUSEΪbaseColor pathģλõ·
+				// 读取第一个DIFFUSE材质作为baseColor， path必须是相对模型位置的相对路径
 				material->GetTexture(aiTextureType_DIFFUSE, 0, &path);
-				std::string filePath = directory + "/" + std::string(path.C_Str());
-				if (texturePathToId.count(filePath)) { // ֮ǰȡͬ
-					textureId = texturePathToId[filePath];
-				} else {
-					int width, height, nChannels;
-					unsigned char* data = stbi_load(filePath.c_str(), 
-						&width, &height, &nChannels, 0);
-					if (!data) {
-						std::cout << "Cannot load texture from: " << filePath << std::endl;
-						stbi_image_free(data);
-					} else {
-						textureId = texturePathToId[filePath] = textures.size();
-						textureInfos.push_back({ width, height, nChannels });
-						textures.push_back(data);
-					}
-				}
+				texturePath = directory + "/" + std::string(path.C_Str());
 			} 
 		}
 
@@ -94,42 +200,115 @@ private:
 				indices.push_back(face.mIndices[j]);
 			}
 		}
-		return Mesh(std::move(vertices), std::move(indices), textureId);
+		return Mesh(std::move(vertices), std::move(indices), texturePath);
 	}
 };
 
-inline void ModelOutput(const std::vector<Model>& models) {
-	int countVertices = 0;
-	for (const auto& model : models) {
-		glm::mat4 normalMatrix = glm::transpose(glm::inverse(model.modelMatrix));
-		for (const auto& mesh : model.meshes) {
-			for (const auto& vertex : mesh.vertices) {
-				Vertex nVertex;
-				nVertex.position = glm::vec3(model.modelMatrix * glm::vec4(vertex.position, 1.0));
-				nVertex.normal = glm::vec3(normalMatrix * glm::vec4(vertex.normal, 1.0));
-				nVertex.tangent = glm::vec3(model.modelMatrix * glm::vec4(vertex.tangent, 1.0));
-				nVertex.bitangent = glm::vec3(model.modelMatrix * glm::vec4(vertex.bitangent, 1.0));
-				nVertex.texcoord = vertex.texcoord;
-				vertices.push_back(nVertex);
-			}
-			for (int i = 0; i < mesh.indices.size(); i += 3) {
-				Triangle triangle;
-				triangle.indices[0] = mesh.indices[i] + countVertices;
-				triangle.indices[1] = mesh.indices[i + 1] + countVertices;
-				triangle.indices[2] = mesh.indices[i + 2] + countVertices;
-				triangle.materialId = model.materialId;
-				triangle.textureId = mesh.textureId;
-				const glm::vec3& p0 = vertices[triangle.indices[0]].position;
-				const glm::vec3& p1 = vertices[triangle.indices[1]].position;
-				const glm::vec3& p2 = vertices[triangle.indices[2]].position;
-				triangle.area = glm::length(glm::cross(p1 - p0, p2 - p0)) * 0.5;
-				triangle.bound.Union(vertices[triangle.indices[0]].position);
-				triangle.bound.Union(vertices[triangle.indices[1]].position);
-				triangle.bound.Union(vertices[triangle.indices[2]].position);
-				triangle.boundCenter = (triangle.bound.pMax + triangle.bound.pMin) * .5f;
-				triangles.push_back(triangle);
+inline Vertex TransformVertex(const Vertex& vertex, const glm::mat4& modelMatrix, const glm::mat4& normalMatrix) {
+	Vertex nVertex;
+	nVertex.position = glm::vec3(modelMatrix * glm::vec4(vertex.position, 1.0));
+	nVertex.normal = glm::vec3(normalMatrix * glm::vec4(vertex.normal, 1.0));
+	nVertex.tangent = glm::vec3(modelMatrix * glm::vec4(vertex.tangent, 1.0));
+	nVertex.bitangent = glm::vec3(modelMatrix * glm::vec4(vertex.bitangent, 1.0));
+	nVertex.texcoord = vertex.texcoord;
+	return nVertex;
+}
+
+// 把模型经过modelMatrix变换后的顶点与三角形追加到vertices与triangles中
+inline void ModelOutput(const Model& model, const glm::mat4& modelMatrix,
+	std::vector<Vertex>& vertices, std::vector<Triangle>& triangles) {
+	glm::mat4 normalMatrix = glm::transpose(glm::inverse(modelMatrix));
+	int countVertices = vertices.size();
+	for (const auto& mesh : model.meshes) {
+		for (const auto& vertex : mesh.vertices) {
+			vertices.push_back(TransformVertex(vertex, modelMatrix, normalMatrix));
+		}
+		for (int i = 0; i < mesh.indices.size(); i += 3) {
+			Triangle triangle;
+			triangle.indices[0] = mesh.indices[i] + countVertices;
+			triangle.indices[1] = mesh.indices[i + 1] + countVertices;
+			triangle.indices[2] = mesh.indices[i + 2] + countVertices;
+			triangle.materialId = model.materialId;
+			triangle.textureId = mesh.textureId;
+			const glm::vec3& p0 = vertices[triangle.indices[0]].position;
+			const glm::vec3& p1 = vertices[triangle.indices[1]].position;
+			const glm::vec3& p2 = vertices[triangle.indices[2]].position;
+			triangle.area = glm::length(glm::cross(p1 - p0, p2 - p0)) * 0.5;
+			triangle.bound.Union(vertices[triangle.indices[0]].position);
+			triangle.bound.Union(vertices[triangle.indices[1]].position);
+			triangle.bound.Union(vertices[triangle.indices[2]].position);
+			triangle.boundCenter = (triangle.bound.pMax + triangle.bound.pMin) * .5f;
+			triangles.push_back(triangle);
+		}
+		countVertices += mesh.vertices.size();
+	}
+}
+
+/*
+	读取所有模型的网格与纹理
+	路径相同的模型只导入一次，不同路径的模型在线程池中并行导入，纹理收集后并行解码
+	材质编号在构造Model时已按顺序确定，纹理按模型与网格的顺序加入，编号与依次调用Load相同
+*/
+inline void LoadModels(std::vector<Model>& models) {
+	int n = models.size();
+	std::vector<int> source(n);
+	std::map<std::string, int> firstModel;
+	std::vector<int> imports;
+	for (int i = 0; i < n; ++i) {
+		if (models[i].Loaded()) continue;
+		source[i] = firstModel.emplace(models[i].path, i).first->second;
+		if (source[i] == i) imports.push_back(i);
+	}
+	std::vector<char> imported(n);
+	ParallelFor(0, imports.size(), 1, [&](int k) {
+		imported[imports[k]] = models[imports[k]].Import();
+	});
+	std::vector<std::string> texturePaths;
+	for (int i = 0; i < n; ++i) {
+		if (models[i].Loaded() || !imported[source[i]]) continue;
+		if (source[i] != i) {
+			models[i].meshes = models[source[i]].meshes;
+			models[i].openedFiles = models[source[i]].openedFiles;
+		}
+		for (const auto& mesh : models[i].meshes)
+			if (!mesh.texturePath.empty()) texturePaths.push_back(mesh.texturePath);
+	}
+	LoadTextures(texturePaths);
+	for (int i = 0; i < n; ++i)
+		if (!models[i].Loaded() && imported[source[i]]) models[i].ResolveTextures();
+}
+
+inline void ModelOutput(std::vector<Model>& models) {
+	for (auto& model : models) {
+		model.vertexOffset = vertices.size();
+		ModelOutput(model, model.modelMatrix, vertices, triangles);
+		model.vertexCount = vertices.size() - model.vertexOffset;
+	}
+}
+
+// 在BVH重排后的三角形中寻找能自发光的三角形索引，加入到lights，空间划分复制出的三角形只加入一次
+inline void TriangleLightsOutput(const std::vector<Triangle>& triangles) {
+	std::vector<bool> isLight(triangles.size());
+	for (int i = 0; i < triangles.size(); ++i) {
+		const Triangle& tri = triangles[i];
+		if (isLight[tri.primitiveId]) continue;
+		if (materials[tri.materialId].emssive != glm::vec3(0)) {
+			isLight[tri.primitiveId] = true;
+			lights.push_back({ i, tri.area });
+			if (lights.size() > 1) {
+				lights[lights.size() - 1].prefixArea += lights[lights.size() - 2].prefixArea;
 			}
-			countVertices += mesh.vertices.size();
+		}
+	}
+}
+
+// modelMatrix改变后重新计算模型在vertices中的顶点，三角形的顶点索引不变
+inline void ModelTransform(const Model& model, std::vector<Vertex>& vertices) {
+	glm::mat4 normalMatrix = glm::transpose(glm::inverse(model.modelMatrix));
+	int index = model.vertexOffset;
+	for (const auto& mesh : model.meshes) {
+		for (const auto& vertex : mesh.vertices) {
+			vertices[index++] = TransformVertex(vertex, model.modelMatrix, normalMatrix);
 		}
 	}
 }
\ No newline at end of file
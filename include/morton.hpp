@@ -0,0 +1,73 @@
+#pragma once
+#include "PnRT.hpp"
+#include "parallel.hpp"
+
+/*
+	Morton码：把归一化的坐标在每个轴上量化后交错各个轴的二进制位，排序后空间上相近的点也相邻
+	用于LBVH构建时排序三角形，以及光线流排序光线的起点
+*/
+
+// 在每一位之间插入两个0：10位输入用于30位Morton码，21位输入用于63位Morton码
+inline uint64_t ExpandBits(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffff;
+	v = (v | v << 16) & 0x1f0000ff0000ff;
+	v = (v | v << 8) & 0x100f00f00f00f00f;
+	v = (v | v << 4) & 0x10c30c30c30c30c3;
+	v = (v | v << 2) & 0x1249249249249249;
+	return v;
+}
+
+// p为归一化到[0, 1]的坐标
+inline uint64_t MortonCode(const glm::vec3& p, int bitsPerAxis) {
+	const float maxValue = (float)((1 << bitsPerAxis) - 1);
+	uint64_t x = (uint64_t)std::min(std::max(p.x * maxValue, 0.f), maxValue);
+	uint64_t y = (uint64_t)std::min(std::max(p.y * maxValue, 0.f), maxValue);
+	uint64_t z = (uint64_t)std::min(std::max(p.z * maxValue, 0.f), maxValue);
+	return ExpandBits(x) << 2 | ExpandBits(y) << 1 | ExpandBits(z);
+}
+
+struct MortonPrimitive {
+	uint64_t code;
+	int index;
+};
+
+// 并行基数排序：每趟处理8位，各块分别统计后求出每个块每个桶的写入位置，保证排序稳定
+inline void RadixSort(std::vector<MortonPrimitive>* prims, int bits) {
+	constexpr int RADIX_BITS = 8, RADIX = 1 << RADIX_BITS;
+	constexpr int BLOCK_SIZE = 16384;
+	const int n = prims->size();
+	const int nBlocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	std::vector<MortonPrimitive> temp(n);
+	std::vector<std::array<int, RADIX>> offsets(nBlocks);
+	std::vector<MortonPrimitive>* in = prims, *out = &temp;
+	for (int shift = 0; shift < bits; shift += RADIX_BITS) {
+		ParallelFor(0, nBlocks, 1, [&](int b) {
+			std::array<int, RADIX>& count = offsets[b];
+			count.fill(0);
+			for (int i = b * BLOCK_SIZE; i < std::min(n, (b + 1) * BLOCK_SIZE); ++i)
+				count[((*in)[i].code >> shift) & (RADIX - 1)]++;
+		});
+		// 按桶优先、块其次的顺序求前缀和；所有元素都在同一个桶中时跳过这一趟
+		int sum = 0;
+		bool skip = false;
+		for (int d = 0; d < RADIX && !skip; ++d) {
+			int bucketSum = 0;
+			for (int b = 0; b < nBlocks; ++b) {
+				int c = offsets[b][d];
+				offsets[b][d] = sum;
+				sum += c;
+				bucketSum += c;
+			}
+			skip = bucketSum == n;
+		}
+		if (skip) continue;
+		ParallelFor(0, nBlocks, 1, [&](int b) {
+			std::array<int, RADIX>& offset = offsets[b];
+			for (int i = b * BLOCK_SIZE; i < std::min(n, (b + 1) * BLOCK_SIZE); ++i)
+				(*out)[offset[((*in)[i].code >> shift) & (RADIX - 1)]++] = (*in)[i];
+		});
+		std::swap(in, out);
+	}
+	if (in != prims) prims->swap(temp);
+}
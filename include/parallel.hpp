@@ -0,0 +1,221 @@
+#pragma once
+#include "PnRT.hpp"
+
+/*
+	工作窃取线程池
+	每个工作线程拥有一个固定容量的环形双端队列：
+	本线程从队列尾部取任务（后进先出，保持局部性），空闲时从其他线程队列头部窃取（先进先出，窃取较大的任务）
+	等待任务完成的线程不会阻塞，而是帮助执行队列中的任务，因此可以在任务中继续派生并等待子任务
+*/
+class ThreadPool {
+public:
+	using Task = std::function<void()>;
+
+	explicit ThreadPool(int nThreads = 0) {
+		if (nThreads <= 0) nThreads = std::max(1, (int)std::thread::hardware_concurrency());
+		for (int i = 0; i < nThreads; ++i)
+			queues.emplace_back(new WorkQueue());
+		// 调用者线程也会参与执行任务，因此只需额外创建 nThreads - 1 个工作线程
+		for (int i = 1; i < nThreads; ++i)
+			workers.emplace_back([this, i]() { WorkerLoop(i); });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stop = true;
+		}
+		sleepCondition.notify_all();
+		for (auto& w : workers) w.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int NumThreads() const {
+		return (int)queues.size();
+	}
+
+	// 提交任务：工作线程提交到自己的队列，其他线程轮流提交到各个队列，队列已满时直接执行
+	void Submit(Task task) {
+		int index = CurrentIndex();
+		if (index < 0) index = (int)(submitCount++ % queues.size());
+		if (!queues[index]->PushBack(task)) {
+			task();
+			return;
+		}
+		++pendingTasks;
+		{
+			// 加锁后再唤醒，避免工作线程在检查条件与进入等待之间错过通知
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		sleepCondition.notify_one();
+	}
+
+	// 执行一个队列中的任务，没有可执行任务时返回false
+	bool RunPendingTask() {
+		int index = CurrentIndex();
+		Task task;
+		if (index >= 0 && queues[index]->PopBack(task)) {
+			--pendingTasks;
+			task();
+			return true;
+		}
+		// 从其他线程的队列头部窃取
+		int n = (int)queues.size();
+		int start = index >= 0 ? index + 1 : 0;
+		for (int i = 0; i < n; ++i) {
+			int victim = (start + i) % n;
+			if (victim == index) continue;
+			if (queues[victim]->PopFront(task)) {
+				--pendingTasks;
+				task();
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	struct WorkQueue {
+		static constexpr int CAPACITY = 1024;
+		WorkQueue() : ring(CAPACITY) {}
+		bool PushBack(Task& task) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (size == CAPACITY) return false;
+			ring[(head + size) % CAPACITY] = std::move(task);
+			++size;
+			return true;
+		}
+		bool PopBack(Task& task) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (size == 0) return false;
+			--size;
+			task = std::move(ring[(head + size) % CAPACITY]);
+			return true;
+		}
+		bool PopFront(Task& task) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (size == 0) return false;
+			task = std::move(ring[head]);
+			head = (head + 1) % CAPACITY;
+			--size;
+			return true;
+		}
+		std::mutex mutex;
+		std::vector<Task> ring;
+		int head = 0, size = 0;
+	};
+
+	// 当前线程在本线程池中的编号，调用者线程为0，不属于本线程池的线程为-1
+	int CurrentIndex() const {
+		if (CurrentPool() == this) return CurrentWorker();
+		if (!workers.empty() && std::this_thread::get_id() == mainThread) return 0;
+		return -1;
+	}
+
+	static const ThreadPool*& CurrentPool() {
+		static thread_local const ThreadPool* pool = nullptr;
+		return pool;
+	}
+
+	static int& CurrentWorker() {
+		static thread_local int worker = -1;
+		return worker;
+	}
+
+	void WorkerLoop(int index) {
+		CurrentPool() = this;
+		CurrentWorker() = index;
+		while (true) {
+			if (RunPendingTask()) continue;
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleepCondition.wait(lock, [this]() { return stop || pendingTasks > 0; });
+			if (stop) return;
+		}
+	}
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> workers;
+	std::thread::id mainThread = std::this_thread::get_id();
+	std::atomic<int> pendingTasks{ 0 };
+	std::atomic<unsigned int> submitCount{ 0 };
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+	bool stop = false;
+};
+
+// 全局线程池，第一次使用时创建，线程数与CPU核心数相同
+inline ThreadPool& GlobalThreadPool() {
+	static ThreadPool pool;
+	return pool;
+}
+
+// 一组可等待的任务，Wait时当前线程会帮助执行任务直到组内任务全部完成
+class TaskGroup {
+public:
+	explicit TaskGroup(ThreadPool& pool = GlobalThreadPool()) : pool(pool) {}
+	~TaskGroup() {
+		Wait();
+	}
+
+	template <typename F>
+	void Run(F&& f) {
+		++unfinished;
+		pool.Submit([this, f]() {
+			f();
+			--unfinished;
+		});
+	}
+
+	void Wait() {
+		while (unfinished > 0) {
+			if (!pool.RunPendingTask()) std::this_thread::yield();
+		}
+	}
+
+private:
+	ThreadPool& pool;
+	std::atomic<int> unfinished{ 0 };
+};
+
+// 将[begin, end)按grain大小分块并行执行func(i)
+template <typename F>
+inline void ParallelFor(int begin, int end, int grain, const F& func) {
+	if (end <= begin) return;
+	ThreadPool& pool = GlobalThreadPool();
+	if (end - begin <= grain || pool.NumThreads() == 1) {
+		for (int i = begin; i < end; ++i) func(i);
+		return;
+	}
+	struct Loop {
+		std::atomic<int> next;
+		std::atomic<int> running;
+		int end, grain;
+		const F* func;
+		void Run() {
+			for (int i = next.fetch_add(grain); i < end; i = next.fetch_add(grain)) {
+				int iEnd = std::min(i + grain, end);
+				for (int j = i; j < iEnd; ++j) (*func)(j);
+			}
+		}
+	} loop;
+	loop.next = begin;
+	loop.end = end;
+	loop.grain = grain;
+	loop.func = &func;
+	// 每个工作线程提交一个循环任务，任务只捕获一个指针，不会产生额外的内存分配
+	int nTasks = std::min(pool.NumThreads() - 1, (end - begin + grain - 1) / grain - 1);
+	loop.running = nTasks;
+	Loop* l = &loop;
+	for (int i = 0; i < nTasks; ++i) {
+		pool.Submit([l]() {
+			l->Run();
+			--l->running;
+		});
+	}
+	loop.Run();
+	while (loop.running > 0) {
+		if (!pool.RunPendingTask()) std::this_thread::yield();
+	}
+}
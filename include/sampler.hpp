@@ -0,0 +1,105 @@
+#pragma once
+#include "PnRT.hpp"
+
+/*
+	与ray_tracing.comp相同的随机数：
+	wang_hash生成每个像素独立的随机序列，sobol序列经过Cranley-Patterson旋转用于BRDF采样
+	CPU渲染时每个像素持有自己的种子，线程之间不共享状态
+*/
+
+// 迭代更新种子
+inline uint32_t WangHash(uint32_t& seed) {
+	seed = (seed ^ 61u) ^ (seed >> 16);
+	seed *= 9u;
+	seed = seed ^ (seed >> 4);
+	seed *= 0x27d4eb2du;
+	seed = seed ^ (seed >> 15);
+	return seed;
+}
+
+inline float Rand0To1(uint32_t& seed) {
+	return float(WangHash(seed)) / 4294967296.0f;
+}
+
+// sobol方向数的维度个数，每次反弹使用两个维度，因此最多支持SOBOL_MAX_BOUNCE次反弹，与GPU的MAX_BOUNCE_DEPTH相同
+constexpr int SOBOL_DIMENSIONS = 8;
+constexpr int SOBOL_MAX_BOUNCE = SOBOL_DIMENSIONS / 2;
+
+// 前SOBOL_DIMENSIONS个维度的sobol方向数，每个维度32个
+constexpr uint32_t SOBOL_DIRECTIONS[SOBOL_DIMENSIONS * 32] = {
+	2147483648u, 1073741824u, 536870912u, 268435456u, 134217728u, 67108864u, 33554432u, 16777216u,
+	8388608u, 4194304u, 2097152u, 1048576u, 524288u, 262144u, 131072u, 65536u,
+	32768u, 16384u, 8192u, 4096u, 2048u, 1024u, 512u, 256u,
+	128u, 64u, 32u, 16u, 8u, 4u, 2u, 1u,
+	2147483648u, 3221225472u, 2684354560u, 4026531840u, 2281701376u, 3422552064u, 2852126720u, 4278190080u,
+	2155872256u, 3233808384u, 2694840320u, 4042260480u, 2290614272u, 3435921408u, 2863267840u, 4294901760u,
+	2147516416u, 3221274624u, 2684395520u, 4026593280u, 2281736192u, 3422604288u, 2852170240u, 4278255360u,
+	2155905152u, 3233857728u, 2694881440u, 4042322160u, 2290649224u, 3435973836u, 2863311530u, 4294967295u,
+	2147483648u, 3221225472u, 1610612736u, 2415919104u, 3892314112u, 1543503872u, 2382364672u, 3305111552u,
+	1753219072u, 2629828608u, 3999268864u, 1435500544u, 2154299392u, 3231449088u, 1626210304u, 2421489664u,
+	3900735488u, 1556135936u, 2388680704u, 3314585600u, 1751705600u, 2627492864u, 4008611328u, 1431684352u,
+	2147543168u, 3221249216u, 1610649184u, 2415969680u, 3892340840u, 1543543964u, 2382425838u, 3305133397u,
+	2147483648u, 3221225472u, 536870912u, 1342177280u, 4160749568u, 1946157056u, 2717908992u, 2466250752u,
+	3632267264u, 624951296u, 1507852288u, 3872391168u, 2013790208u, 3020685312u, 2181169152u, 3271884800u,
+	546275328u, 1363623936u, 4226424832u, 1977167872u, 2693105664u, 2437829632u, 3689389568u, 635137280u,
+	1484783744u, 3846176960u, 2044723232u, 3067084880u, 2148008184u, 3222012020u, 537002146u, 1342505107u,
+	2147483648u, 1073741824u, 536870912u, 2952790016u, 4160749568u, 3690987520u, 2046820352u, 2634022912u,
+	1518338048u, 801112064u, 2707423232u, 4038066176u, 3666345984u, 1875116032u, 2170683392u, 1085997056u,
+	579305472u, 3016343552u, 4217741312u, 3719483392u, 2013407232u, 2617981952u, 1510979072u, 755882752u,
+	2726789248u, 4090085440u, 3680870432u, 1840435376u, 2147625208u, 1074478300u, 537900666u, 2953698205u,
+	2147483648u, 1073741824u, 1610612736u, 805306368u, 2818572288u, 335544320u, 2113929216u, 3472883712u,
+	2290089984u, 3829399552u, 3059744768u, 1127219200u, 3089629184u, 4199809024u, 3567124480u, 1891565568u,
+	394297344u, 3988799488u, 920674304u, 4193267712u, 2950604800u, 3977188352u, 3250028032u, 129093376u,
+	2231568512u, 2963678272u, 4281226848u, 432124720u, 803643432u, 1633613396u, 2672665246u, 3170194367u,
+	2147483648u, 3221225472u, 2684354560u, 3489660928u, 1476395008u, 2483027968u, 1040187392u, 3808428032u,
+	3196059648u, 599785472u, 505413632u, 4077912064u, 1182269440u, 1736704000u, 2017853440u, 2221342720u,
+	3329785856u, 2810494976u, 3628507136u, 1416089600u, 2658719744u, 864310272u, 3863387648u, 3076993792u,
+	553150080u, 272922560u, 4167467040u, 1148698640u, 1719673080u, 2009075780u, 2149644390u, 3222291575u,
+	2147483648u, 1073741824u, 2684354560u, 1342177280u, 2281701376u, 1946157056u, 436207616u, 2566914048u,
+	2625634304u, 3208642560u, 2720006144u, 2098200576u, 111673344u, 2354315264u, 3464626176u, 4027383808u,
+	2886631424u, 3770826752u, 1691164672u, 3357462528u, 1993345024u, 3752330240u, 873073152u, 2870150400u,
+	1700563072u, 87021376u, 1097028000u, 1222351248u, 1560027592u, 2977959924u, 23268898u, 437609937u,
+};
+
+// 格林码
+inline uint32_t GrayCode(uint32_t i) {
+	return i ^ (i >> 1);
+}
+
+// 生成第 d 维度的第 i 个 sobol 数，d需要小于SOBOL_DIMENSIONS
+inline float Sobol(uint32_t d, uint32_t i) {
+	uint32_t result = 0;
+	uint32_t offset = d * 32;
+	for (uint32_t j = 0; i != 0; i >>= 1, j++)
+		if ((i & 1) != 0)
+			result ^= SOBOL_DIRECTIONS[j + offset];
+	return float(result) * (1.0f / float(0xFFFFFFFFu));
+}
+
+// 生成第 i 帧的第 b 次反弹需要的二维随机向量
+inline glm::vec2 SobolVec2(uint32_t i, uint32_t b) {
+	float u = Sobol(b * 2, GrayCode(i));
+	float v = Sobol(b * 2 + 1, GrayCode(i));
+	return glm::vec2(u, v);
+}
+
+// 以像素位置生成的随机偏移旋转sobol点，width与height为屏幕大小
+inline glm::vec2 CranleyPattersonRotation(glm::vec2 p, int x, int y, int width, int height) {
+	uint32_t pseed = uint32_t(
+		uint32_t(x * width) * 1973u +
+		uint32_t(y * height) * 9277u +
+		uint32_t(114514 / 1919) * 26699u) | 1u;
+
+	float u = Rand0To1(pseed);
+	float v = Rand0To1(pseed);
+
+	p.x += u;
+	if (p.x > 1) p.x -= 1;
+	if (p.x < 0) p.x += 1;
+
+	p.y += v;
+	if (p.y > 1) p.y -= 1;
+	if (p.y < 0) p.y += 1;
+
+	return p;
+}
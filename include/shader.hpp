@@ -1,5 +1,6 @@
 #pragma once
 #include "PnRT.hpp"
+#include "HDRImage.hpp"
 
 inline unsigned int createAndCompileShader(const char* shaderSource, GLenum type) {
 	unsigned int shader = glCreateShader(type);
@@ -55,7 +56,8 @@ public:
 
 class ComputeShader : public Shader {
 public:
-	ComputeShader(const char* path) {		
+	// defines中的宏插入到#version之后，用于在编译时选择着色器中的功能
+	ComputeShader(const char* path, const std::vector<std::string>& defines = {}) {		
 		std::string computeShaderCode;
 		try {
 			std::ifstream computeFile;
@@ -67,6 +69,13 @@ public:
 		} catch (std::ifstream::failure e) {
 			std::cout << "Cannot open compute shader file: " << path << std::endl;
 		}
+		if (!defines.empty()) {
+			std::string defineCode;
+			for (const auto& define : defines) defineCode += "#define " + define + "\n";
+			size_t pos = computeShaderCode.find("#version");
+			pos = pos == std::string::npos ? 0 : computeShaderCode.find('\n', pos) + 1;
+			computeShaderCode.insert(pos, defineCode);
+		}
 		unsigned int shader = createAndCompileShader(computeShaderCode.c_str(), GL_COMPUTE_SHADER);
 		program = glCreateProgram();
 		glAttachShader(program, shader);
@@ -123,103 +132,35 @@ public:
 	}
 };
 
-inline void LoadHDRImage(const char* path, const Shader& shader) {
+// 将HDR环境贴图及其重要性采样表上传到着色器
+inline void LoadHDRImage(const HDRImage& image, const Shader& shader) {
 	shader.use();
 	shader.setInt("HasHDRImage", 0);
-	int width, height, comp;
-	unsigned int hdrTexture;
-	float* hdrImage = stbi_loadf(path, &width, &height, &comp, 0);
-	if (!hdrImage) {
-		std::cout << "Failed to load HDR image: " << path << std::endl;
-	} else {
-		glGenTextures(1, &hdrTexture);
-		glActiveTexture(GL_TEXTURE29);
-		glBindTexture(GL_TEXTURE_2D, hdrTexture);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, hdrImage);
-
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-		std::vector<std::vector<float>> pdf;
-		pdf.resize(width);
-		float pdfSum = 0.0;
-		for (int x = 0; x < width; ++x) {
-			pdf[x].resize(height);
-			for (int y = 0; y < height; ++y) {
-				int pos = y * width + x;
-				// R * 0.2 + G * 0.7 + B * 0.1
-				float lumen = hdrImage[pos * 3 + 0] * 0.2 + hdrImage[pos * 3 + 1] * 0.7 + hdrImage[pos * 3 + 2] * 0.1;
-				pdf[x][y] = lumen;
-				pdfSum += lumen;
-			}
-		}
-		// λñxĸʱԵܶȺ
-		std::vector<float> cdfMarginX, pdfMarginX;
-		cdfMarginX.resize(width);
-		pdfMarginX.resize(width);
-		for (int y = 0; y < height; ++y) {
-			for (int x = 0; x < width; ++x) {
-				pdf[x][y] /= pdfSum; // һ
-				pdfMarginX[x] += pdf[x][y];
-			}
-		}
-		cdfMarginX[0] = pdfMarginX[0];
-		for (int x = 1; x < width; ++x) {
-			cdfMarginX[x] = cdfMarginX[x - 1] + pdfMarginX[x];
-		}
-		// ѡx¶yܶȺ
-		std::vector<std::vector<float>> cdfYConditionX;
-		cdfYConditionX.resize(width);
-		for (int x = 0; x < width; ++x) {
-			cdfYConditionX[x].resize(height);
-			for (int y = 0; y < height; ++y) {
-				cdfYConditionX[x][y] = (y > 0 ? cdfYConditionX[x][y - 1] : 0.0)
-					+ pdf[x][y] / pdfMarginX[x];
-			}
-		}
-
-		float* randomHDR = new float[width * height * 3];
-		// ɫr1 = i / width, r2 = j / heightʱCDF溯ҶӦx, y
-		// randomHDR[pos]洢x, y, 
-		for (int i = 0; i < width; ++i) {
-			for (int j = 0; j < height; ++j) {
-				float r1 = Rand0To1(), r2 = Rand0To1();
-				int x = (int)(std::lower_bound(cdfMarginX.begin(), cdfMarginX.end(),
-					(float)i / width) - cdfMarginX.begin());
-				if (x >= width) x = width - 1;
-				if (x < 0) x = 0;
-				int y = (int)(std::lower_bound(cdfYConditionX[x].begin(), cdfYConditionX[x].end(),
-					(float)j / height) - cdfYConditionX[x].begin());
-				if (y >= height) y = height - 1;
-				if (y < 0) y = 0;
-				int pos = 3 * (j * width + i);
-				
-				randomHDR[pos + 0] = (float)x / width;
-				randomHDR[pos + 1] = (float)y / height;
-				randomHDR[pos + 2] = pdf[x][y];
-			}
-		}
+	if (image.Empty()) return;
 
-		unsigned int rH;
-		glGenTextures(1, &rH);
-		glActiveTexture(GL_TEXTURE30);
-		glBindTexture(GL_TEXTURE_2D, rH);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, randomHDR);
-
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-		shader.setInt("HDRImageWidth", width);
-		shader.setInt("HDRImageHeight", height);
-		shader.setInt("HasHDRImage", 1);
-
-		std::cout << "Success to load HDR Image: " << path << std::endl;
-
-		stbi_image_free(hdrImage);
-		delete[] randomHDR;
-	}
-}
\ No newline at end of file
+	unsigned int hdrTexture;
+	glGenTextures(1, &hdrTexture);
+	glActiveTexture(GL_TEXTURE29);
+	glBindTexture(GL_TEXTURE_2D, hdrTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.pixels.data());
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	unsigned int rH;
+	glGenTextures(1, &rH);
+	glActiveTexture(GL_TEXTURE30);
+	glBindTexture(GL_TEXTURE_2D, rH);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.randomHDR.data());
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	shader.setInt("HDRImageWidth", image.width);
+	shader.setInt("HDRImageHeight", image.height);
+	shader.setInt("HasHDRImage", 1);
+}
@@ -4,84 +4,36 @@
 
 struct Triangle {
 	int indices[3] = { -1, -1, -1 };
-	// materialtextureڸvectorеglslָ
+	// material和texture在各自vector中的索引，在glsl里起到类似指针的作用
 	int materialId = 0;
 	int textureId = -1;
+	// 构建BVH前在三角形数组中的编号，空间划分复制出的三角形引用编号相同
+	int primitiveId = -1;
 	float area = 0.f;
 	Bound bound;
 	glm::vec3 boundCenter = glm::vec3(0);
 };
 
-inline bool TriangleIntersect(const Triangle& tri, const Ray& ray,
+/*
+	三角形求交的结果：遍历中只记录三角形编号、距离与重心坐标，更近的交点直接覆盖
+	遍历结束后再由TriangleInteraction对最近的交点计算一次表面信息
+*/
+struct TriangleHit {
+	int triangle = -1;
+	int instance = -1; // 两层加速结构中交点所在的实例
+	float t, b0, b1, b2;
+};
+
+// 由交点的重心坐标计算表面信息，只对遍历结束后的最近交点调用
+inline void TriangleInteraction(const Triangle& tri, const glm::vec3& dir, float t, float b0, float b1, float b2,
 	const std::vector<Vertex>& vertices, Interaction* isect) {
 	const Vertex& v0 = vertices[tri.indices[0]];
 	const Vertex& v1 = vertices[tri.indices[1]];
 	const Vertex& v2 = vertices[tri.indices[2]];
-
 	glm::vec3 p0 = v0.position;
 	glm::vec3 p1 = v1.position;
 	glm::vec3 p2 = v2.position;
 
-	// 任ϵԭ(0, 0, 0), ָ+z
-	glm::vec3 P0 = p0 - ray.origin;
-	glm::vec3 P1 = p1 - ray.origin;
-	glm::vec3 P2 = p2 - ray.origin;
-	glm::vec3 rd = ray.dir;
-	// zΪ0ѡȡн
-	if (rd.z == 0) {
-		if (std::abs(rd.x) > std::abs(rd.y)) {
-			std::swap(P0.x, P0.z);
-			std::swap(P1.x, P1.z);
-			std::swap(P2.x, P2.z);
-			std::swap(rd.x, rd.z);
-		}
-		else {
-			std::swap(P0.y, P0.z);
-			std::swap(P1.y, P1.z);
-			std::swap(P2.y, P2.z);
-			std::swap(rd.y, rd.z);
-		}
-	}
-	// б任߷+z
-	float invDz = 1.f / rd.z;
-	P0.x = P0.x - P0.z * rd.x * invDz;
-	P0.y = P0.y - P0.z * rd.y * invDz;
-	P0.z *= invDz;
-	P1.x = P1.x - P1.z * rd.x * invDz;
-	P1.y = P1.y - P1.z * rd.y * invDz;
-	P1.z *= invDz;
-	P2.x = P2.x - P2.z * rd.x * invDz;
-	P2.y = P2.y - P2.z * rd.y * invDz;
-	P2.z *= invDz;
-
-	// ߺ p0  p1Լĵpָ
-	float e0 = P1.x * P2.y - P1.y * P2.x;
-	float e1 = P2.x * P0.y - P2.y * P0.x;
-	float e2 = P0.x * P1.y - P0.y * P1.x;
-
-	// 
-	if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) return false;
-
-	// 㹲
-	float det = e0 + e1 + e2;
-	if (det == 0) return false;
-
-	/* 
-		꣺bi = ei / (e0 + e1 + e2) = bi / det
-		ֵz = simga(bi * zi) = sigma(ei * zi) / det
-		 жzڹ߷Χsigma(ei * zi)ray.tMax * detбȽ
-	*/
-	float tScaled = e0 * P0.z + e1 * P1.z + e2 * P2.z;
-	if (det > 0 && (tScaled <= 0 || tScaled >= ray.tMax * det)) return false;
-	if (det < 0 && (tScaled >= 0 || tScaled <= ray.tMax * det)) return false;
-
-	// 
-	float invDet = 1.f / det;
-	float t = tScaled * invDet;
-	float b0 = e0 * invDet;
-	float b1 = e1 * invDet;
-	float b2 = e2 * invDet;
-	
 	glm::vec2 uv0 = v0.texcoord;
 	glm::vec2 uv1 = v1.texcoord;
 	glm::vec2 uv2 = v2.texcoord;
@@ -92,15 +44,15 @@ inline bool TriangleIntersect(const Triangle& tri, const Ray& ray,
 	glm::vec3 normal2 = v2.normal;
 	glm::vec3 nHit;
 	
-	// βڷ
+	// 该三角形不存在法线
 	if (normal0 == glm::vec3(0) || normal1 == glm::vec3(0) || normal2 == glm::vec3(0)) {
 		nHit = glm::normalize(glm::cross(p1 - p0, p2 - p0));
 	} else {
 		nHit = normal0 * b0 + normal1 * b1 + normal2 * b2;
 	}
 
-	// ߻α棬Ҫת
-	if (glm::dot(nHit, ray.dir) > 0) {
+	// 光线击中三角形背面，需要反转法线
+	if (glm::dot(nHit, dir) > 0) {
 		nHit = -nHit;
 	}
 	nHit = glm::normalize(nHit);
@@ -110,13 +62,14 @@ inline bool TriangleIntersect(const Triangle& tri, const Ray& ray,
 	isect->textureId = tri.textureId;
 	isect->materialId = tri.materialId;
 	isect->time = t;
-	ray.tMax = t;
-	return true;
 }
 
-// ֻཻ
-inline bool TriangleIntersectP(const Triangle& tri, const Ray& ray,
-	const std::vector<Vertex>& vertices) {
+/*
+	与三角形求交（水密求交），击中时写出三条边函数、tScaled与det，交点距离为tScaled / det
+	TriangleIntersect与TriangleIntersectP共用，与TriangleBlockTest的运算顺序相同
+*/
+inline bool TriangleTest(const Triangle& tri, const Ray& ray, const std::vector<Vertex>& vertices,
+	float e[3], float* tScaledOut, float* detOut) {
 	const Vertex& v0 = vertices[tri.indices[0]];
 	const Vertex& v1 = vertices[tri.indices[1]];
 	const Vertex& v2 = vertices[tri.indices[2]];
@@ -125,26 +78,27 @@ inline bool TriangleIntersectP(const Triangle& tri, const Ray& ray,
 	glm::vec3 p1 = v1.position;
 	glm::vec3 p2 = v2.position;
 
-	// 任ϵԭ(0, 0, 0), ָ+z
+	// 变换坐标系：光线原点在(0, 0, 0), 方向指向+z轴
 	glm::vec3 P0 = p0 - ray.origin;
 	glm::vec3 P1 = p1 - ray.origin;
 	glm::vec3 P2 = p2 - ray.origin;
 	glm::vec3 rd = ray.dir;
-	// zΪ0ѡȡн
+	// 光线z方向为0，选取另外两个最长的轴进行交换
 	if (rd.z == 0) {
 		if (std::abs(rd.x) > std::abs(rd.y)) {
 			std::swap(P0.x, P0.z);
 			std::swap(P1.x, P1.z);
 			std::swap(P2.x, P2.z);
 			std::swap(rd.x, rd.z);
-		} else {
+		}
+		else {
 			std::swap(P0.y, P0.z);
 			std::swap(P1.y, P1.z);
 			std::swap(P2.y, P2.z);
 			std::swap(rd.y, rd.z);
 		}
 	}
-	// б任߷+z
+	// 错切变换，射线方向与+z轴对齐
 	float invDz = 1.f / rd.z;
 	P0.x = P0.x - P0.z * rd.x * invDz;
 	P0.y = P0.y - P0.z * rd.y * invDz;
@@ -156,37 +110,190 @@ inline bool TriangleIntersectP(const Triangle& tri, const Ray& ray,
 	P2.y = P2.y - P2.z * rd.y * invDz;
 	P2.z *= invDz;
 
-	// ߺ p0  p1Լĵpָ
+	// 边函数：由 p0 和 p1以及给定的第三点p指定的三角形面积的两倍
 	float e0 = P1.x * P2.y - P1.y * P2.x;
 	float e1 = P2.x * P0.y - P2.y * P0.x;
 	float e2 = P0.x * P1.y - P0.y * P1.x;
 
-	// 
+	// 交点落在三角形外
 	if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) return false;
 
-	// 㹲
+	// 三角形三点共线
 	float det = e0 + e1 + e2;
 	if (det == 0) return false;
 
-	/*
-		꣺bi = ei / (e0 + e1 + e2) = bi / det
-		ֵz = simga(bi * zi) = sigma(ei * zi) / det
-		 жzڹ߷Χsigma(ei * zi)ray.tMax * detбȽ
+	/* 
+		重心坐标：bi = ei / (e0 + e1 + e2) = bi / det
+		插值后z = simga(bi * zi) = sigma(ei * zi) / det
+		避免除法误差 判断z在光线范围内用sigma(ei * zi)与ray.tMax * det进行比较
 	*/
 	float tScaled = e0 * P0.z + e1 * P1.z + e2 * P2.z;
 	if (det > 0 && (tScaled <= 0 || tScaled >= ray.tMax * det)) return false;
 	if (det < 0 && (tScaled >= 0 || tScaled <= ray.tMax * det)) return false;
 
+	e[0] = e0;
+	e[1] = e1;
+	e[2] = e2;
+	*tScaledOut = tScaled;
+	*detOut = det;
+	return true;
+}
+
+// 击中更近的交点时缩短ray.tMax，并写入交点的距离与重心坐标，三角形编号由调用者填写
+inline bool TriangleIntersect(const Triangle& tri, const Ray& ray,
+	const std::vector<Vertex>& vertices, TriangleHit* hit) {
+	float e[3], tScaled, det;
+	if (!TriangleTest(tri, ray, vertices, e, &tScaled, &det)) return false;
+	// 重心坐标
+	float invDet = 1.f / det;
+	hit->t = tScaled * invDet;
+	hit->b0 = e[0] * invDet;
+	hit->b1 = e[1] * invDet;
+	hit->b2 = e[2] * invDet;
+	ray.tMax = hit->t;
 	return true;
 }
 
-// ϲ
+// 只进行相交测试
+inline bool TriangleIntersectP(const Triangle& tri, const Ray& ray,
+	const std::vector<Vertex>& vertices) {
+	float e[3], tScaled, det;
+	return TriangleTest(tri, ray, vertices, e, &tScaled, &det);
+}
+
+/*
+	三角形块：叶子中相邻的TRIANGLE_BLOCK_SIZE个三角形的顶点位置按分量连续存储(SoA)，一次SSE运算与4个三角形求交
+	求交只读取块中紧凑的顶点位置，不访问Vertex与Triangle，交点的法线、纹理坐标在遍历结束后只对最近的交点计算
+	叶子中的三角形一般只有几个，因此AVX下仍使用4个一组
+*/
+constexpr int TRIANGLE_BLOCK_SIZE = 4;
+
+struct alignas(16) TriangleBlock {
+	float p[3][3][TRIANGLE_BLOCK_SIZE]; // p[顶点][轴][三角形]，不足4个时其余三角形的顶点全为0
+};
+
+// 与三角形块求交时不变的量：TriangleIntersect中的坐标轴交换与错切所用的光线方向
+struct TriangleBlockRay {
+	explicit TriangleBlockRay(const Ray& ray) {
+		glm::vec3 rd = ray.dir;
+		// 与TriangleIntersect相同，光线z方向为0时与另外两个轴中较长的一个交换
+		kx = 0, ky = 1, kz = 2;
+		if (rd.z == 0) {
+			if (std::abs(rd.x) > std::abs(rd.y)) std::swap(kx, kz);
+			else std::swap(ky, kz);
+		}
+		origin[0] = _mm_set1_ps(ray.origin[kx]);
+		origin[1] = _mm_set1_ps(ray.origin[ky]);
+		origin[2] = _mm_set1_ps(ray.origin[kz]);
+		dirX = _mm_set1_ps(rd[kx]);
+		dirY = _mm_set1_ps(rd[ky]);
+		invDz = _mm_set1_ps(1.f / rd[kz]);
+	}
+	int kx, ky, kz;
+	__m128 origin[3], dirX, dirY, invDz;
+};
+
+/*
+	4个三角形同时按TriangleIntersect的运算顺序求交，返回击中的三角形的位掩码，不足4个时只测试前count个
+	边函数、tScaled与det同时写出，用于逐个确定最近的交点
+*/
+inline int TriangleBlockTest(const TriangleBlock& block, int count, const TriangleBlockRay& ray, float tMax,
+	__m128* eOut, __m128* tScaledOut, __m128* detOut) {
+	__m128 Px[3], Py[3], Pz[3];
+	for (int v = 0; v < 3; ++v) {
+		// 变换坐标系：光线原点在(0, 0, 0), 方向指向+z轴，再错切使方向与+z轴对齐
+		__m128 x = _mm_sub_ps(_mm_load_ps(block.p[v][ray.kx]), ray.origin[0]);
+		__m128 y = _mm_sub_ps(_mm_load_ps(block.p[v][ray.ky]), ray.origin[1]);
+		__m128 z = _mm_sub_ps(_mm_load_ps(block.p[v][ray.kz]), ray.origin[2]);
+		Px[v] = _mm_sub_ps(x, _mm_mul_ps(_mm_mul_ps(z, ray.dirX), ray.invDz));
+		Py[v] = _mm_sub_ps(y, _mm_mul_ps(_mm_mul_ps(z, ray.dirY), ray.invDz));
+		Pz[v] = _mm_mul_ps(z, ray.invDz);
+	}
+	// 边函数
+	__m128 e0 = _mm_sub_ps(_mm_mul_ps(Px[1], Py[2]), _mm_mul_ps(Py[1], Px[2]));
+	__m128 e1 = _mm_sub_ps(_mm_mul_ps(Px[2], Py[0]), _mm_mul_ps(Py[2], Px[0]));
+	__m128 e2 = _mm_sub_ps(_mm_mul_ps(Px[0], Py[1]), _mm_mul_ps(Py[0], Px[1]));
+	__m128 zero = _mm_setzero_ps();
+	// 交点落在三角形外
+	__m128 anyNegative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+	__m128 anyPositive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+	__m128 miss = _mm_and_ps(anyNegative, anyPositive);
+	// 三角形三点共线
+	__m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+	miss = _mm_or_ps(miss, _mm_cmpeq_ps(det, zero));
+	// 交点在光线范围外
+	__m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, Pz[0]), _mm_mul_ps(e1, Pz[1])), _mm_mul_ps(e2, Pz[2]));
+	__m128 tMaxDet = _mm_mul_ps(_mm_set1_ps(tMax), det);
+	__m128 missPositive = _mm_and_ps(_mm_cmpgt_ps(det, zero), _mm_or_ps(_mm_cmple_ps(tScaled, zero), _mm_cmpge_ps(tScaled, tMaxDet)));
+	__m128 missNegative = _mm_and_ps(_mm_cmplt_ps(det, zero), _mm_or_ps(_mm_cmpge_ps(tScaled, zero), _mm_cmple_ps(tScaled, tMaxDet)));
+	miss = _mm_or_ps(miss, _mm_or_ps(missPositive, missNegative));
+	eOut[0] = e0;
+	eOut[1] = e1;
+	eOut[2] = e2;
+	*tScaledOut = tScaled;
+	*detOut = det;
+	return ~_mm_movemask_ps(miss) & ((1 << count) - 1);
+}
+
+/*
+	与块中的三角形求交，按编号顺序对每个击中的三角形调用onHit(const TriangleHit&)，firstTriangle为块中第一个三角形的编号
+	每个交点调用前与当前的*tMax重新比较，onHit缩短*tMax后块中更远的交点不再报告；onHit返回false时停止并返回false
+*/
+template <typename F>
+inline bool TriangleBlockHits(const TriangleBlock& block, int count, int firstTriangle, const TriangleBlockRay& ray,
+	const float* tMax, const F& onHit) {
+	__m128 eV[3], tScaledV, detV;
+	int mask = TriangleBlockTest(block, count, ray, *tMax, eV, &tScaledV, &detV);
+	if (!mask) return true;
+	alignas(16) float e[3][TRIANGLE_BLOCK_SIZE], tScaled[TRIANGLE_BLOCK_SIZE], det[TRIANGLE_BLOCK_SIZE];
+	for (int k = 0; k < 3; ++k) _mm_store_ps(e[k], eV[k]);
+	_mm_store_ps(tScaled, tScaledV);
+	_mm_store_ps(det, detV);
+	for (int i = 0; i < TRIANGLE_BLOCK_SIZE; ++i) {
+		if (!(mask >> i & 1)) continue;
+		if (det[i] > 0 && tScaled[i] >= *tMax * det[i]) continue;
+		if (det[i] < 0 && tScaled[i] <= *tMax * det[i]) continue;
+		float invDet = 1.f / det[i];
+		TriangleHit hit;
+		hit.triangle = firstTriangle + i;
+		hit.t = tScaled[i] * invDet;
+		hit.b0 = e[0][i] * invDet;
+		hit.b1 = e[1][i] * invDet;
+		hit.b2 = e[2][i] * invDet;
+		if (!onHit(hit)) return false;
+	}
+	return true;
+}
+
+/*
+	与块中的三角形求交，击中时缩短tMax并写入最近的交点
+	同一块中有多个交点时按编号顺序逐个与缩短后的tMax比较，结果与逐个调用TriangleIntersect相同
+*/
+inline bool TriangleBlockIntersect(const TriangleBlock& block, int count, int firstTriangle, const TriangleBlockRay& ray,
+	float* tMax, TriangleHit* hit) {
+	bool found = false;
+	TriangleBlockHits(block, count, firstTriangle, ray, tMax, [&](const TriangleHit& h) {
+		*hit = h;
+		*tMax = h.t;
+		found = true;
+		return true;
+	});
+	return found;
+}
+
+// 只进行相交测试，返回遮挡光线的三角形的位掩码
+inline int TriangleBlockIntersectP(const TriangleBlock& block, int count, const TriangleBlockRay& ray, float tMax) {
+	__m128 e[3], tScaled, det;
+	return TriangleBlockTest(block, count, ray, tMax, e, &tScaled, &det);
+}
+
+// 在三角形上采样，返回重心坐标
 inline glm::vec2 UniformSampleTriangle(const glm::vec2& u) {
 	float su0 = std::sqrt(u[0]);
 	return glm::vec2(1 - su0, u[1] * su0);
 }
 
-// ϲزϢ
+// 在三角形上采样，返回采样点信息
 inline Interaction TriangleSample(const Triangle& tri, const glm::vec2& u, const std::vector<Vertex>& vertices) {
 	glm::vec2 b = UniformSampleTriangle(u);
 	const glm::vec3& p0 = vertices[tri.indices[0]].position;
@@ -1,5 +1,12 @@
 #include "PnRT.hpp"
 #include "BVH.hpp"
+#include "TLAS.hpp"
+#include "CompressedBVH.hpp"
+#include "SceneCache.hpp"
+#include "BVHStats.hpp"
+#include "CPURenderer.hpp"
+#include "BatchRender.hpp"
+#include "Benchmark.hpp"
 #include "camera.hpp"
 #include "model.hpp"
 #include "shader.hpp"
@@ -194,6 +201,86 @@ void renderQuad() {
 	glBindVertexArray(0);
 }
 
+// 按计算着色器中读取的顺序把顶点写入缓冲区
+void PackVertex(const Vertex& vertex, float* buffer) {
+	int num = 0;
+	buffer[num++] = vertex.position[0];
+	buffer[num++] = vertex.position[1];
+	buffer[num++] = vertex.position[2];
+	buffer[num++] = vertex.normal[0];
+	buffer[num++] = vertex.normal[1];
+	buffer[num++] = vertex.normal[2];
+	buffer[num++] = vertex.tangent[0];
+	buffer[num++] = vertex.tangent[1];
+	buffer[num++] = vertex.tangent[2];
+	buffer[num++] = vertex.bitangent[0];
+	buffer[num++] = vertex.bitangent[1];
+	buffer[num++] = vertex.bitangent[2];
+	buffer[num++] = vertex.texcoord[0];
+	buffer[num++] = vertex.texcoord[1];
+	buffer[num++] = 0.f; // 保证12字节对齐
+}
+
+// 上传压缩节点中[texelBegin, texelEnd)的纹素
+void UploadCompressedBVH(const CompressedBVH& compressed, int texelBegin, int texelEnd, unsigned int bvhnodeTbo) {
+	if (texelEnd <= texelBegin) return;
+	glBindBuffer(GL_TEXTURE_BUFFER, bvhnodeTbo);
+	glBufferSubData(GL_TEXTURE_BUFFER, sizeof(uint32_t) * 4 * texelBegin,
+		sizeof(uint32_t) * 4 * (texelEnd - texelBegin), &compressed.data[4 * texelBegin]);
+}
+
+// 实例按计算着色器中读取的顺序写入：两个变换矩阵的前三行（按列存储），BLAS根节点的纹素位置，材质
+void PackInstance(const Instance& instance, int blasRoot, float* buffer) {
+	int num = 0;
+	for (int c = 0; c < 4; ++c)
+		for (int r = 0; r < 3; ++r)
+			buffer[num++] = instance.worldToObject[c][r];
+	for (int c = 0; c < 4; ++c)
+		for (int r = 0; r < 3; ++r)
+			buffer[num++] = instance.objectToWorld[c][r];
+	buffer[num++] = (float)blasRoot;
+	buffer[num++] = (float)instance.materialId;
+	buffer[num++] = 0.f;
+}
+
+// 模型移动后重新计算其顶点并Refit BVH，只上传该模型的顶点以及包围盒发生变化的节点和它们的父节点
+void UpdateModel(Model& model, BVH& bvhaccel, CompressedBVH& compressed, unsigned int vertexTbo, unsigned int bvhnodeTbo) {
+	// 从场景缓存启动时模型的网格没有读取，第一次移动时读取
+	model.Load();
+	ModelTransform(model, bvhaccel.vertices);
+	std::vector<float> vertexBuffer(VERTEX_SIZE * model.vertexCount);
+	for (int i = 0; i < model.vertexCount; ++i)
+		PackVertex(bvhaccel.vertices[model.vertexOffset + i], &vertexBuffer[VERTEX_SIZE * i]);
+	glBindBuffer(GL_TEXTURE_BUFFER, vertexTbo);
+	glBufferSubData(GL_TEXTURE_BUFFER, sizeof(float) * VERTEX_SIZE * model.vertexOffset,
+		sizeof(float) * vertexBuffer.size(), vertexBuffer.data());
+
+	BVHRefitResult refit = bvhaccel.Refit(model.vertexOffset, model.vertexOffset + model.vertexCount);
+	std::vector<IndexRange> texelRuns;
+	compressed.Update(bvhaccel.bvh, refit.dirtyRuns, &texelRuns);
+	for (const IndexRange& run : texelRuns)
+		UploadCompressedBVH(compressed, run.begin, run.end, bvhnodeTbo);
+	if (refit.needRebuild) {
+		std::cout << "BVH quality degraded after refit, SAH cost: " << bvhaccel.buildCost << " -> "
+			<< refit.sahCost << ", rebuild recommended" << std::endl;
+	}
+}
+
+// 实例移动后只需重建顶层BVH，上传顶层节点与该实例的变换
+void UpdateInstance(int id, const Model& model, TLAS& tlas, CompressedBVH& compressed, unsigned int bvhnodeTbo, unsigned int instanceTbo) {
+	tlas.SetTransform(id, model.modelMatrix);
+	tlas.Build();
+	// 顶层节点数不变，压缩后仍占据缓冲开头相同大小的区间
+	int texelBegin, texelEnd;
+	compressed.Rebuild(tlas.bvh, 0, &texelBegin, &texelEnd);
+	UploadCompressedBVH(compressed, texelBegin, texelEnd, bvhnodeTbo);
+
+	const Instance& instance = tlas.instances[id];
+	float instanceBuffer[INSTANCE_SIZE];
+	PackInstance(instance, compressed.recordOffset[tlas.blasNodeOffset[instance.blasId]], instanceBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, instanceTbo);
+	glBufferSubData(GL_TEXTURE_BUFFER, sizeof(float) * INSTANCE_SIZE * id, sizeof(instanceBuffer), instanceBuffer);
+}
 
 void CornellBox() {
 	glm::vec3 cameraEye(0, 2.8, 7);
@@ -346,43 +433,205 @@ void teapot() {
 
 }
 
-int main() {
+// 按名称设置场景的模型与相机，名称不存在时返回false
+bool LoadScene(const std::string& name) {
+	if (name == "CornellBox") CornellBox();
+	else if (name == "SceneFlat") SceneFlat();
+	else if (name == "teapot") teapot();
+	else return false;
+	return true;
+}
+
+// 渲染与性能测试共用的BVH设置
+BVHSetting SceneBVHSetting() {
+	BVHSetting bvhSetting;
+	/*
+		空间划分(spatialSplit)默认关闭：内置场景的墙面都是与坐标轴对齐的四边形，
+		空间划分在这类场景中没有降低SAH代价，构建却慢5-8倍；只对测得有收益的场景开启
+	*/
+	// 场景是静态的，构建后再进行treelet重构降低遍历代价
+	bvhSetting.optimizePasses = 3;
+	return bvhSetting;
+}
+
+int main(int argc, char** argv) {
+	// 第一个参数为--benchmark时测试各个场景的光线求交性能后退出
+	BenchmarkSetting benchmark;
+	if (!ParseBenchmarkSetting(argc, argv, &benchmark)) return 1;
+	if (benchmark.enabled) {
+		bool ok = RunBenchmark(benchmark, SceneBVHSetting(), [](const std::string& name, Camera* sceneCamera) {
+			if (!LoadScene(name)) return false;
+			*sceneCamera = camera;
+			return true;
+		});
+		return ok ? 0 : 1;
+	}
+
+	// 带有--batch参数时不创建窗口，使用CPU渲染器离线渲染并输出图像
+	BatchSetting batch;
+	if (!ParseBatchSetting(argc, argv, &batch)) return 1;
+
+	// 在这里更换场景：CornellBox, SceneFlat, teapot
+	std::string sceneName = batch.enabled ? batch.scene : "CornellBox";
+	if (!LoadScene(sceneName)) {
+		std::cout << "Unknown scene: " << sceneName << std::endl;
+		return 1;
+	}
+	if (batch.enabled) SetupBatchCamera(batch, &camera);
+	const char* hdrPath = "./HDR/vignaioli_night_1k.hdr";
+	//const char* hdrPath = "./HDR/clarens_midday_2k.hdr";
+	// 使用两层加速结构：相同路径的模型只构建一次BLAS，移动模型时只重建顶层，关闭时所有模型合并构建一棵BVH
+	constexpr bool USE_INSTANCING = true;
+	// 着色器中每个线程缓存上一次遮挡灯光阴影射线的三角形，之后指向同一灯光的阴影射线先与其求交
+	constexpr bool USE_OCCLUSION_CACHE = false;
+	// 着色器遍历BVH时使用短栈与restart trail代替每个线程128项的完整栈，找到的交点相同
+	constexpr bool USE_SHORT_STACK = false;
+	// 输出BVH的质量统计以及CPU求交时每条光线访问的节点数，用于比较构建方法与调整参数
+	constexpr bool REPORT_BVH_STATS = false;
+
+	BVHSetting bvhSetting = SceneBVHSetting();
+	std::shared_ptr<BVH> bvhaccel;
+	std::shared_ptr<TLAS> tlas;
+	// 上传到GPU的顶点、三角形和BVH节点
+	std::vector<Vertex> sceneVertices;
+	std::vector<Triangle> sceneTriangles;
+	std::vector<BVHNode> sceneNodes;
+	// 场景没有改变时直接映射上次写入的场景缓存，跳过模型导入、BVH构建与数据打包
+	const std::string sceneCachePath = "./scene.cache";
+	uint64_t sceneCacheKey = SceneCacheKey(models, bvhSetting, USE_INSTANCING);
+	SceneCache sceneCache;
+	auto buildBegin = clock();
+	bool warmStart = sceneCache.Open(sceneCachePath, sceneCacheKey);
+	// 纹理按原来的编号顺序读取，三角形中的纹理编号保持不变；任意纹理读取失败时之后的编号都会错位，放弃缓存重新构建
+	if (warmStart && !LoadTextures(sceneCache.GetStrings(SceneCacheSection::TexturePaths))) {
+		std::cout << "Cannot load textures of scene cache, rebuild the scene" << std::endl;
+		ClearTextures();
+		sceneCache.Close();
+		warmStart = false;
+	}
+	if (warmStart) {
+		sceneVertices = sceneCache.GetVector<Vertex>(SceneCacheSection::Vertices);
+		sceneTriangles = sceneCache.GetVector<Triangle>(SceneCacheSection::Triangles);
+		sceneNodes = sceneCache.GetVector<BVHNode>(SceneCacheSection::Nodes);
+		lights = sceneCache.GetVector<Light>(SceneCacheSection::Lights);
+		if (USE_INSTANCING) {
+			tlas = InstanceRestore(models, sceneCache.GetVector<int>(SceneCacheSection::BLASRanges),
+				sceneCache.GetVector<int>(SceneCacheSection::InstanceBLAS), sceneVertices, sceneTriangles, sceneNodes, bvhSetting);
+		} else {
+			Span<int> modelRanges = sceneCache.Get<int>(SceneCacheSection::ModelRanges);
+			for (int i = 0; i < models.size(); ++i) {
+				models[i].vertexOffset = modelRanges[2 * i];
+				models[i].vertexCount = modelRanges[2 * i + 1];
+			}
+			bvhaccel = std::make_shared<BVH>(sceneVertices, sceneTriangles, sceneNodes, bvhSetting);
+		}
+		std::cout << "Load scene cache completed, cost: " << clock() - buildBegin << " ms, " << sceneNodes.size() << " nodes and "
+			<< sceneTriangles.size() << " triangle references" << std::endl;
+	} else if (USE_INSTANCING) {
+		LoadModels(models);
+		// 相同路径的模型共享BLAS，每个模型作为一个实例
+		tlas = InstanceOutput(models, bvhSetting);
+		tlas->Merge(&sceneVertices, &sceneTriangles, &sceneNodes);
+		std::cout << "Build TLAS completed, cost: " << clock() - buildBegin << " ms" << std::endl;
+		std::cout << "TLAS has " << tlas->blases.size() << " unique meshes, " << tlas->instances.size() << " instances, "
+			<< sceneNodes.size() << " nodes and " << sceneTriangles.size() << " triangle references" << std::endl;
+		for (int i = 0; i < tlas->blases.size(); ++i) {
+			const BVHOptimizeResult& opt = tlas->blases[i]->optimizeResult;
+			std::cout << "BLAS " << i << " SAH cost: " << opt.sahBefore << " -> " << opt.sahAfter << " after optimization" << std::endl;
+		}
+
+		// 自发光实例的每个三角形加入到lights，面积使用变换到世界空间后的面积
+		for (int i = 0; i < tlas->instances.size(); ++i) {
+			const Instance& instance = tlas->instances[i];
+			if (materials[instance.materialId].emssive == glm::vec3(0)) continue;
+			const BVH& blas = *tlas->blases[instance.blasId];
+			std::vector<bool> isLight(blas.triangles.size());
+			for (int j = 0; j < blas.triangles.size(); ++j) {
+				const Triangle& tri = blas.triangles[j];
+				if (isLight[tri.primitiveId]) continue;
+				isLight[tri.primitiveId] = true;
+				glm::vec3 p[3];
+				for (int k = 0; k < 3; ++k)
+					p[k] = glm::vec3(instance.objectToWorld * glm::vec4(blas.vertices[tri.indices[k]].position, 1.0));
+				float area = glm::length(glm::cross(p[1] - p[0], p[2] - p[0])) * 0.5f;
+				lights.push_back({ tlas->blasTriangleOffset[instance.blasId] + j, area, i });
+				if (lights.size() > 1) {
+					lights[lights.size() - 1].prefixArea += lights[lights.size() - 2].prefixArea;
+				}
+			}
+		}
+	} else {
+		LoadModels(models);
+		// 将模型数据输出到顶点和三角形数组
+		ModelOutput(models);
+		std::cout << "Load " << vertices.size() << " vertices and " << triangles.size() << " triangles" << std::endl;
+
+		// 构建bvh，获取bvh结构以及重排后的顶点和三角形数据
+		bvhaccel = std::make_shared<BVH>(std::move(vertices), std::move(triangles), bvhSetting);
+		std::cout << "Build BVH completed, cost: " << clock() - buildBegin << " ms, SAH cost: " << bvhaccel->optimizeResult.sahBefore
+			<< " -> " << bvhaccel->optimizeResult.sahAfter << " after optimization" << std::endl;
+		std::cout << "BVH has " << bvhaccel->bvh.size() << " nodes and " << bvhaccel->triangles.size() << " triangle references" << std::endl;
+		sceneVertices = bvhaccel->vertices;
+		sceneTriangles = bvhaccel->triangles;
+		sceneNodes = bvhaccel->bvh;
+
+		TriangleLightsOutput(bvhaccel->triangles);
+	}
+	std::cout << "Load " << lights.size() << " lights" << std::endl;
+	if (REPORT_BVH_STATS) {
+		const int statsWidth = SCREEN_WIDTH / 4, statsHeight = SCREEN_HEIGHT / 4;
+		if (USE_INSTANCING) {
+			// BLAS在模型空间中，使用第一个引用它的实例把相机光线变换到模型空间
+			for (int b = 0; b < tlas->blases.size(); ++b) {
+				std::cout << "BLAS " << b << " ";
+				PrintBVHStats(std::cout, ComputeBVHStats(*tlas->blases[b]));
+				for (const auto& instance : tlas->instances) {
+					if (instance.blasId != b) continue;
+					PrintBVHRayStats(std::cout, MeasureBVHRays(*tlas->blases[b], camera, statsWidth, statsHeight, instance.worldToObject));
+					break;
+				}
+			}
+		} else {
+			PrintBVHStats(std::cout, ComputeBVHStats(*bvhaccel));
+			PrintBVHRayStats(std::cout, MeasureBVHRays(*bvhaccel, camera, statsWidth, statsHeight));
+		}
+	}
+
+	if (batch.enabled) {
+		HDRImage hdrImage;
+		if (!batch.noHDR) hdrImage.Load(batch.hdr.empty() ? hdrPath : batch.hdr.c_str());
+		CPURenderSetting renderSetting;
+		renderSetting.width = batch.width;
+		renderSetting.height = batch.height;
+		renderSetting.maxBounce = batch.maxBounce;
+		renderSetting.clampSample = batch.clampSample;
+		renderSetting.packetTracing = batch.packet;
+		renderSetting.streamTracing = batch.stream;
+		renderSetting.occlusionCache = batch.occlusionCache;
+		CPURenderer renderer(sceneVertices, sceneTriangles, bvhaccel.get(), tlas.get(), &hdrImage, renderSetting);
+		return RenderBatch(renderer, camera, batch) ? 0 : 1;
+	}
+
 	WindowInit();
 
 	glfwSetMouseButtonCallback(window, MouseButtonCallback);
 	glfwSetCursorPosCallback(window, CursorPosCallback);
 	glfwSetScrollCallback(window, ScrollCallback);
 
-	// 
-	CornellBox();
-	//SceneFlat();
-	//teapot();
-	// ģ
-	ModelOutput(models);
-	std::cout << "Load " << vertices.size() << " vertices and " << triangles.size() << " triangles" << std::endl;
-
 	std::unique_ptr<ImGuiLayer> gui(new ImGuiLayer(window));
 	gui->updateModel(models);
 
-	// bvhȡbvhṹԼźĶ
-	auto c1 = clock();
-	auto bvhaccel = std::make_shared<BVH>(std::move(vertices), std::move(triangles));
-	auto c2 = clock();
-	std::cout << "Build BVH completed, cost: " << c2 - c1 << " ms" << std::endl;
-
-	// źѰԷ뵽lights
-	for (int i = 0; i < bvhaccel->triangles.size(); ++i) {
-		const Triangle& tri = bvhaccel->triangles[i];
-		if (materials[tri.materialId].emssive != glm::vec3(0)) {
-			lights.push_back({ i, tri.area });
-			if (lights.size() > 1) {
-				lights[lights.size() - 1].prefixArea += lights[lights.size() - 2].prefixArea;
-			}
-		}
+	std::vector<std::string> shaderDefines;
+	if (USE_INSTANCING) shaderDefines.push_back("USE_INSTANCING");
+	if (USE_OCCLUSION_CACHE) shaderDefines.push_back("USE_OCCLUSION_CACHE");
+	if (bvhSetting.orderedTraversal) shaderDefines.push_back("USE_ORDERED_TRAVERSAL");
+	if (USE_SHORT_STACK) {
+		// trail的位数限制了树的深度，更深的树使用完整的栈
+		int maxDepth = CompressedBVH::MaxDepth(sceneNodes);
+		if (maxDepth <= COMPRESSED_TRAIL_MAX_DEPTH) shaderDefines.push_back("USE_SHORT_STACK");
+		else std::cout << "BVH depth " << maxDepth << " exceeds the short stack limit, using the full stack" << std::endl;
 	}
-	std::cout << "Load " << lights.size() << " lights" << std::endl;
-
-	ComputeShader cs("./shaders/ray_tracing.comp");
+	ComputeShader cs("./shaders/ray_tracing.comp", shaderDefines);
 	VFShader render("./shaders/render.vert", "./shaders/render.frag");
 
 	cs.use();
@@ -391,50 +640,46 @@ int main() {
 	cs.setInt("lightsSize", lights.size());
 	cs.setFloat("lightsSumArea", lights.empty() ? 0 : lights[lights.size() - 1].prefixArea);
 
-	c1 = clock();
+	auto c1 = clock();
 
-	// HDR
-	//LoadHDRImage("./HDR/clarens_midday_2k.hdr", cs);
-	LoadHDRImage("./HDR/vignaioli_night_1k.hdr", cs);
+	// 加载HDR
+	HDRImage hdrImage;
+	hdrImage.Load(hdrPath);
+	LoadHDRImage(hdrImage, cs);
 
-	// ݴŵв䵽ɫ
+	// 将数据存放到缓冲纹理中并传输到着色器中
 
-	// 
-	unsigned int tbo[5], tex[5];
-	glGenBuffers(5, tbo);
-	glGenTextures(5, tex);
+	// 创建缓冲区对象和纹理对象
+	unsigned int tbo[6], tex[6];
+	glGenBuffers(6, tbo);
+	glGenTextures(6, tex);
 
 	gui->materialTex = tex[1];
 	
-	std::vector<float> vertexBuffer; // 
-	vertexBuffer.resize(VERTEX_SIZE * bvhaccel->vertices.size());
-	int num = 0;
-	for (const auto& vertex : bvhaccel->vertices) { // ˳ɫжȡ˳һ
-		vertexBuffer[num++] = vertex.position[0];
-		vertexBuffer[num++] = vertex.position[1];
-		vertexBuffer[num++] = vertex.position[2];
-		vertexBuffer[num++] = vertex.normal[0];
-		vertexBuffer[num++] = vertex.normal[1];
-		vertexBuffer[num++] = vertex.normal[2];
-		vertexBuffer[num++] = vertex.tangent[0];
-		vertexBuffer[num++] = vertex.tangent[1];
-		vertexBuffer[num++] = vertex.tangent[2];
-		vertexBuffer[num++] = vertex.bitangent[0];
-		vertexBuffer[num++] = vertex.bitangent[1];
-		vertexBuffer[num++] = vertex.bitangent[2];
-		vertexBuffer[num++] = vertex.texcoord[0];
-		vertexBuffer[num++] = vertex.texcoord[1];
-		vertexBuffer[num++] = 0.f; // ֤12ֽڶ
+	// 上传的数据，从场景缓存启动时直接指向缓存文件的映射
+	Span<float> vertexSpan, triangleSpan, lightSpan;
+	Span<uint32_t> bvhnodeSpan;
+
+	std::vector<float> vertexBuffer; // 顶点
+	if (warmStart) {
+		vertexSpan = sceneCache.Get<float>(SceneCacheSection::VertexBuffer);
+	} else {
+		vertexBuffer.resize(VERTEX_SIZE * sceneVertices.size());
+		for (int i = 0; i < sceneVertices.size(); ++i) { // 加载顺序与计算着色器中读取顺序一致
+			PackVertex(sceneVertices[i], &vertexBuffer[VERTEX_SIZE * i]);
+		}
+		vertexSpan = vertexBuffer;
 	}
-	glBindBuffer(GL_TEXTURE_BUFFER, tbo[0]); // 󶨻
-	glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * VERTEX_SIZE * bvhaccel->vertices.size(), &vertexBuffer[0], GL_STATIC_DRAW); // 
+	glBindBuffer(GL_TEXTURE_BUFFER, tbo[0]); // 绑定缓冲区
+	// 移动模型时会更新部分顶点
+	glBufferData(GL_TEXTURE_BUFFER, vertexSpan.Bytes(), vertexSpan.data, GL_DYNAMIC_DRAW); // 向纹理填充数据
 	glActiveTexture(GL_TEXTURE0 + 0);
-	glBindTexture(GL_TEXTURE_BUFFER, tex[0]); // 
-	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, tbo[0]); // tboеݹtexture buffer
+	glBindTexture(GL_TEXTURE_BUFFER, tex[0]); // 绑定纹理
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, tbo[0]); // 将tbo中的数据关联到texture buffer
 
-	std::vector<float> materialBuffer; // 
+	std::vector<float> materialBuffer; // 材质
 	materialBuffer.resize(MATERIAL_SIZE * materials.size());
-	num = 0;
+	int num = 0;
 	for (const auto& material : materials) {
 		materialBuffer[num++] = material.emssive[0];
 		materialBuffer[num++] = material.emssive[1];
@@ -464,66 +709,132 @@ int main() {
 	glGenerateMipmap(GL_TEXTURE_1D);
 	std::cout << "materialBuffer width: " << MATERIAL_SIZE * materials.size() / 3 << "\n";
 
-	std::vector<float> triangleBuffer; // 
-	triangleBuffer.resize(TRIANGLE_SIZE * bvhaccel->triangles.size());
-	num = 0;
-	for (const auto& tri : bvhaccel->triangles) {
-		triangleBuffer[num++] = (float)tri.indices[0];
-		triangleBuffer[num++] = (float)tri.indices[1];
-		triangleBuffer[num++] = (float)tri.indices[2];
-		triangleBuffer[num++] = (float)tri.materialId;
-		triangleBuffer[num++] = (float)tri.textureId;
-		triangleBuffer[num++] = tri.area;
+	std::vector<float> triangleBuffer; // 三角形
+	if (warmStart) {
+		triangleSpan = sceneCache.Get<float>(SceneCacheSection::TriangleBuffer);
+	} else {
+		triangleBuffer.resize(TRIANGLE_SIZE * sceneTriangles.size());
+		num = 0;
+		for (const auto& tri : sceneTriangles) {
+			triangleBuffer[num++] = (float)tri.indices[0];
+			triangleBuffer[num++] = (float)tri.indices[1];
+			triangleBuffer[num++] = (float)tri.indices[2];
+			triangleBuffer[num++] = (float)tri.materialId;
+			triangleBuffer[num++] = (float)tri.textureId;
+			triangleBuffer[num++] = tri.area;
+		}
+		triangleSpan = triangleBuffer;
 	}
 	glBindBuffer(GL_TEXTURE_BUFFER, tbo[2]);
-	glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * TRIANGLE_SIZE * bvhaccel->triangles.size(), &triangleBuffer[0], GL_STATIC_DRAW);
+	glBufferData(GL_TEXTURE_BUFFER, triangleSpan.Bytes(), triangleSpan.data, GL_STATIC_DRAW);
 	glActiveTexture(GL_TEXTURE0 + 2);
 	glBindTexture(GL_TEXTURE_BUFFER, tex[2]);
 	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, tbo[2]);
-	std::cout << "triangleBuffer width: " << TRIANGLE_SIZE * bvhaccel->triangles.size() / 3 << "\n";
-
-	std::vector<float> bvhnodeBuffer; // bvh
-	bvhnodeBuffer.resize(BVHNODE_SIZE * bvhaccel->bvh.size());
-	num = 0;
-	for (const auto& node : bvhaccel->bvh) {
-		bvhnodeBuffer[num++] = node.bound.pMin[0];
-		bvhnodeBuffer[num++] = node.bound.pMin[1];
-		bvhnodeBuffer[num++] = node.bound.pMin[2];
-		bvhnodeBuffer[num++] = node.bound.pMax[0];
-		bvhnodeBuffer[num++] = node.bound.pMax[1];
-		bvhnodeBuffer[num++] = node.bound.pMax[2];
-		bvhnodeBuffer[num++] = (float)node.axis;
-		bvhnodeBuffer[num++] = (float)node.rightChild;
-		bvhnodeBuffer[num++] = (float)node.startIndex;
-		bvhnodeBuffer[num++] = (float)node.endIndex;
-		bvhnodeBuffer[num++] = 0.f;
-		bvhnodeBuffer[num++] = 0.f;
+	std::cout << "triangleBuffer width: " << TRIANGLE_SIZE * sceneTriangles.size() / 3 << "\n";
+
+	// bvh结点压缩后上传，顶层BVH与每个BLAS分别编码
+	CompressedBVH compressedBVH;
+	std::vector<int> bvhRoots = { 0 };
+	if (USE_INSTANCING) bvhRoots.insert(bvhRoots.end(), tlas->blasNodeOffset.begin(), tlas->blasNodeOffset.end());
+	if (warmStart) {
+		// 只重新计算节点位置，编码后的数据直接从缓存上传，CPU中保留一份用于移动模型后的局部更新
+		bvhnodeSpan = sceneCache.Get<uint32_t>(SceneCacheSection::BVHNodeBuffer);
+		if (!compressedBVH.Assign(sceneNodes, bvhRoots, bvhnodeSpan.data, bvhnodeSpan.size)) {
+			compressedBVH.Build(sceneNodes, bvhRoots);
+			bvhnodeSpan = compressedBVH.data;
+		}
+	} else {
+		compressedBVH.Build(sceneNodes, bvhRoots);
+		bvhnodeSpan = compressedBVH.data;
 	}
 	glBindBuffer(GL_TEXTURE_BUFFER, tbo[3]);
-	glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * BVHNODE_SIZE * bvhaccel->bvh.size(), &bvhnodeBuffer[0], GL_STATIC_DRAW);
+	glBufferData(GL_TEXTURE_BUFFER, bvhnodeSpan.Bytes(), bvhnodeSpan.data, GL_DYNAMIC_DRAW);
 	glActiveTexture(GL_TEXTURE0 + 3);
 	glBindTexture(GL_TEXTURE_BUFFER, tex[3]);
-	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, tbo[3]);
-	std::cout << "bvhnodeBuffer width: " << BVHNODE_SIZE * bvhaccel->bvh.size() / 3 << "\n";
-
-	if (lights.size()) {
-		std::vector<float> lightBuffer; // ƹ
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, tbo[3]);
+	std::cout << "bvhnodeBuffer width: " << compressedBVH.data.size() / 4 << ", " << sizeof(uint32_t) * compressedBVH.data.size()
+		<< " bytes (uncompressed " << sizeof(float) * 12 * sceneNodes.size() << " bytes)\n";
+
+	std::vector<float> lightBuffer; // 灯光
+	if (warmStart) {
+		lightSpan = sceneCache.Get<float>(SceneCacheSection::LightBuffer);
+	} else {
 		lightBuffer.resize(LIGHT_SIZE * lights.size());
 		num = 0;
 		for (const auto& l : lights) {
 			lightBuffer[num++] = (float)l.index;
 			lightBuffer[num++] = l.prefixArea;
-			lightBuffer[num++] = 0.f;
+			lightBuffer[num++] = (float)l.instanceId;
 		}
+		lightSpan = lightBuffer;
+	}
+	if (lights.size()) {
 		glBindBuffer(GL_TEXTURE_BUFFER, tbo[4]);
-		glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * LIGHT_SIZE * lights.size(), &lightBuffer[0], GL_STATIC_DRAW);
+		glBufferData(GL_TEXTURE_BUFFER, lightSpan.Bytes(), lightSpan.data, GL_STATIC_DRAW);
 		glActiveTexture(GL_TEXTURE0 + 4);
 		glBindTexture(GL_TEXTURE_BUFFER, tex[4]);
 		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, tbo[4]);
 		std::cout << "lightBuffer width: " << LIGHT_SIZE * lights.size() / 3 << "\n";
 	}
 
-	// ɲ
+	if (USE_INSTANCING) {
+		std::vector<float> instanceBuffer; // 实例
+		instanceBuffer.resize(INSTANCE_SIZE * tlas->instances.size());
+		for (int i = 0; i < tlas->instances.size(); ++i) {
+			const Instance& instance = tlas->instances[i];
+			PackInstance(instance, compressedBVH.recordOffset[tlas->blasNodeOffset[instance.blasId]], &instanceBuffer[INSTANCE_SIZE * i]);
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, tbo[5]);
+		// 移动模型时会更新实例的变换
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * instanceBuffer.size(), instanceBuffer.data(), GL_DYNAMIC_DRAW);
+		glActiveTexture(GL_TEXTURE0 + 25); // 5~24为物体纹理
+		glBindTexture(GL_TEXTURE_BUFFER, tex[5]);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, tbo[5]);
+		std::cout << "instanceBuffer width: " << INSTANCE_SIZE * tlas->instances.size() / 3 << "\n";
+	}
+
+	// 冷启动时把构建结果写入场景缓存，热启动时数据已经上传，不再需要映射
+	if (!warmStart) {
+		SceneCacheWriter writer;
+		writer.Add(SceneCacheSection::VertexBuffer, vertexSpan);
+		writer.Add(SceneCacheSection::TriangleBuffer, triangleSpan);
+		writer.Add(SceneCacheSection::BVHNodeBuffer, bvhnodeSpan);
+		writer.Add(SceneCacheSection::LightBuffer, lightSpan);
+		writer.Add(SceneCacheSection::Vertices, Span<Vertex>(sceneVertices));
+		writer.Add(SceneCacheSection::Triangles, Span<Triangle>(sceneTriangles));
+		writer.Add(SceneCacheSection::Nodes, Span<BVHNode>(sceneNodes));
+		writer.Add(SceneCacheSection::Lights, Span<Light>(lights));
+		std::vector<int> blasRanges, instanceBLAS, modelRanges;
+		if (USE_INSTANCING) {
+			for (int b = 0; b < tlas->blases.size(); ++b) {
+				blasRanges.push_back(tlas->blasNodeOffset[b]);
+				blasRanges.push_back(tlas->blasTriangleOffset[b]);
+				blasRanges.push_back(tlas->blasVertexOffset[b]);
+			}
+			for (const auto& instance : tlas->instances) instanceBLAS.push_back(instance.blasId);
+		} else {
+			for (const auto& model : models) {
+				modelRanges.push_back(model.vertexOffset);
+				modelRanges.push_back(model.vertexCount);
+			}
+		}
+		writer.Add(SceneCacheSection::BLASRanges, Span<int>(blasRanges));
+		writer.Add(SceneCacheSection::InstanceBLAS, Span<int>(instanceBLAS));
+		writer.Add(SceneCacheSection::ModelRanges, Span<int>(modelRanges));
+		writer.AddStrings(SceneCacheSection::TexturePaths, texturePaths);
+		std::vector<std::string> dependencies = SceneDependencies(models);
+		uint64_t dependencyKey = SceneDependencyKey(dependencies);
+		writer.AddStrings(SceneCacheSection::Dependencies, dependencies);
+		writer.Add(SceneCacheSection::DependencyKey, Span<uint64_t>(&dependencyKey, 1));
+		if (writer.Save(sceneCachePath, sceneCacheKey)) {
+			std::cout << "Write scene cache to " << sceneCachePath << std::endl;
+		} else {
+			std::cout << "Cannot write scene cache to " << sceneCachePath << std::endl;
+		}
+	}
+	sceneCache.Close();
+
+	// 生成并载入物体的纹理
 	for (int i = 0; i < textureInfos.size(); ++i) {
 		int width = textureInfos[i].width;
 		int height = textureInfos[i].height;
@@ -536,7 +847,7 @@ int main() {
 
 		unsigned int texture;
 		glGenTextures(1, &texture);
-		glActiveTexture(GL_TEXTURE5 + i); // 0, 1, 2, 3, 4ѱռ
+		glActiveTexture(GL_TEXTURE5 + i); // 0, 1, 2, 3, 4已被占用
 		glBindTexture(GL_TEXTURE_2D, texture);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -547,23 +858,23 @@ int main() {
 		textureInfos[i].tbo = texture;
 	}
 
-	// ɫеtextures[]λ
+	// 给计算着色器中所有的textures[]绑定位置
 	for (int i = 0; i < 20; ++i) { 
 		std::string name = "textures[" + std::to_string(i) + "]";
 		cs.setInt(name.c_str(), i + 5);
 	}
 
-	unsigned int outputImage; // ɫͼ
+	unsigned int outputImage; // 计算着色器输出图像
 	glCreateTextures(GL_TEXTURE_2D, 1, &outputImage);
 	glTextureStorage2D(outputImage, 1, GL_RGBA32F, SCREEN_WIDTH, SCREEN_HEIGHT);
 	glBindImageTexture(0, outputImage, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
-	unsigned int debugtbo; // û
+	unsigned int debugtbo; // 调试输出用缓存区
 	glCreateBuffers(1, &debugtbo);
 	glNamedBufferStorage(debugtbo, 1024, NULL, GL_MAP_READ_BIT);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, debugtbo);
 		
-	c2 = clock();
+	auto c2 = clock();
 	std::cout << "Loading data to shaders costs: " << c2 - c1 << "ms" << std::endl;
 
 	const unsigned int WORK_BLOCK_SIZE = 32;
@@ -589,7 +900,16 @@ int main() {
 		bool redraw = false;
 
 		ImGui::Begin("Settings");
-		if (gui->showModelSettingCombo() || mouseButtonPress || mouseScroll) {
+		bool materialChanged = gui->showModelSettingCombo();
+		bool modelMoved = gui->showModelTransform(models);
+		if (modelMoved) {
+			if (USE_INSTANCING) {
+				UpdateInstance(gui->currentModelId, models[gui->currentModelId], *tlas, compressedBVH, tbo[3], tbo[5]);
+			} else {
+				UpdateModel(models[gui->currentModelId], *bvhaccel, compressedBVH, tbo[0], tbo[3]);
+			}
+		}
+		if (materialChanged || modelMoved || mouseButtonPress || mouseScroll) {
 			cs.setInt("MAX_BOUNCE_DEPTH", 1);
 			cs.setInt("redraw", 1);
 			frameCount = 0;